@@ -0,0 +1,381 @@
+#include "bf_backend.h"
+#include "bf_lexer.h"
+#include "bf_opt.h"
+#include "bf_source.h"
+#include "bf_tape.h"
+#include "microasm.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ptrace.h>
+#endif
+
+// NOTE: bjit-bench compiles every program that has a golden output in the
+// golden directory, then runs it in a child process with <name>.in (if
+// there is one) on stdin. Compile times are taken in process, run times by
+// the child around the call into the code only, so neither includes process
+// startup. Every run's output is compared with <name>.out.
+
+#define BENCH_DEFAULT_RUNS (10)
+#define BENCH_MAX_PROGRAMS (256)
+
+typedef struct {
+  char name[64];
+  bool ok;           // Every run matched the golden output
+  double compile[2]; // Median and p95, in seconds
+  double run[2];
+  size_t code_bytes;
+  long syscalls; // Made by the code in one run, -1 if they can't be counted
+} bench_result;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Median and nearest-rank 95th percentile, sorts the samples
+static void summarize(double *samples, uint32_t n, double out[2]) {
+  qsort(samples, n, sizeof(double), compare_doubles);
+  out[0] = n % 2 ? samples[n / 2]
+                 : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+  uint32_t rank = (uint32_t)((n * 95 + 99) / 100);
+  out[1] = samples[rank - 1];
+}
+
+// *guard is the guard size the code's tape needs, see tape_guard_size
+static microasm bench_compile(bf_source *src, size_t *guard) {
+  const char *error;
+  TokenList tokens = tokenize_bf(src->data, src->len, &error, NULL);
+  if (tokens.data == NULL) {
+    printf("%s\n", error);
+    exit(-1);
+  }
+  optimize_bf(&tokens, NULL);
+  *guard = tape_guard_size(opt_max_reach(&tokens), 1);
+
+  microasm bin = asm_init(code_size_estimate(&tokens));
+  if (TARGET_HOST == TARGET_X86_64) {
+    error = compile_bf_x86_64(&tokens, &bin, 1, NULL, NULL, NULL);
+  } else {
+    error = compile_bf_arm64(&tokens, &bin, false, 1, NULL, NULL, NULL);
+  }
+  if (error != NULL) {
+    printf("%s\n", error);
+    exit(-1);
+  }
+
+  tokens_free(&tokens);
+  return bin;
+}
+
+// Runs the code in the calling process with in_fd as stdin and out_fd as
+// stdout, returns how long the code took. Only called in a child.
+static double bench_child_run(bf_native_fn code, size_t guard, int in_fd,
+                              int out_fd, bool traced) {
+  dup2(in_fd, STDIN_FILENO);
+  dup2(out_fd, STDOUT_FILENO);
+
+  bf_tape tape;
+  if (!tape_init(&tape, 0, 1, guard)) {
+    _exit(2);
+  }
+
+#ifdef __linux__
+  // The tracer counts the syscalls from here on
+  if (traced) {
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    kill(getpid(), SIGSTOP);
+  }
+#endif
+
+  double start = now_seconds();
+  uint8_t *cell = code(tape.origin, tape.origin, tape.origin + BF_TAPE_SIZE,
+                       BF_STDIO_FDS);
+  double elapsed = now_seconds() - start;
+
+  if (cell == NULL) {
+    _exit(3);
+  }
+  return elapsed;
+}
+
+static int open_input(const char *path) {
+  int fd = open(path, O_RDONLY);
+  return fd >= 0 ? fd : open("/dev/null", O_RDONLY);
+}
+
+// One run of the code, false if it crashed or the output differs from
+// golden. The child writes its run time to *elapsed.
+static bool bench_run(bf_native_fn code, size_t guard, const char *in_path,
+                      bf_source *golden, double *elapsed) {
+  FILE *out = tmpfile();
+  int in_fd = open_input(in_path);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    *elapsed = bench_child_run(code, guard, in_fd, fileno(out), false);
+    _exit(0);
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  close(in_fd);
+
+  bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+  if (ok) {
+    fseek(out, 0, SEEK_END);
+    long size = ftell(out);
+    ok = size == (long)golden->len;
+    if (ok && size > 0) {
+      char *data = malloc(size);
+      rewind(out);
+      ok = fread(data, 1, size, out) == (size_t)size &&
+           memcmp(data, golden->data, size) == 0;
+      free(data);
+    }
+  }
+
+  fclose(out);
+  return ok;
+}
+
+// Syscalls the code makes in one run, counted with ptrace in a separate
+// run that isn't timed. The exit_group of the child isn't counted.
+static long bench_syscalls(bf_native_fn code, size_t guard,
+                           const char *in_path) {
+#ifdef __linux__
+  int in_fd = open_input(in_path);
+  int out_fd = open("/dev/null", O_WRONLY);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    bench_child_run(code, guard, in_fd, out_fd, true);
+    _exit(0);
+  }
+
+  close(in_fd);
+  close(out_fd);
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFSTOPPED(status) ||
+      ptrace(PTRACE_SETOPTIONS, pid, NULL,
+             PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) != 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    return -1;
+  }
+
+  // Entry and exit stops alternate, the exit_group has no exit stop
+  long stops = 0;
+  for (;;) {
+    if (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) != 0) {
+      return -1;
+    }
+    waitpid(pid, &status, 0);
+    if (WIFEXITED(status) || WIFSIGNALED(status)) {
+      break;
+    }
+    stops += WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80);
+  }
+
+  return (stops + 1) / 2 - 1;
+#else
+  (void)code;
+  (void)guard;
+  (void)in_path;
+  return -1;
+#endif
+}
+
+static bool bench_program(const char *src_dir, const char *golden_dir,
+                          const char *name, uint32_t runs,
+                          bench_result *result) {
+  char path[4096];
+  *result = (bench_result){.syscalls = -1};
+  snprintf(result->name, sizeof(result->name), "%s", name);
+
+  bf_source src, golden;
+  snprintf(path, sizeof(path), "%s/%s.bf", src_dir, name);
+  if (!source_load(path, &src)) {
+    printf("Could not open file: %s\n", path);
+    return false;
+  }
+  snprintf(path, sizeof(path), "%s/%s.out", golden_dir, name);
+  if (!source_load(path, &golden)) {
+    printf("Could not open file: %s\n", path);
+    source_free(&src);
+    return false;
+  }
+  snprintf(path, sizeof(path), "%s/%s.in", golden_dir, name);
+
+  double *samples = malloc(sizeof(double) * runs);
+
+  microasm bin = {.dest = NULL};
+  size_t guard = TAPE_GUARD_SIZE;
+  for (uint32_t i = 0; i < runs; i++) {
+    if (bin.dest != NULL) {
+      asm_free(&bin);
+    }
+    double start = now_seconds();
+    bin = bench_compile(&src, &guard);
+    samples[i] = now_seconds() - start;
+  }
+  summarize(samples, runs, result->compile);
+  result->code_bytes = bin.dest - (uint8_t *)(bin.dest_end - bin.dest_size);
+
+  bf_native_fn code = (bf_native_fn)asm_seal(&bin);
+  if (code == NULL) {
+    printf("failed to make JIT memory executable!\n");
+    exit(-1);
+  }
+
+  // The child's run time comes back through a shared page
+  double *elapsed = mmap(NULL, sizeof(double), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  result->ok = true;
+  for (uint32_t i = 0; i < runs; i++) {
+    result->ok &= bench_run(code, guard, path, &golden, elapsed);
+    samples[i] = *elapsed;
+  }
+  summarize(samples, runs, result->run);
+  munmap(elapsed, sizeof(double));
+
+  result->syscalls = bench_syscalls(code, guard, path);
+
+  free(samples);
+  asm_free(&bin);
+  source_free(&golden);
+  source_free(&src);
+  return true;
+}
+
+static int compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Names of the programs with a <name>.out in the golden directory
+static uint32_t find_programs(const char *golden_dir, char **names) {
+  DIR *dir = opendir(golden_dir);
+  if (dir == NULL) {
+    printf("Could not open directory: %s\n", golden_dir);
+    exit(-1);
+  }
+
+  uint32_t count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL && count < BENCH_MAX_PROGRAMS) {
+    size_t len = strlen(entry->d_name);
+    if (len > 4 && strcmp(entry->d_name + len - 4, ".out") == 0) {
+      names[count++] = strndup(entry->d_name, len - 4);
+    }
+  }
+  closedir(dir);
+
+  qsort(names, count, sizeof(char *), compare_names);
+  return count;
+}
+
+static void print_table(bench_result *results, uint32_t count,
+                        uint32_t runs) {
+  printf("%-18s %12s %12s %12s %12s %10s %9s  %s\n", "program",
+         "compile med", "compile p95", "run med", "run p95", "code", "syscalls",
+         "output");
+  for (uint32_t i = 0; i < count; i++) {
+    bench_result *r = &results[i];
+    printf("%-18s %10.3fms %10.3fms %10.3fms %10.3fms %9zuB %9ld  %s\n",
+           r->name, r->compile[0] * 1e3, r->compile[1] * 1e3, r->run[0] * 1e3,
+           r->run[1] * 1e3, r->code_bytes, r->syscalls,
+           r->ok ? "ok" : "MISMATCH");
+  }
+  printf("%u runs each, times from CLOCK_MONOTONIC\n", runs);
+}
+
+static void write_json(const char *path, bench_result *results,
+                       uint32_t count, uint32_t runs) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    printf("Could not open file: %s\n", path);
+    exit(-1);
+  }
+
+  fprintf(f, "{\n  \"target\": \"%s\",\n  \"runs\": %u,\n  \"programs\": [\n",
+          TARGET_HOST == TARGET_X86_64 ? "x86_64" : "arm64", runs);
+  for (uint32_t i = 0; i < count; i++) {
+    bench_result *r = &results[i];
+    fprintf(f,
+            "    {\"name\": \"%s\", \"ok\": %s, "
+            "\"compile_median_s\": %.9f, \"compile_p95_s\": %.9f, "
+            "\"run_median_s\": %.9f, \"run_p95_s\": %.9f, "
+            "\"code_bytes\": %zu, \"syscalls\": %ld}%s\n",
+            r->name, r->ok ? "true" : "false", r->compile[0], r->compile[1],
+            r->run[0], r->run[1], r->code_bytes, r->syscalls,
+            i + 1 < count ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+}
+
+int main(int argc, char **argv) {
+  uint32_t runs = BENCH_DEFAULT_RUNS;
+  char *json_path = NULL;
+  char *src_dir = NULL;
+  char *golden_dir = NULL;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      runs = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+      json_path = argv[++i];
+    } else if (src_dir == NULL) {
+      src_dir = argv[i];
+    } else {
+      golden_dir = argv[i];
+    }
+  }
+
+  if (src_dir == NULL || golden_dir == NULL || runs == 0) {
+    printf("Usage: bjit_bench [-n runs] [--json <file>] <bf_tests dir> "
+           "<golden dir>\n");
+    return -1;
+  }
+
+  char *names[BENCH_MAX_PROGRAMS];
+  uint32_t count = find_programs(golden_dir, names);
+  bench_result *results = malloc(sizeof(bench_result) * count);
+
+  bool ok = true;
+  uint32_t done = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    if (bench_program(src_dir, golden_dir, names[i], runs, &results[done])) {
+      ok &= results[done].ok;
+      done++;
+    } else {
+      ok = false;
+    }
+    free(names[i]);
+  }
+
+  print_table(results, done, runs);
+  if (json_path != NULL) {
+    write_json(json_path, results, done, runs);
+  }
+
+  free(results);
+  return ok ? 0 : 1;
+}
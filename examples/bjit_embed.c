@@ -0,0 +1,52 @@
+#include "bjit.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// NOTE: Embeds libbjit: compiles the program once, then calls it `runs`
+// times in this process, each run on a fresh tape.
+//   bjit_embed <file.bf> [runs]
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("Usage: %s <file.bf> [runs]\n", argv[0]);
+    return -1;
+  }
+  int runs = argc > 2 ? atoi(argv[2]) : 1;
+
+  FILE *f = fopen(argv[1], "rb");
+  if (f == NULL) {
+    printf("Could not open file: %s\n", argv[1]);
+    return -1;
+  }
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  char *src = malloc(len + 1);
+  size_t read = fread(src, 1, len, f);
+  fclose(f);
+
+  bjit_status status;
+  bjit_options opts = {.safe = true};
+  bjit_program *prog = bjit_compile(src, read, &opts, &status);
+  free(src);
+  if (prog == NULL) {
+    printf("%s\n", bjit_status_string(status));
+    return -1;
+  }
+
+  for (int i = 0; i < runs && status == BJIT_OK; i++) {
+    bjit_tape tape;
+    status = bjit_tape_init(&tape, prog);
+    if (status == BJIT_OK) {
+      status = bjit_run(prog, &tape, &(bjit_io){.in_fd = 0, .out_fd = 1});
+      bjit_tape_free(&tape);
+    }
+  }
+
+  bjit_free(prog);
+  if (status != BJIT_OK) {
+    printf("%s\n", bjit_status_string(status));
+    return -1;
+  }
+  return 0;
+}
@@ -1,8 +1,16 @@
+#pragma once
+
 #include <stdint.h>
 
+#define BJIT_VERSION "0.1.0" // Part of the key of cached code
+#define BF_TAPE_SIZE (30000)
+
 typedef struct bf_data {
   uint8_t *data;
-  uint32_t position;
+  uint8_t *tape;     // First cell the program may touch
+  uint8_t *tape_end; // Past the last one, only enforced in --safe mode
+  uint32_t position; // In cells
+  uint8_t cell_size; // Bytes per cell, 1, 2 or 4
   uint64_t *loop_stack;
   uint32_t loop_pos;
 } bf_data;
@@ -11,3 +19,6 @@ extern bf_data *bf;
 
 uint8_t bf_get_data(uint8_t pos);
 void bf_set_data(uint8_t pos, uint8_t value);
+
+// Reports a failed --safe check and exits
+void bf_out_of_bounds(void);
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "bf_lexer.h"
+#include "bf_perf.h"
+#include "bf_timings.h"
+#include "microasm.h"
+#include <stdbool.h>
+
+// Sizes of the I/O buffers on the stack frame of the compiled code. The last
+// 8 bytes of the input buffer hold the fds of the call, reads stop short of
+// them. The offsets are from the end of the output buffer.
+#define OUTPUT_BUF_SIZE (64 * 1024)
+#define INPUT_BUF_SIZE (64 * 1024)
+#define IO_FRAME_SIZE (OUTPUT_BUF_SIZE + INPUT_BUF_SIZE)
+#define INPUT_READ_SIZE (INPUT_BUF_SIZE - 8)
+#define IO_IN_FD_OFFSET (INPUT_BUF_SIZE - 8)
+#define IO_OUT_FD_OFFSET (INPUT_BUF_SIZE - 4)
+// The frame is reserved a page at a time and each page read, so a stack too
+// small for it faults on its guard page instead of writing past it
+#define IO_PROBE_SIZE (4096)
+
+// The fds argument of the compiled code, in_fd in the low half
+#define BF_IO_FDS(in_fd, out_fd)                                              \
+  (((uint64_t)(uint32_t)(out_fd) << 32) | (uint32_t)(in_fd))
+#define BF_STDIO_FDS (BF_IO_FDS(0, 1))
+
+typedef enum { TARGET_ARM64, TARGET_X86_64 } bf_target;
+
+#if defined(__x86_64__)
+#define TARGET_HOST (TARGET_X86_64)
+#else
+#define TARGET_HOST (TARGET_ARM64)
+#endif
+
+// Bytes of code mapped before compiling. Tokens average 10-20 bytes on both
+// backends, the I/O subroutines and prologue take the fixed part. Programs
+// that need more just grow the arena.
+#define CODE_BYTES_PER_TOKEN (16)
+#define CODE_FIXED_BYTES (1024)
+
+static inline size_t code_size_estimate(TokenList *tokens) {
+  return CODE_FIXED_BYTES + (size_t)tokens->size * CODE_BYTES_PER_TOKEN;
+}
+
+// Compiled code is called with the current cell, the bounds of the tape and
+// the fds to read and write (BF_IO_FDS), and returns the current cell when
+// it's done. A failed --safe check stops the program and returns NULL. Cells
+// are cell_size bytes wide, only their low byte is printed.
+typedef uint8_t *(*bf_native_fn)(uint8_t *cell, uint8_t *tape,
+                                 uint8_t *tape_end, uint64_t fds);
+
+// Code emission and backpatching are phases of timings. With a profile the
+// n-th loop adds 1 to profile[n] on every iteration, see bf_profile.h. The
+// code is split into regions for perf in codemap, see bf_perf.h. Returns
+// NULL, or why the code in bin can't be used: unbalanced tokens or a code
+// buffer that couldn't grow.
+const char *compile_bf_arm64(TokenList *tokens, microasm *bin, bool debug,
+                             uint8_t cell_size, uint64_t *profile,
+                             bf_codemap *codemap, bf_timings *timings);
+const char *compile_bf_x86_64(TokenList *tokens, microasm *bin,
+                              uint8_t cell_size, uint64_t *profile,
+                              bf_codemap *codemap, bf_timings *timings);
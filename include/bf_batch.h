@@ -0,0 +1,25 @@
+#pragma once
+
+#include "bf_backend.h"
+#include "bf_tape.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// NOTE: --batch compiles the program once and runs it again for every input
+// file, --batch-lines and --batch-null for every record on stdin. Every run
+// starts at cell 0 of a zeroed tape with its input on its own fd, and its
+// output is followed by the delimiter, a newline or a NUL byte. The latency
+// of each run, reset and delimiter included, is reported on stderr.
+
+typedef struct {
+  char **files;       // --batch inputs, in order
+  uint32_t file_count;
+  bool records;       // Split stdin into records instead
+  char delim;         // Ends every record and every run's output
+  bool verbose;       // A latency line per run, not just the summary
+} bf_batch;
+
+// Runs code on every input with the tape bounds tape_lo and tape_hi, returns
+// how many runs failed
+uint32_t batch_run(bf_batch *b, bf_native_fn code, bf_tape *tape,
+                   uint8_t *tape_lo, uint8_t *tape_hi);
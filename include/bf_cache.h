@@ -0,0 +1,43 @@
+#pragma once
+
+#include "bf_backend.h"
+#include "bf_source.h"
+#include "microasm.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// NOTE: --cache-dir keeps compiled programs on disk, one <key>.bjc file per
+// program. The key hashes the source, the flags that change the code, the
+// bjit version and the target. The code is position-independent: branches
+// and calls are pc-relative and the tape and I/O buffers come in registers,
+// so an entry is mapped PROT_READ | PROT_EXEC with one mmap and called as is.
+// Code with absolute addresses (--profile counters) has relocations, which
+// entries can't hold, and is never cached.
+#define CACHE_DEFAULT_MAX_BYTES ((uint64_t)64 * 1024 * 1024)
+
+typedef struct {
+  const char *dir;
+  uint64_t max_bytes; // Least recently used entries go past this
+  uint64_t key;
+} bf_cache;
+
+typedef struct {
+  uint8_t *map;
+  size_t map_size;
+  bf_native_fn code;
+  uint64_t scan_reach; // See opt_bounds_checks
+  uint64_t max_reach;  // See opt_max_reach
+} bf_cache_entry;
+
+void cache_init(bf_cache *c, const char *dir, uint64_t max_bytes,
+                bf_source *src, bf_target target, bool safe,
+                uint8_t cell_size);
+// Maps the entry for the key and counts a hit, or counts a miss
+bool cache_load(bf_cache *c, bf_cache_entry *entry);
+void cache_unmap(bf_cache_entry *entry);
+// Writes the code of bin, then evicts until the cache fits in max_bytes
+void cache_store(bf_cache *c, microasm *bin, uint64_t scan_reach,
+                 uint64_t max_reach);
+// Prints the hits, misses and size of the cache to stderr
+void cache_report(bf_cache *c);
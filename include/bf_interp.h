@@ -0,0 +1,10 @@
+#pragma once
+
+#include "bf.h"
+#include "bf_lexer.h"
+#include "bf_tier.h"
+
+// Runs the optimized tokens on bf->data without generating any machine code.
+// bf->position is left at the final cell. With a tier, hot loops are handed
+// to its compiler thread and run natively once they're ready.
+void interpret_bf(TokenList *tokens, bf_data *bf, bf_tier *tier);
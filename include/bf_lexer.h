@@ -1,5 +1,6 @@
 #pragma once
 
+#include "bf_timings.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -12,10 +13,47 @@ typedef enum token_t {
   JUMP_IF_ZERO,
   JUMP_IF_NOT_ZERO,
   PRINT,
-  INPUT
+  INPUT,
+  // Produced by the optimizer
+  SET_CELL, // Set the cell to token_data
+  MUL_CELL,   // Add the current cell times token_data to the cell at offset
+  SCAN_RIGHT, // Move right by token_data cells until the cell is 0
+  SCAN_LEFT,  // Move left by token_data cells until the cell is 0
+  // Only produced in --safe mode, see opt_bounds_checks
+  CHECK_BOUNDS,    // Stop unless cells offset..check_hi are on the tape,
+                   // token_data says which ends still need to be tested
+  CHECK_BOUNDS_IF, // Same with both ends, if the cell at (int32_t)token_data
+                   // isn't 0
+  GUARD_RANGE,     // If cells offset..check_hi are on the tape, jump past the
+                   // matching GUARD_ELSE to the unchecked copy of the code.
+                   // token_data is the ends to test like CHECK_BOUNDS
+  GUARD_ELSE,      // End of the checked copy, jump to the matching GUARD_END
+  GUARD_END
 } token_t;
 
+// CHECK_BOUNDS and GUARD_RANGE ends to test, the others are already known to
+// be on the tape
+#define BOUNDS_LO (1)
+#define BOUNDS_HI (2)
+
 typedef struct Token {
   token_t token;
-  uint32_t token_data;
+  uint32_t token_data; // Run length of the operation, source byte of a bracket
+  int32_t offset;      // Cell offset relative to the data pointer
+  union {
+    uint32_t jump;      // Index of the matching bracket token
+    int32_t src_offset; // MUL_CELL: offset of the loop cell
+    int32_t check_hi;   // CHECK_BOUNDS(_IF), GUARD_RANGE: last cell offset
+  };
 } Token;
+
+typedef struct {
+  uint32_t maxSize;
+  uint32_t size;
+  Token *data;
+} TokenList;
+
+// Unmatched brackets return no tokens (data is NULL) and set *error
+TokenList tokenize_bf(const char *src, size_t len, const char **error,
+                      bf_timings *timings);
+void tokens_free(TokenList *tokens);
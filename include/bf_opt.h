@@ -0,0 +1,16 @@
+#pragma once
+
+#include "bf_lexer.h"
+
+// Each pass is a phase of timings
+void optimize_bf(TokenList *tokens, bf_timings *timings);
+
+// Adds the CHECK_BOUNDS tokens of --safe mode, after optimize_bf. Returns how
+// far left of the tape the unchecked scans can read, those cells have to be
+// mapped and 0.
+uint32_t opt_bounds_checks(TokenList *tokens);
+
+// The most cells the pointer can get from one cell it touches to the next,
+// the guards around the tape have to be at least this big so a program that
+// leaves the tape always faults on them. After optimize_bf.
+uint64_t opt_max_reach(TokenList *tokens);
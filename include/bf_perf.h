@@ -0,0 +1,44 @@
+#pragma once
+
+#include "bf_source.h"
+#include "microasm.h"
+#include "stack.h"
+#include <stdint.h>
+
+// NOTE: --perf-map and --perf-jitdump tell perf what the JIT code is. The
+// backends split the code into regions as they emit it: the I/O subroutines,
+// the code outside of any loop (bf_main) and every loop, which is named after
+// where its '[' is, like loop@L12:C4. Regions don't overlap, the code of an
+// inner loop belongs to the inner loop only. Everything takes a NULL
+// bf_codemap and does nothing then.
+
+typedef struct {
+  uint32_t offset;  // Byte offset of the first instruction in the code
+  uint32_t src_pos; // Loops only, source byte of the '['
+  const char *name; // NULL for loops
+} codemap_region;
+
+typedef struct {
+  uint32_t count;
+  uint32_t max;
+  codemap_region *regions;
+  const char *base; // Name of the code outside of loops
+  Stack loops;      // src_pos of the loops the code is in
+} bf_codemap;
+
+void codemap_init(bf_codemap *m);
+// Code from here on is called name, until a loop starts
+void codemap_begin(bf_codemap *m, microasm *bin, const char *name);
+void codemap_loop_start(bf_codemap *m, microasm *bin, uint32_t src_pos);
+void codemap_loop_end(bf_codemap *m, microasm *bin);
+void codemap_free(bf_codemap *m);
+
+// Writes /tmp/perf-<pid>.map for the sealed code at code, code_size bytes
+void perf_write_map(bf_codemap *m, uint8_t *code, size_t code_size,
+                    bf_source *src);
+// Writes /tmp/jit-<pid>.dump with a code load, and the line of the region in
+// src_path, for every region. The file stays mapped so perf record sees it,
+// `perf inject --jit` turns the samples into symbols.
+void perf_write_jitdump(bf_codemap *m, uint8_t *code, size_t code_size,
+                        bf_source *src, const char *src_path,
+                        uint16_t machine);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "bf_lexer.h"
+#include "bf_source.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// NOTE: --profile counts the iterations of every loop the optimizer left as
+// a loop. The backends add 1 to the loop's counter at the top of its body, so
+// a loop entered once that runs 10 times counts 10. Loops turned into
+// SET_CELL, MUL_CELL or a scan run in a handful of instructions and aren't
+// counted.
+#define PROFILE_DEFAULT_TOP (10)
+#define PROFILE_TEXT_MAX (40) // Longer loops are cut off with "..."
+
+typedef struct {
+  uint32_t count;   // Loops, the n-th '[' of the tokens counts in counts[n]
+  uint64_t *counts; // Written by the compiled code
+  uint32_t *starts; // Source bytes of each loop's '[' and ']'
+  uint32_t *ends;
+} bf_profile;
+
+void profile_init(bf_profile *p, TokenList *tokens);
+// Prints the top loops by iteration count to stderr. The same source loop can
+// be compiled more than once (--safe guards), those are added up.
+void profile_report(bf_profile *p, bf_source *src, uint32_t top);
+void profile_free(bf_profile *p);
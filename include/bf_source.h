@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+  const char *data;
+  size_t len;
+  bool mapped; // true if `data` is a mmap of the file, false if malloc'd
+} bf_source;
+
+bool source_load(const char *path, bf_source *src);
+void source_free(bf_source *src);
+// 1-based line and column (in bytes) of the byte at pos
+void source_locate(bf_source *src, size_t pos, uint32_t *line, uint32_t *col);
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "bf.h"
+#include "microasm.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// NOTE: The tape is one PROT_NONE reservation with guard pages at both
+// ends. Cell 0 sits `start` cells (rounded up to pages) after the left
+// guard so programs can move left of it. The right side starts at
+// TAPE_INITIAL_SIZE cells and grows from the SIGSEGV handler, a page
+// the kernel hasn't touched yet is just the shared zero page. The sizes are
+// in cells, the mapping scales them by the cell size. The guards are in
+// bytes, at least TAPE_GUARD_SIZE and more for programs that can jump
+// further than that in one step, see tape_guard_size.
+#define TAPE_GUARD_SIZE (64 * 1024)
+#define TAPE_INITIAL_SIZE (64 * 1024)  // Cells right of cell 0, >= BF_TAPE_SIZE
+#define TAPE_MAX_SIZE ((size_t)1 << 30) // The right side never grows past this
+
+typedef struct {
+  uint8_t *map;      // Start of the reservation, the left guard
+  size_t map_size;
+  uint8_t *origin;   // Cell 0
+  size_t start;      // Bytes left of cell 0 that are usable
+  size_t committed;  // Bytes right of cell 0 that are RW
+  uint8_t cell_size; // Bytes per cell
+} bf_tape;
+
+// Maps the tape and installs the SIGSEGV handler, there's one active tape
+bool tape_init(bf_tape *tape, size_t start, uint8_t cell_size, size_t guard);
+void tape_free(bf_tape *tape);
+// Output the interpreter has buffered in [out, *out_pos), written to stdout
+// if the run faults on the tape. Native code's buffer is found without this.
+// NULL when the buffer goes away.
+void tape_watch_output(uint8_t *out, uint8_t *volatile *out_pos);
+// Zeroes the tape for the next run and shrinks it back to its initial size
+bool tape_reset(bf_tape *tape);
+
+// Cells right of cell 0 a program may touch, --safe mode holds it to the
+// classic BF_TAPE_SIZE
+static inline size_t tape_limit(bool safe) {
+  return safe ? BF_TAPE_SIZE : TAPE_MAX_SIZE;
+}
+
+static inline size_t tape_page_round(size_t size) {
+  size_t page = ASM_PAGE_SIZE;
+  return (size + page - 1) & ~(page - 1);
+}
+
+// Guard bytes for a program with opt_max_reach `reach`, any access it makes
+// past the end of the tape lands in a guard instead of skipping over it
+static inline size_t tape_guard_size(uint64_t reach, uint8_t cell_size) {
+  size_t guard = tape_page_round((reach + 1) * cell_size);
+  return guard > TAPE_GUARD_SIZE ? guard : TAPE_GUARD_SIZE;
+}
+
+// Same layout for the startup stub of an executable and for libbjit. The
+// stub commits the left side and TAPE_INITIAL_SIZE cells and grows the rest
+// from its SIGSEGV handler, libbjit can't grow the tape so the whole right
+// side is RW from the start. `left` cells are mapped left of cell 0, the
+// program may use `start` of them.
+static inline asm_tape_layout tape_aot_layout(size_t left, size_t start,
+                                              bool safe, uint8_t cell_size,
+                                              size_t guard) {
+  left = tape_page_round(left * cell_size);
+  size_t origin = guard + left;
+  size_t max_size = TAPE_MAX_SIZE * cell_size;
+
+  return (asm_tape_layout){
+      .map_size = guard + left + max_size + guard,
+      .rw_offset = guard,
+      .rw_size = left + max_size,
+      .commit_size = left + TAPE_INITIAL_SIZE * cell_size,
+      .origin_offset = origin,
+      .tape_offset = origin - start * cell_size,
+      .end_offset = origin + tape_limit(safe) * cell_size};
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include "bf_backend.h"
+#include "bf_lexer.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Back-edges a loop takes in the interpreter before it gets compiled
+#ifndef TIER_HOT_LOOP
+#define TIER_HOT_LOOP (1000)
+#endif
+
+typedef struct {
+  uint32_t lpos;       // Token index of the '['
+  bool compilable;     // No ',' inside, the input buffer is the interpreter's
+  bool queued;         // Only touched by the interpreter thread
+  uint32_t backedges;  // Only touched by the interpreter thread
+  microasm code;       // Only touched by the compiler thread until it's joined
+  _Atomic(bf_native_fn) native; // Published once the code is ready
+} tier_loop;
+
+// NOTE: Loops are numbered by the order of their '[' in the tokens, the
+// interpreter numbers them the same way when it translates the tokens
+typedef struct {
+  TokenList *tokens;
+  uint8_t cell_size;
+  tier_loop *loops;
+  uint32_t loop_count;
+
+  // Loops waiting for the compiler thread, each one is queued at most once
+  uint32_t *queue;
+  uint32_t queue_head;
+  uint32_t queue_tail;
+  bool stopping;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+
+  _Atomic uint32_t compiled;
+} bf_tier;
+
+void tier_start(bf_tier *tier, TokenList *tokens, uint8_t cell_size);
+void tier_request(bf_tier *tier, uint32_t loop);
+void tier_stop(bf_tier *tier);
+
+// Native code for the loop, or NULL if it isn't compiled (yet)
+static inline bf_native_fn tier_native(bf_tier *tier, uint32_t loop) {
+  bf_native_fn native =
+      atomic_load_explicit(&tier->loops[loop].native, memory_order_acquire);
+#if defined(__aarch64__)
+  // The code was written by another core, drop anything fetched before
+  if (native != NULL) {
+    __asm__ volatile("isb" ::: "memory");
+  }
+#endif
+  return native;
+}
+
+static inline void tier_backedge(bf_tier *tier, uint32_t loop) {
+  if (++tier->loops[loop].backedges == TIER_HOT_LOOP) {
+    tier_request(tier, loop);
+  }
+}
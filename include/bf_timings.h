@@ -0,0 +1,40 @@
+#pragma once
+
+#include "stack.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// NOTE: -t/--timings splits a run of bjit into phases. Each phase gets the
+// wall (CLOCK_MONOTONIC) and CPU (CLOCK_PROCESS_CPUTIME_ID) time since the
+// previous one ended, so they add up to the whole run. Everything takes a
+// NULL bf_timings and does nothing then.
+#define TIMINGS_MAX_PHASES (32)
+
+typedef struct {
+  const char *name;
+  double wall;
+  double cpu;
+} timing_phase;
+
+typedef struct {
+  timing_phase phases[TIMINGS_MAX_PHASES];
+  uint32_t count;
+  double wall_mark;
+  double cpu_mark;
+
+  // Bytes the compiler's own structures grew to
+  size_t token_bytes; // TokenList
+  size_t stack_bytes; // Stacks of the lexer and the backend
+  size_t loop_bytes;  // Loop position table and guard caches of the backend
+  size_t code_bytes;  // Mapped for the code buffer
+} bf_timings;
+
+void timings_start(bf_timings *t);
+// Ends the current phase, it's called name
+void timings_phase(bf_timings *t, const char *name);
+// Wall time of the phase called name, 0 if there's none
+double timings_wall(bf_timings *t, const char *name);
+// Counts the bytes a stack grew to, call it before stack_free
+void timings_stack(bf_timings *t, Stack *s);
+// Prints the phases, peak RSS and the allocated bytes to stderr
+void timings_report(bf_timings *t);
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// NOTE: libbjit compiles a program once and runs it in the calling process
+// as often as needed. Nothing is global: programs, tapes and I/O are passed
+// to every call, so several programs can be compiled and run at once from
+// different threads as long as each run has its own tape. Errors come back
+// as a bjit_status, nothing prints or exits: unmatched brackets, and code
+// buffers that can't be mapped, grown or made executable, are all statuses.
+// Two things still take the process down: a program compiled without safe
+// that leaves the tape faults on a guard page, and the compiler's own
+// malloc'd tables aren't checked for NULL. The guards are sized for the
+// program, none of its moves or offsets can skip over them.
+// A run keeps its I/O buffers on the stack, so the calling thread needs
+// about 128KB of it free (pthread stacks can be smaller). The frame is
+// touched a page at a time, a stack that's too small faults on its guard
+// page like a tape access would instead of corrupting memory below it.
+//
+//   bjit_status status;
+//   bjit_program *prog = bjit_compile(src, len, &opts, &status);
+//   bjit_tape tape;
+//   bjit_tape_init(&tape, prog);
+//   status = bjit_run(prog, &tape, &(bjit_io){.in_fd = in, .out_fd = out});
+//   bjit_tape_free(&tape);
+//   bjit_free(prog);
+
+// The library is built with hidden visibility, only this API is exported
+#define BJIT_API __attribute__((visibility("default")))
+
+typedef enum {
+  BJIT_OK,
+  BJIT_ERR_OPTIONS,       // Unsupported cell size, or a tape of another program
+  BJIT_ERR_SYNTAX,        // Unmatched brackets
+  BJIT_ERR_MEMORY,        // The code or the tape couldn't be mapped
+  BJIT_ERR_OUT_OF_BOUNDS, // A safe program left the tape and was stopped
+} bjit_status;
+
+typedef struct {
+  bool safe;          // Check every tape access, for untrusted programs
+  uint8_t cell_bits;  // 8, 16 or 32, 0 is 8
+  size_t tape_start;  // Cells left of cell 0 the program may use
+} bjit_options;
+
+typedef struct bjit_program bjit_program;
+
+// Cells of one run, the tape keeps its contents between runs
+typedef struct {
+  uint8_t *map; // The whole mapping, guard pages included
+  size_t map_size;
+  uint8_t *origin;   // Cell 0, where every run starts
+  size_t left;       // Bytes mapped left of cell 0
+  size_t guard;      // Bytes of each guard
+  uint8_t cell_size; // Bytes per cell
+} bjit_tape;
+
+// The program reads ',' from in_fd and writes '.' to out_fd
+typedef struct {
+  int in_fd;
+  int out_fd;
+} bjit_io;
+
+// Returns NULL and sets *status if the program can't be compiled, opts can
+// be NULL for the defaults
+BJIT_API bjit_program *bjit_compile(const char *buf, size_t len,
+                                    const bjit_options *opts,
+                                    bjit_status *status);
+BJIT_API void bjit_free(bjit_program *prog);
+
+// Maps a zeroed tape laid out for prog. Programs with the same cell size
+// that don't need more room left of cell 0 or bigger guards can run on it
+// too.
+BJIT_API bjit_status bjit_tape_init(bjit_tape *tape,
+                                    const bjit_program *prog);
+BJIT_API void bjit_tape_free(bjit_tape *tape);
+
+// Runs prog from cell 0 of tape, io NULL is stdin and stdout. Output is
+// flushed before it returns.
+BJIT_API bjit_status bjit_run(const bjit_program *prog, bjit_tape *tape,
+                              const bjit_io *io);
+
+BJIT_API const char *bjit_status_string(bjit_status status);
@@ -1,22 +1,69 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#define JIT_MEM_SIZE ((1024 * 1024) * 4) // 4MB
+// Code buffers are mapped and grown in whole pages
+#define ASM_PAGE_SIZE (16 * 1024) // Largest page size of Apple Silicon
+
+// Condition codes for asm_arm64_bcond
+#define ARM64_COND_EQ (0x0)
+#define ARM64_COND_NE (0x1)
+#define ARM64_COND_HS (0x2)
+#define ARM64_COND_LO (0x3)
+#define ARM64_COND_HI (0x8)
+#define ARM64_COND_LS (0x9)
+#define ARM64_COND_LE (0xD)
 
 typedef struct {
   uint8_t *dest;
   uint32_t count;
   uint64_t dest_end;
   uint32_t dest_size;
+  bool failed; // The buffer couldn't grow, the code in it is garbage
 } microasm;
 
+// Tape set up by the startup stub of asm_write_exec: map_size bytes are
+// reserved PROT_NONE, rw_size bytes at rw_offset can be made RW and cell 0
+// is at origin_offset. The stub makes the first commit_size of them RW and
+// the rest as the code touches it. The code gets the bounds at tape_offset
+// and end_offset.
+typedef struct {
+  uint64_t map_size;
+  uint64_t rw_offset;
+  uint64_t rw_size;
+  uint64_t commit_size;
+  uint64_t origin_offset;
+  uint64_t tape_offset;
+  uint64_t end_offset;
+} asm_tape_layout;
+
+microasm asm_init(size_t size);
+bool asm_try_init(microasm *a, size_t size);
+uint8_t *asm_seal(microasm *a);
+void asm_free(microasm *a);
 void asm_write(microasm *a, int n, ...);
+void asm_write_bytes(microasm *a, const uint8_t *bytes, int n);
 
-void asm_arm64_immadd(microasm *a, uint8_t rd, uint8_t rn, uint8_t imm);
+void asm_arm64_immadd(microasm *a, uint8_t rd, uint8_t rn, uint16_t imm);
+void asm_arm64_immadd_lsl12(microasm *a, uint8_t rd, uint8_t rn,
+                            uint16_t imm);
+void asm_arm64_immsub_lsl12(microasm *a, uint8_t rd, uint8_t rn,
+                            uint16_t imm);
 void asm_arm64_regadd(microasm *a, uint8_t rd, uint8_t rn, uint8_t rm,
                       uint8_t imm_shift);
-void asm_arm64_immsub(microasm *a, uint8_t rd, uint8_t rn, uint8_t imm);
+void asm_arm64_immsub(microasm *a, uint8_t rd, uint8_t rn, uint16_t imm);
+void asm_arm64_regsub(microasm *a, uint8_t rd, uint8_t rn, uint8_t rm,
+                      uint8_t imm_shift);
+void asm_arm64_madd(microasm *a, uint8_t rd, uint8_t rn, uint8_t rm,
+                    uint8_t ra);
 void asm_arm64_regldrb(microasm *a, uint8_t rt, uint8_t rn);
 void asm_arm64_regstrb(microasm *a, uint8_t rt, uint8_t rn);
+void asm_arm64_immldrb(microasm *a, uint8_t rt, uint8_t rn, uint16_t imm);
+void asm_arm64_immstrb(microasm *a, uint8_t rt, uint8_t rn, uint16_t imm);
+void asm_arm64_ldurb(microasm *a, uint8_t rt, uint8_t rn, int16_t imm);
+void asm_arm64_sturb(microasm *a, uint8_t rt, uint8_t rn, int16_t imm);
 void asm_arm64_regldr(microasm *a, uint8_t rt, uint8_t rn);
 void asm_arm64_regstr(microasm *a, uint8_t rt, uint8_t rn);
 void asm_arm64_immmov(microasm *a, uint8_t rn, uint16_t imm);
@@ -28,7 +75,37 @@ void asm_arm64_pcrelbranch_nz(microasm *a, uint8_t rt, uint32_t imm);
 void asm_arm64_pcrelbranch_ze(microasm *a, uint8_t rt, uint32_t imm);
 void asm_arm64_br(microasm *a, uint8_t rn);
 void asm_arm64_b(microasm *a, uint32_t imm);
+void asm_arm64_bl(microasm *a, uint32_t imm);
 void asm_arm64_getpcval(microasm *a, uint8_t rd);
+void asm_arm64_immmov64(microasm *a, uint8_t rd, uint64_t imm);
+void asm_arm64_regand(microasm *a, uint8_t rd, uint8_t rn, uint8_t rm);
+void asm_arm64_regcmp(microasm *a, uint8_t rn, uint8_t rm);
+void asm_arm64_uxtb(microasm *a, uint8_t rd, uint8_t rn);
+void asm_arm64_lsr(microasm *a, uint8_t rd, uint8_t rn, uint8_t shift);
+void asm_arm64_rbit(microasm *a, uint8_t rd, uint8_t rn);
+void asm_arm64_clz(microasm *a, uint8_t rd, uint8_t rn);
+void asm_arm64_bcond(microasm *a, uint8_t cond, uint32_t imm);
+void asm_arm64_patch_branch(microasm *a, uint32_t from, uint32_t to);
+void asm_arm64_ldrb_pre(microasm *a, uint8_t rt, uint8_t rn, int16_t imm);
+void asm_arm64_ldrb_post(microasm *a, uint8_t rt, uint8_t rn, int16_t imm);
+void asm_arm64_strb_post(microasm *a, uint8_t rt, uint8_t rn, int16_t imm);
+void asm_arm64_immldr_n(microasm *a, uint8_t size, uint8_t rt, uint8_t rn,
+                        uint16_t imm);
+void asm_arm64_immstr_n(microasm *a, uint8_t size, uint8_t rt, uint8_t rn,
+                        uint16_t imm);
+void asm_arm64_ldur_n(microasm *a, uint8_t size, uint8_t rt, uint8_t rn,
+                      int16_t imm);
+void asm_arm64_stur_n(microasm *a, uint8_t size, uint8_t rt, uint8_t rn,
+                      int16_t imm);
+void asm_arm64_ldr_pre_n(microasm *a, uint8_t size, uint8_t rt, uint8_t rn,
+                         int16_t imm);
+void asm_arm64_uxt_n(microasm *a, uint8_t size, uint8_t rd, uint8_t rn);
+void asm_arm64_ldurq(microasm *a, uint8_t qt, uint8_t rn, int16_t imm);
+void asm_arm64_neon_cmeqz(microasm *a, uint8_t size, uint8_t vd,
+                          uint8_t vn);
+void asm_arm64_neon_shrn4(microasm *a, uint8_t vd, uint8_t vn);
+void asm_arm64_fmov_to_gp(microasm *a, uint8_t rd, uint8_t vn);
 void asm_return(microasm *a);
 
-void asm_write_exec(char *filename, microasm *bin);
+void asm_write_exec(char *filename, microasm *bin, uint16_t machine,
+                    asm_tape_layout tape);
@@ -1,13 +1,15 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef struct {
   uint32_t maxSize;
   uint32_t size;
-  // Pointer to an array of ptrs
-  void **data;
+  // Pointer to an array of indices, the top of the stack is data[size - 1]
+  uint32_t *data;
 } Stack;
 
 Stack stack_init(uint32_t size);
-void stack_push(Stack *stack, void *item);
-void *stack_pop(Stack *stack);
+void stack_push(Stack *stack, uint32_t item);
+bool stack_pop(Stack *stack, uint32_t *item);
+void stack_free(Stack *stack);
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "microasm.h"
+#include <stdint.h>
+
+// NOTE: The x86-64 encoders share microasm with the ARM64 ones, but count
+// is in bytes instead of instructions. Branch targets are byte offsets from
+// the start of the code.
+
+// General purpose registers
+#define X86_RAX (0)
+#define X86_RCX (1)
+#define X86_RDX (2)
+#define X86_RBX (3)
+#define X86_RSP (4)
+#define X86_RBP (5)
+#define X86_RSI (6)
+#define X86_RDI (7)
+#define X86_R8 (8)
+#define X86_R9 (9)
+#define X86_R10 (10)
+#define X86_R11 (11)
+#define X86_R12 (12)
+#define X86_R13 (13)
+#define X86_R14 (14)
+#define X86_R15 (15)
+
+// Condition codes for asm_x86_jcc
+#define X86_COND_B (0x2)
+#define X86_COND_AE (0x3)
+#define X86_COND_E (0x4)
+#define X86_COND_NE (0x5)
+#define X86_COND_BE (0x6)
+#define X86_COND_A (0x7)
+#define X86_COND_LE (0xE)
+
+void asm_x86_push(microasm *a, uint8_t r);
+void asm_x86_pop(microasm *a, uint8_t r);
+void asm_x86_ret(microasm *a);
+void asm_x86_syscall(microasm *a);
+
+void asm_x86_regmov(microasm *a, uint8_t dst, uint8_t src);
+void asm_x86_immmov(microasm *a, uint8_t dst, uint64_t imm);
+void asm_x86_regadd(microasm *a, uint8_t dst, uint8_t src);
+void asm_x86_regsub(microasm *a, uint8_t dst, uint8_t src);
+void asm_x86_regcmp(microasm *a, uint8_t lhs, uint8_t rhs);
+void asm_x86_immadd(microasm *a, uint8_t dst, int32_t imm);
+void asm_x86_immsub(microasm *a, uint8_t dst, int32_t imm);
+void asm_x86_immcmp(microasm *a, uint8_t r, int32_t imm);
+void asm_x86_lea(microasm *a, uint8_t dst, uint8_t base, int32_t disp);
+
+void asm_x86_movzx8_load(microasm *a, uint8_t dst, uint8_t base, int32_t disp);
+void asm_x86_movzx8_reg(microasm *a, uint8_t dst, uint8_t src);
+void asm_x86_store8(microasm *a, uint8_t src, uint8_t base, int32_t disp);
+void asm_x86_store8_imm(microasm *a, uint8_t base, int32_t disp, uint8_t imm);
+void asm_x86_add8_imm(microasm *a, uint8_t r, uint8_t imm);
+void asm_x86_sub8_imm(microasm *a, uint8_t r, uint8_t imm);
+void asm_x86_add8_mem(microasm *a, uint8_t base, int32_t disp, uint8_t src);
+void asm_x86_sub8_mem(microasm *a, uint8_t base, int32_t disp, uint8_t src);
+void asm_x86_cmp8_mem_imm(microasm *a, uint8_t base, int32_t disp,
+                          uint8_t imm);
+void asm_x86_test8(microasm *a, uint8_t r1, uint8_t r2);
+
+void asm_x86_load_n(microasm *a, uint8_t size, uint8_t dst, uint8_t base,
+                    int32_t disp);
+void asm_x86_store_n(microasm *a, uint8_t size, uint8_t src, uint8_t base,
+                     int32_t disp);
+void asm_x86_store_imm_n(microasm *a, uint8_t size, uint8_t base,
+                         int32_t disp, uint32_t imm);
+void asm_x86_add_mem_n(microasm *a, uint8_t size, uint8_t base, int32_t disp,
+                       uint8_t src);
+void asm_x86_sub_mem_n(microasm *a, uint8_t size, uint8_t base, int32_t disp,
+                       uint8_t src);
+void asm_x86_cmp_mem_imm_n(microasm *a, uint8_t size, uint8_t base,
+                           int32_t disp, int8_t imm);
+void asm_x86_add_mem64_imm(microasm *a, uint8_t base, int32_t disp,
+                           int8_t imm);
+void asm_x86_test_n(microasm *a, uint8_t size, uint8_t r1, uint8_t r2);
+
+void asm_x86_imul32_imm(microasm *a, uint8_t dst, uint8_t src, int32_t imm);
+void asm_x86_and32_imm(microasm *a, uint8_t r, uint32_t imm);
+void asm_x86_test32(microasm *a, uint8_t r1, uint8_t r2);
+void asm_x86_bsf32(microasm *a, uint8_t dst, uint8_t src);
+void asm_x86_bsr32(microasm *a, uint8_t dst, uint8_t src);
+
+void asm_x86_movdqu_load(microasm *a, uint8_t xmm, uint8_t base, int32_t disp);
+void asm_x86_pxor(microasm *a, uint8_t dst, uint8_t src);
+void asm_x86_pcmpeqb(microasm *a, uint8_t dst, uint8_t src);
+void asm_x86_pcmpeq_n(microasm *a, uint8_t size, uint8_t dst, uint8_t src);
+void asm_x86_pmovmskb(microasm *a, uint8_t dst, uint8_t xmm);
+
+void asm_x86_jmp(microasm *a, uint32_t to);
+void asm_x86_jcc(microasm *a, uint8_t cond, uint32_t to);
+void asm_x86_call(microasm *a, uint32_t to);
+void asm_x86_patch_rel32(microasm *a, uint32_t from, uint32_t to);
@@ -1,6 +1,13 @@
 #include "bf.h"
+#include <stdio.h>
+#include <stdlib.h>
 
 bf_data *bf = 0;
 
 uint8_t bf_get_data(uint8_t pos) { return bf->data[pos]; }
 void bf_set_data(uint8_t pos, uint8_t value) { bf->data[pos] = value; }
+
+void bf_out_of_bounds(void) {
+  fprintf(stderr, "tape access out of bounds\n");
+  exit(-1);
+}
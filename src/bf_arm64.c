@@ -0,0 +1,797 @@
+#include "bf.h"
+#include "bf_backend.h"
+#include "microasm.h"
+#include "stack.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Instruction indices just past the '[' and ']' sequences of a loop, so the
+// table stays valid when the code buffer moves
+typedef struct {
+  uint32_t lpos;
+  uint32_t rpos;
+  bool near; // Both ends are a single cbz/cbnz to the other
+} loop_pos;
+
+// Upper bound of the instructions emitted for one token, used to tell if a
+// loop fits in the +-1MB range of cbz/cbnz before its body is emitted
+#define MAX_TOKEN_INSNS (64)
+#define MAX_CBZ_DISTANCE ((1 << 18) - 1)
+
+#define SCAN_SHORT_STEPS (3)
+
+// NOTE: x12 is the tape pointer, it holds the address of the current cell
+// so cells around it are reached with immediate offsets. x10 keeps the base
+// of the tape for the scans' bounds and x17 its end, both are the bounds of
+// the --safe checks. Moves and addresses are in bytes, cells are cell_size
+// bytes wide.
+static void emit_move(microasm *bin, bool right, uint32_t bytes) {
+  const uint8_t addr_reg = 12;
+
+  if (bytes <= 4095) {
+    if (right) {
+      asm_arm64_immadd(bin, addr_reg, addr_reg, bytes);
+    } else {
+      asm_arm64_immsub(bin, addr_reg, addr_reg, bytes);
+    }
+    return;
+  }
+
+  asm_arm64_immmov64(bin, 11, bytes);
+  if (right) {
+    asm_arm64_regadd(bin, addr_reg, addr_reg, 11, 0);
+  } else {
+    asm_arm64_regsub(bin, addr_reg, addr_reg, 11, 0);
+  }
+}
+
+// rd = x12 + offset bytes
+static void emit_cell_addr(microasm *bin, uint8_t rd, int32_t offset) {
+  if (offset >= 0 && offset <= 4095) {
+    asm_arm64_immadd(bin, rd, 12, offset);
+  } else if (offset < 0 && offset >= -4095) {
+    asm_arm64_immsub(bin, rd, 12, -offset);
+  } else {
+    asm_arm64_immmov64(bin, rd, (int64_t)offset);
+    asm_arm64_regadd(bin, rd, 12, rd, 0);
+  }
+}
+
+// Loads or stores the low size bytes of rt at the cell at offset, x14 is
+// used for offsets the addressing modes can't encode
+static void emit_cell_access(microasm *bin, uint8_t size, bool store,
+                             uint8_t rt, int32_t offset) {
+  int32_t bytes = offset * size;
+  if (offset >= 0 && offset <= 4095) {
+    if (store) {
+      asm_arm64_immstr_n(bin, size, rt, 12, offset);
+    } else {
+      asm_arm64_immldr_n(bin, size, rt, 12, offset);
+    }
+  } else if (bytes < 0 && bytes >= -256) {
+    if (store) {
+      asm_arm64_stur_n(bin, size, rt, 12, bytes);
+    } else {
+      asm_arm64_ldur_n(bin, size, rt, 12, bytes);
+    }
+  } else {
+    emit_cell_addr(bin, 14, bytes);
+    if (store) {
+      asm_arm64_immstr_n(bin, size, rt, 14, 0);
+    } else {
+      asm_arm64_immldr_n(bin, size, rt, 14, 0);
+    }
+  }
+}
+
+// NOTE: x13 caches the value of one cell within a basic block, so runs of
+// arithmetic on the same cell only load and store it once. The cell is
+// written back before anything that reads the tape and before every branch.
+// At a loop edge x13 always holds the current cell, zero extended.
+typedef struct {
+  bool valid;     // x13 holds the cell at offset
+  bool dirty;     // x13 hasn't been stored yet
+  bool extended;  // The upper bits of x13 are 0
+  int32_t offset; // Relative to x12
+  uint8_t size;   // Bytes per cell
+} cell_cache;
+
+static void cache_flush(microasm *bin, cell_cache *cache) {
+  if (cache->valid && cache->dirty) {
+    emit_cell_access(bin, cache->size, true, 13, cache->offset);
+    cache->dirty = false;
+  }
+}
+
+static void cache_load(microasm *bin, cell_cache *cache, int32_t offset) {
+  if (cache->valid && cache->offset == offset) {
+    return;
+  }
+
+  cache_flush(bin, cache);
+  emit_cell_access(bin, cache->size, false, 13, offset);
+  *cache = (cell_cache){.valid = true,
+                        .dirty = false,
+                        .extended = true,
+                        .offset = offset,
+                        .size = cache->size};
+}
+
+// Loads the cell at offset into x13 so it can be tested with cbz/cbnz
+static void cache_load_test(microasm *bin, cell_cache *cache, int32_t offset) {
+  cache_load(bin, cache, offset);
+  if (!cache->extended) {
+    asm_arm64_uxt_n(bin, cache->size, 13, 13);
+    cache->extended = true;
+  }
+}
+
+// NOTE: Scan loops that step up to 4 bytes at a time check 16 bytes at once
+// with NEON. Each block is turned into a 64-bit mask with 4 bits per byte
+// that are set if the cell the byte is part of is 0, and only one byte of
+// each cell the loop would actually visit is kept (the one nearest to the
+// scan's start). Blocks are only loaded while they are fully inside the
+// tape, the rest is done 1 cell at a time like the loop would.
+static void emit_scan(microasm *bin, bool right, uint32_t stride,
+                      uint8_t size) {
+  const uint8_t data_reg = 10;
+  const uint8_t stride_reg = 11;
+  const uint8_t addr_reg = 12;
+  const uint8_t limit_reg = 14;
+  const uint32_t step = stride * size;
+
+  asm_arm64_immldr_n(bin, size, 13, addr_reg, 0);
+  uint32_t to_done = bin->count;
+  asm_arm64_pcrelbranch_ze(bin, 13, 0); // Most scans don't move at all
+
+  uint32_t to_done_vec = 0, to_scalar = 0, to_found = 0;
+  uint32_t to_done_short[SCAN_SHORT_STEPS];
+  if (step <= 4) {
+    // Short scans are cheaper without setting up the block loop
+    for (int i = 0; i < SCAN_SHORT_STEPS; i++) {
+      asm_arm64_ldr_pre_n(bin, size, 13, addr_reg,
+                          right ? (int16_t)step : -(int16_t)step);
+      to_done_short[i] = bin->count;
+      asm_arm64_pcrelbranch_ze(bin, 13, 0);
+    }
+
+    uint32_t block = (16 / step) * step;
+    uint64_t mask = 0;
+    for (uint32_t byte = 0; byte < 16; byte += step) {
+      mask |= 0xFULL << (4 * (right ? byte : 15 - byte));
+    }
+
+    if (step != 1) {
+      asm_arm64_immmov64(bin, stride_reg, mask);
+    }
+    if (right) {
+      asm_arm64_immmov64(bin, limit_reg, BF_TAPE_SIZE * size - 16);
+      asm_arm64_regadd(bin, limit_reg, limit_reg, data_reg, 0);
+    } else {
+      asm_arm64_immadd(bin, limit_reg, data_reg, 16 - size);
+    }
+
+    uint32_t vec = bin->count;
+    asm_arm64_regcmp(bin, addr_reg, limit_reg);
+    to_scalar = bin->count;
+    asm_arm64_bcond(bin, right ? ARM64_COND_HI : ARM64_COND_LO, 0);
+
+    // Going left the block ends with the current cell
+    asm_arm64_ldurq(bin, 0, addr_reg, right ? 0 : -(16 - size));
+    asm_arm64_neon_cmeqz(bin, size, 0, 0);
+    asm_arm64_neon_shrn4(bin, 0, 0);
+    asm_arm64_fmov_to_gp(bin, 13, 0);
+    if (step != 1) {
+      asm_arm64_regand(bin, 13, 13, stride_reg);
+    }
+
+    to_found = bin->count;
+    asm_arm64_pcrelbranch_nz(bin, 13, 0);
+    if (right) {
+      asm_arm64_immadd(bin, addr_reg, addr_reg, block);
+    } else {
+      asm_arm64_immsub(bin, addr_reg, addr_reg, block);
+    }
+    asm_arm64_b(bin, 0);
+    asm_arm64_patch_branch(bin, bin->count - 1, vec);
+
+    // Distance to the zero cell in bytes is the count of trailing (or
+    // leading) zero bits divided by 4
+    asm_arm64_patch_branch(bin, to_found, bin->count);
+    if (right) {
+      asm_arm64_rbit(bin, 13, 13);
+    }
+    asm_arm64_clz(bin, 13, 13);
+    asm_arm64_lsr(bin, 13, 13, 2);
+    if (right) {
+      asm_arm64_regadd(bin, addr_reg, addr_reg, 13, 0);
+    } else {
+      asm_arm64_regsub(bin, addr_reg, addr_reg, 13, 0);
+    }
+    to_done_vec = bin->count;
+    asm_arm64_b(bin, 0);
+
+    // The block loop stops on a cell it hasn't checked yet
+    asm_arm64_patch_branch(bin, to_scalar, bin->count);
+    asm_arm64_immldr_n(bin, size, 13, addr_reg, 0);
+    asm_arm64_pcrelbranch_ze(bin, 13, 0);
+    asm_arm64_patch_branch(bin, bin->count - 1, to_done);
+    to_scalar = bin->count - 1;
+  }
+
+  uint32_t scalar;
+  if (step <= 255) {
+    scalar = bin->count;
+    asm_arm64_ldr_pre_n(bin, size, 13, addr_reg,
+                        right ? (int16_t)step : -(int16_t)step);
+  } else {
+    asm_arm64_immmov64(bin, stride_reg, step);
+    scalar = bin->count;
+    if (right) {
+      asm_arm64_regadd(bin, addr_reg, addr_reg, stride_reg, 0);
+    } else {
+      asm_arm64_regsub(bin, addr_reg, addr_reg, stride_reg, 0);
+    }
+    asm_arm64_immldr_n(bin, size, 13, addr_reg, 0);
+  }
+  asm_arm64_pcrelbranch_nz(bin, 13, 0);
+  asm_arm64_patch_branch(bin, bin->count - 1, scalar);
+
+  uint32_t done = bin->count;
+  asm_arm64_patch_branch(bin, to_done, done);
+  if (step <= 4) {
+    asm_arm64_patch_branch(bin, to_done_vec, done);
+    asm_arm64_patch_branch(bin, to_scalar, done);
+    for (int i = 0; i < SCAN_SHORT_STEPS; i++) {
+      asm_arm64_patch_branch(bin, to_done_short[i], done);
+    }
+  }
+}
+
+// NOTE: --safe checks compare the addresses of the first and last cell of a
+// range with x10 and x17. A CHECK_BOUNDS branches to the out of bounds exit
+// if either end in sides is off the tape. That's a b patched from s_oob at
+// the end, b.cond can't reach it in large programs. lo and hi are in bytes.
+static void emit_check(microasm *bin, Stack *s_oob, int32_t lo, int32_t hi,
+                       uint32_t sides) {
+  const uint8_t data_reg = 10;
+  const uint8_t end_reg = 17;
+
+  if (sides & BOUNDS_LO) {
+    emit_cell_addr(bin, 11, lo);
+    asm_arm64_regcmp(bin, 11, data_reg);
+    asm_arm64_bcond(bin, ARM64_COND_HS, 2);
+    stack_push(s_oob, bin->count);
+    asm_arm64_b(bin, 0);
+  }
+  if (sides & BOUNDS_HI) {
+    emit_cell_addr(bin, 11, hi);
+    asm_arm64_regcmp(bin, 11, end_reg);
+    asm_arm64_bcond(bin, ARM64_COND_LO, 2);
+    stack_push(s_oob, bin->count);
+    asm_arm64_b(bin, 0);
+  }
+}
+
+// A GUARD_RANGE falls through to the checked copy if the range is off the
+// tape, and otherwise branches past the GUARD_ELSE. That b.cond is patched
+// there, it's left on s_guards. The copies are at most GUARD_MAX_TOKENS long
+// so it always reaches. Only the ends in sides are compared.
+static void emit_guard(microasm *bin, Stack *s_guards, int32_t lo, int32_t hi,
+                       uint32_t sides) {
+  const uint8_t data_reg = 10;
+  const uint8_t end_reg = 17;
+
+  if (!(sides & BOUNDS_HI)) {
+    emit_cell_addr(bin, 11, lo);
+    asm_arm64_regcmp(bin, 11, data_reg);
+    stack_push(s_guards, bin->count);
+    asm_arm64_bcond(bin, ARM64_COND_HS, 0);
+    return;
+  }
+
+  uint32_t to_checked = UINT32_MAX;
+  if (sides & BOUNDS_LO) {
+    emit_cell_addr(bin, 11, lo);
+    asm_arm64_regcmp(bin, 11, data_reg);
+    to_checked = bin->count;
+    asm_arm64_bcond(bin, ARM64_COND_LO, 0);
+  }
+  emit_cell_addr(bin, 11, hi);
+  asm_arm64_regcmp(bin, 11, end_reg);
+  stack_push(s_guards, bin->count);
+  asm_arm64_bcond(bin, ARM64_COND_LO, 0);
+  if (to_checked != UINT32_MAX) {
+    asm_arm64_patch_branch(bin, to_checked, bin->count);
+  }
+}
+
+// NOTE: '.' appends to an output buffer on the stack of the compiled code
+// instead of making a write syscall per byte. x3 is the write position and
+// x4 the end of the buffer. The buffer is written out by a subroutine at the
+// start of the code when it fills up, before reading input and at the end.
+//
+// ',' takes the next byte of an input buffer that sits right above it, x5 is
+// the read position and x7 the end of the data. Another subroutine refills
+// it with a single large read when it runs out.
+
+// Emits the flush subroutine, called with bl. Only uses x0-x2 and x8/x16
+static void emit_output_flush(microasm *bin) {
+  const uint8_t out_reg = 3;
+
+#ifdef __APPLE__
+  const uint8_t write_syscall = 4;
+#else
+  const uint8_t write_syscall = 64;
+#endif
+
+  asm_arm64_immadd(bin, 1, 31, 0); // mov x1, sp
+  asm_arm64_regsub(bin, 2, out_reg, 1, 0);
+  uint32_t to_empty = bin->count;
+  asm_arm64_pcrelbranch_ze(bin, 2, 0);
+
+  // write() can return early, loop until the whole buffer is out
+  uint32_t write = bin->count;
+#ifdef __APPLE__
+  asm_arm64_immmov(bin, 16, write_syscall);
+#else
+  asm_arm64_immmov(bin, 8, write_syscall); // 0x40 is write syscall
+#endif
+  asm_arm64_immadd_lsl12(bin, 0, 4, INPUT_BUF_SIZE >> 12);
+  asm_arm64_ldur_n(bin, 4, 0, 0, IO_OUT_FD_OFFSET - INPUT_BUF_SIZE);
+  asm_arm64_syscall(bin, 0);
+  asm_arm64_immcmp(bin, 0, 0);
+  uint32_t to_error = bin->count;
+  asm_arm64_bcond(bin, ARM64_COND_LE, 0);
+  asm_arm64_regadd(bin, 1, 1, 0, 0);
+  asm_arm64_regsub(bin, 2, 2, 0, 0);
+  asm_arm64_pcrelbranch_nz(bin, 2, 0);
+  asm_arm64_patch_branch(bin, bin->count - 1, write);
+
+  asm_arm64_patch_branch(bin, to_empty, bin->count);
+  asm_arm64_patch_branch(bin, to_error, bin->count);
+  asm_arm64_immadd(bin, out_reg, 31, 0); // Rewind to the start of the buffer
+  asm_return(bin);
+}
+
+// Emits the refill subroutine, called with bl. Flushes the output first so
+// prompts are out before the read blocks. On EOF or an error x5 == x7
+static void emit_input_refill(microasm *bin, uint32_t output_flush) {
+  const uint8_t in_reg = 5;
+  const uint8_t in_end_reg = 7;
+  const uint8_t saved_lr_reg = 9;
+
+#ifdef __APPLE__
+  const uint8_t read_syscall = 3;
+#else
+  const uint8_t read_syscall = 63;
+#endif
+
+  asm_arm64_regmov(bin, saved_lr_reg, 30);
+  asm_arm64_bl(bin, output_flush - bin->count);
+  asm_arm64_regmov(bin, 30, saved_lr_reg);
+
+  asm_arm64_immadd_lsl12(bin, 1, 31, OUTPUT_BUF_SIZE >> 12);
+  asm_arm64_immmov64(bin, 2, INPUT_READ_SIZE);
+#ifdef __APPLE__
+  asm_arm64_immmov(bin, 16, read_syscall);
+#else
+  asm_arm64_immmov(bin, 8, read_syscall);
+#endif
+  asm_arm64_immadd_lsl12(bin, 0, 1, INPUT_BUF_SIZE >> 12);
+  asm_arm64_ldur_n(bin, 4, 0, 0, IO_IN_FD_OFFSET - INPUT_BUF_SIZE);
+  asm_arm64_syscall(bin, 0);
+
+  asm_arm64_regmov(bin, in_reg, 1);
+  asm_arm64_regmov(bin, in_end_reg, 1);
+  asm_arm64_immcmp(bin, 0, 0);
+  asm_arm64_bcond(bin, ARM64_COND_LE, 2); // Nothing was read
+  asm_arm64_regadd(bin, in_end_reg, in_reg, 0, 0);
+  asm_return(bin);
+}
+
+// Adds value to x13, modulo the cell width
+static void emit_cell_add(microasm *bin, uint32_t value, uint8_t size) {
+  uint64_t modulo = (uint64_t)1 << (size * 8);
+  uint64_t add = value & (modulo - 1);
+  uint64_t sub = (modulo - add) & (modulo - 1);
+
+  if (sub < add && sub <= 4095) {
+    asm_arm64_immsub(bin, 13, 13, sub);
+  } else if (add <= 4095) {
+    asm_arm64_immadd(bin, 13, 13, add);
+  } else {
+    asm_arm64_immmov64(bin, 11, add);
+    asm_arm64_regadd(bin, 13, 13, 11, 0);
+  }
+}
+
+const char *compile_bf_arm64(TokenList *tokens, microasm *bin, bool debug,
+                             uint8_t cell_size, uint64_t *profile,
+                             bf_codemap *codemap, bf_timings *timings) {
+  const char *error = NULL;
+  Stack s_loops = stack_init(1024);
+  Stack s_oob = stack_init(64);
+  Stack s_guards = stack_init(64);
+  uint32_t guard_max = 64;
+  cell_cache *guard_cache = malloc(sizeof(cell_cache) * guard_max);
+
+  uint32_t loop_count = 0;
+  uint32_t loop_max = 1024;
+  loop_pos *loops = malloc(sizeof(loop_pos) * loop_max);
+
+  uint32_t mul_skip = 0;
+
+  const uint8_t data_reg = 10;
+  const uint8_t end_reg = 17;
+  const uint8_t value_at_pos_reg = 12;
+  const uint8_t out_reg = 3;
+  const uint8_t out_end_reg = 4;
+  const uint8_t in_reg = 5;
+  const uint8_t in_end_reg = 7;
+  const uint8_t saved_lr_reg = 6;
+
+  codemap_begin(codemap, bin, "bf_main");
+  asm_arm64_b(bin, 0); // Jump over the I/O subroutines
+  const uint32_t output_flush = bin->count;
+  codemap_begin(codemap, bin, "bf_output_flush");
+  emit_output_flush(bin);
+  const uint32_t input_refill = bin->count;
+  codemap_begin(codemap, bin, "bf_input_refill");
+  emit_input_refill(bin, output_flush);
+  asm_arm64_patch_branch(bin, 0, bin->count);
+  codemap_begin(codemap, bin, "bf_main");
+
+  asm_arm64_regmov(bin, saved_lr_reg, 30); // bl overwrites x30
+  asm_arm64_regmov(bin, 11, 3);             // fds, x3 is the output buffer
+  asm_arm64_immmov(bin, 15, IO_FRAME_SIZE / IO_PROBE_SIZE);
+  const uint32_t probe = bin->count;
+  asm_arm64_immsub_lsl12(bin, 31, 31, IO_PROBE_SIZE >> 12);
+  asm_arm64_immldr_n(bin, 1, 16, 31, 0);
+  asm_arm64_immsub(bin, 15, 15, 1);
+  asm_arm64_pcrelbranch_nz(bin, 15, 0);
+  asm_arm64_patch_branch(bin, bin->count - 1, probe);
+  asm_arm64_immadd(bin, out_reg, 31, 0);
+  asm_arm64_immadd_lsl12(bin, out_end_reg, out_reg, OUTPUT_BUF_SIZE >> 12);
+  asm_arm64_immadd_lsl12(bin, 14, out_end_reg, INPUT_BUF_SIZE >> 12);
+  asm_arm64_stur_n(bin, 8, 11, 14, IO_IN_FD_OFFSET - INPUT_BUF_SIZE);
+  asm_arm64_regmov(bin, in_reg, out_end_reg); // The input buffer is empty
+  asm_arm64_regmov(bin, in_end_reg, out_end_reg);
+
+  asm_arm64_regmov(bin, data_reg, 1);
+  asm_arm64_regmov(bin, end_reg, 2);
+  asm_arm64_regmov(bin, value_at_pos_reg, 0);
+
+  cell_cache cache = {.valid = false, .size = cell_size};
+  const uint32_t cell_mask = cell_size == 4 ? UINT32_MAX
+                                            : (1u << (cell_size * 8)) - 1;
+
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token *tok = &tokens->data[i];
+
+    // x0 = data
+    switch (tok->token) {
+    case INC_CUR: {
+      emit_move(bin, true, tok->token_data * cell_size);
+      cache.offset -= tok->token_data;
+      break;
+    }
+    case DEC_CUR: {
+      emit_move(bin, false, tok->token_data * cell_size);
+      cache.offset += tok->token_data;
+      break;
+    }
+    case JUMP_IF_ZERO: {
+      codemap_loop_start(codemap, bin, tok->token_data);
+      if (loop_count == loop_max) {
+        loop_max *= 2;
+        loops = realloc(loops, sizeof(loop_pos) * loop_max);
+      }
+
+      if (debug) {
+        printf("L: loop id: %i\n", loop_count);
+      }
+
+      stack_push(&s_loops, loop_count);
+
+      cache_flush(bin, &cache);
+      cache_load_test(bin, &cache, 0); // Current cell in x13
+
+      uint64_t max_body = (uint64_t)(tok->jump - i + 1) * MAX_TOKEN_INSNS;
+      loops[loop_count].near = max_body <= MAX_CBZ_DISTANCE;
+      if (loops[loop_count].near) {
+        asm_arm64_pcrelbranch_ze(bin, 13, 0); // Patched at the ']'
+      } else {
+        asm_arm64_pcrelbranch_nz(
+            bin, 13,
+            2);               // If x13 is not zero, jump over br instruction
+        asm_arm64_b(bin, 0); // Will be backpatched later
+      }
+
+      loops[loop_count].lpos = bin->count;
+
+      // The ']' branches back here, so this counts iterations
+      if (profile != NULL) {
+        asm_arm64_immmov64(bin, 11, (uint64_t)(uintptr_t)profile++);
+        asm_arm64_immldr_n(bin, 8, 14, 11, 0);
+        asm_arm64_immadd(bin, 14, 14, 1);
+        asm_arm64_immstr_n(bin, 8, 14, 11, 0);
+      }
+
+      loop_count++;
+      break;
+    }
+    case JUMP_IF_NOT_ZERO: {
+      uint32_t loop_id;
+      if (!stack_pop(&s_loops, &loop_id)) {
+        error = "extra ']' in bf code";
+        break;
+      }
+
+      if (debug) {
+        printf("R: loop id: %i\n", loop_id);
+      }
+
+      cache_flush(bin, &cache);
+      cache_load_test(bin, &cache, 0); // Current cell in x13
+
+      if (loops[loop_id].near) {
+        if (bin->count - loops[loop_id].lpos > MAX_CBZ_DISTANCE) {
+          error = "a loop is too long for cbz/cbnz";
+          break;
+        }
+
+        asm_arm64_pcrelbranch_nz(bin, 13, 0);
+        asm_arm64_patch_branch(bin, bin->count - 1, loops[loop_id].lpos);
+        loops[loop_id].rpos = bin->count;
+        asm_arm64_patch_branch(bin, loops[loop_id].lpos - 1, bin->count);
+        codemap_loop_end(codemap, bin);
+        break;
+      }
+
+      asm_arm64_pcrelbranch_ze(bin, 13, 2); // If x13 is zero, jump (3 * 4)
+      asm_arm64_b(bin, 0);
+
+      // Used for '[' to know where to jump if == 0
+      loops[loop_id].rpos = bin->count;
+      codemap_loop_end(codemap, bin);
+      break;
+    }
+    case ADD: {
+      cache_load(bin, &cache, tok->offset); // Value in x13
+      emit_cell_add(bin, tok->token_data, cell_size);
+      cache.dirty = true;
+      cache.extended = false;
+      break;
+    }
+    case SUB: {
+      cache_load(bin, &cache, tok->offset); // Value in x13
+      emit_cell_add(bin, -tok->token_data, cell_size);
+      cache.dirty = true;
+      cache.extended = false;
+      break;
+    }
+    case SET_CELL: {
+      uint32_t value = tok->token_data & cell_mask;
+      if (value == 0) {
+        if (cache.offset == tok->offset) {
+          cache.valid = false;
+        }
+        emit_cell_access(bin, cell_size, true, 31, tok->offset); // Store wzr
+        break;
+      }
+
+      if (cache.valid && cache.offset != tok->offset) {
+        cache_flush(bin, &cache);
+      }
+      asm_arm64_immmov64(bin, 13, value);
+      cache = (cell_cache){.valid = true,
+                           .dirty = true,
+                           .extended = true,
+                           .offset = tok->offset,
+                           .size = cell_size};
+      break;
+    }
+    case MUL_CELL: {
+      // Consecutive MUL_CELLs come from the same loop and share x13
+      if (i == 0 || tokens->data[i - 1].token != MUL_CELL ||
+          tokens->data[i - 1].src_offset != tok->src_offset) {
+        cache_load_test(bin, &cache, tok->src_offset); // Loop cell in x13
+
+        // The loop would never have run, don't touch the other cells
+        mul_skip = bin->count;
+        asm_arm64_pcrelbranch_ze(bin, 13, 0); // Backpatched below
+      }
+
+      // A factor that's a multiple of the cell width leaves the cell as is
+      uint32_t factor = tok->token_data & cell_mask;
+      uint32_t neg_factor = -factor & cell_mask;
+      if (factor != 0) {
+        // Target value to x15
+        emit_cell_access(bin, cell_size, false, 15, tok->offset);
+
+        if ((factor & (factor - 1)) == 0) {
+          // x15 += x13 << log2(factor)
+          asm_arm64_regadd(bin, 15, 15, 13, __builtin_ctz(factor));
+        } else if ((neg_factor & (neg_factor - 1)) == 0) {
+          // x15 -= x13 << log2(-factor)
+          asm_arm64_regsub(bin, 15, 15, 13, __builtin_ctz(neg_factor));
+        } else {
+          asm_arm64_immmov64(bin, 11, factor);
+          asm_arm64_madd(bin, 15, 13, 11, 15); // x15 += x13 * x11
+        }
+
+        emit_cell_access(bin, cell_size, true, 15, tok->offset);
+      }
+
+      bool last_mul = i + 1 == tokens->size ||
+                      tokens->data[i + 1].token != MUL_CELL ||
+                      tokens->data[i + 1].src_offset != tok->src_offset;
+      if (last_mul && !bin->failed) {
+        uint32_t *skip_ins = (uint32_t *)bin->dest - (bin->count - mul_skip);
+        *skip_ins |= ((bin->count - mul_skip) & ((1 << 19) - 1)) << 5;
+      }
+      break;
+    }
+    case SCAN_RIGHT:
+    case SCAN_LEFT: {
+      cache_flush(bin, &cache);
+      cache.valid = false; // x13 is used as a scratch register
+      emit_scan(bin, tok->token == SCAN_RIGHT, tok->token_data, cell_size);
+      break;
+    }
+    case PRINT: {
+      uint8_t value_reg = 13;
+      if (!cache.valid || cache.offset != tok->offset) {
+        value_reg = 11;
+        emit_cell_access(bin, cell_size, false, value_reg, tok->offset);
+      }
+
+      // Only the low byte of a wider cell is printed
+      asm_arm64_strb_post(bin, value_reg, out_reg, 1);
+      asm_arm64_regcmp(bin, out_reg, out_end_reg);
+      asm_arm64_bcond(bin, ARM64_COND_NE, 2); // Skip the flush
+      asm_arm64_bl(bin, output_flush - bin->count);
+      break;
+    }
+    case INPUT: {
+      // x13 ends up holding the new value, or the old one on EOF
+      cache_load(bin, &cache, tok->offset);
+
+      asm_arm64_regcmp(bin, in_reg, in_end_reg);
+      asm_arm64_bcond(bin, ARM64_COND_NE, 4);
+      asm_arm64_bl(bin, input_refill - bin->count);
+      asm_arm64_regcmp(bin, in_reg, in_end_reg);
+      asm_arm64_bcond(bin, ARM64_COND_EQ, 2); // EOF leaves the cell as is
+      asm_arm64_ldrb_post(bin, 13, in_reg, 1);
+
+      cache.dirty = true;
+      cache.extended = true;
+      break;
+    }
+    case CHECK_BOUNDS: {
+      emit_check(bin, &s_oob, tok->offset * cell_size,
+                 tok->check_hi * cell_size, tok->token_data);
+      break;
+    }
+    case CHECK_BOUNDS_IF: {
+      cache_load_test(bin, &cache, (int32_t)tok->token_data);
+      uint32_t to_skip = bin->count;
+      asm_arm64_pcrelbranch_ze(bin, 13, 0);
+      emit_check(bin, &s_oob, tok->offset * cell_size,
+                 tok->check_hi * cell_size, BOUNDS_LO | BOUNDS_HI);
+      asm_arm64_patch_branch(bin, to_skip, bin->count);
+      break;
+    }
+    // Both copies start with the cache of the guard, which doesn't touch
+    // it, and end with nothing cached
+    case GUARD_RANGE: {
+      cache_flush(bin, &cache);
+      if (s_guards.size == guard_max) {
+        guard_max *= 2;
+        guard_cache = realloc(guard_cache, sizeof(cell_cache) * guard_max);
+      }
+      guard_cache[s_guards.size] = cache;
+      emit_guard(bin, &s_guards, tok->offset * cell_size,
+                 tok->check_hi * cell_size, tok->token_data);
+      break;
+    }
+    case GUARD_ELSE: {
+      cache_flush(bin, &cache);
+      uint32_t to_fast;
+      stack_pop(&s_guards, &to_fast);
+      cache = guard_cache[s_guards.size];
+      stack_push(&s_guards, bin->count);
+      asm_arm64_b(bin, 0);
+      asm_arm64_patch_branch(bin, to_fast, bin->count);
+      break;
+    }
+    case GUARD_END: {
+      cache_flush(bin, &cache);
+      cache.valid = false;
+      uint32_t to_end;
+      stack_pop(&s_guards, &to_end);
+      asm_arm64_patch_branch(bin, to_end, bin->count);
+      break;
+    }
+    }
+  }
+
+  cache_flush(bin, &cache);
+  asm_arm64_bl(bin, output_flush - bin->count);
+  asm_arm64_immadd_lsl12(bin, 31, 31, IO_FRAME_SIZE >> 12);
+  asm_arm64_regmov(bin, 30, saved_lr_reg);
+  asm_arm64_regmov(bin, 0, value_at_pos_reg); // Return the current cell
+  asm_return(bin);
+  timings_phase(timings, "emit");
+
+  // NOTE: A failed --safe check returns NULL instead of the current cell.
+  // The output so far is still written, the cache isn't since the program
+  // stops here anyway.
+  if (s_oob.size != 0) {
+    codemap_begin(codemap, bin, "bf_out_of_bounds");
+    for (uint32_t i = 0; i < s_oob.size; i++) {
+      asm_arm64_patch_branch(bin, s_oob.data[i], bin->count);
+    }
+
+    asm_arm64_bl(bin, output_flush - bin->count);
+    asm_arm64_immadd_lsl12(bin, 31, 31, IO_FRAME_SIZE >> 12);
+    asm_arm64_regmov(bin, 30, saved_lr_reg);
+    asm_arm64_immmov(bin, 0, 0);
+    asm_return(bin);
+  }
+
+  if (s_loops.size != 0) {
+    error = "Missing ']'";
+  }
+
+  // The code buffer may have been moved while growing
+  uint8_t *memory = bin->dest - bin->count * 4;
+
+  // NOTE: Backpatching loop, only every loop has both ends if nothing failed
+  for (int i = loop_count - 1; i >= 0 && error == NULL && !bin->failed; i--) {
+    if (loops[i].near) {
+      continue;
+    }
+
+    uint32_t *l_brack = (uint32_t *)memory + loops[i].lpos;
+    uint32_t *r_brack = (uint32_t *)memory + loops[i].rpos;
+
+    int64_t offset = (r_brack - l_brack);
+
+    uint32_t lpos_b_ins = 0x14000000;
+    lpos_b_ins |= (offset + 1) & ((1 << 26) - 1);
+    *(l_brack - 1) = lpos_b_ins;
+
+    uint32_t rpos_b_ins = 0x14000000;
+    rpos_b_ins |= (-offset + 1) & ((1 << 26) - 1);
+    *(r_brack - 1) = rpos_b_ins;
+  }
+
+  if (debug) {
+    printf("*** loops ***\n");
+
+    for (uint32_t i = 0; i < loop_count; i++) {
+      printf("L: 0x%x, R: 0x%x\n", loops[i].lpos * 4, loops[i].rpos * 4);
+    }
+  }
+
+  timings_phase(timings, "backpatch");
+
+  if (timings != NULL) {
+    timings_stack(timings, &s_loops);
+    timings_stack(timings, &s_oob);
+    timings_stack(timings, &s_guards);
+    timings->loop_bytes +=
+        sizeof(loop_pos) * loop_max + sizeof(cell_cache) * guard_max;
+  }
+  stack_free(&s_loops);
+  stack_free(&s_oob);
+  stack_free(&s_guards);
+  free(guard_cache);
+  free(loops);
+
+  return bin->failed ? "failed to grow JIT memory!" : error;
+}
+
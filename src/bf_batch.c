@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+
+#include "bf_batch.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+  uint32_t runs;
+  uint32_t failed;
+  uint32_t max;
+  double *latencies; // In seconds, one per run
+} batch_stats;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+// One run on in_fd, then the delimiter and a clean tape for the next one
+static void batch_run_one(bf_batch *b, batch_stats *s, const char *name,
+                          double start, int in_fd, bf_native_fn code,
+                          bf_tape *tape, uint8_t *tape_lo, uint8_t *tape_hi) {
+  bool ok = in_fd >= 0;
+  if (ok && code(tape->origin, tape_lo, tape_hi,
+                 BF_IO_FDS(in_fd, STDOUT_FILENO)) == NULL) {
+    fprintf(stderr, "batch: %s: tape access out of bounds\n", name);
+    ok = false;
+  }
+
+  // NOTE: A failed run still ends its output, the outputs stay in step
+  // with the inputs
+  write_all(STDOUT_FILENO, &b->delim, 1);
+  if (!tape_reset(tape)) {
+    fprintf(stderr, "Could not reset the tape\n");
+    exit(-1);
+  }
+
+  double latency = now_seconds() - start;
+  if (s->runs == s->max) {
+    s->max *= 2;
+    s->latencies = realloc(s->latencies, sizeof(double) * s->max);
+  }
+  s->latencies[s->runs++] = latency;
+  s->failed += !ok;
+
+  if (b->verbose) {
+    fprintf(stderr, "batch: %s %.1f us\n", name, latency * 1e6);
+  }
+}
+
+static void batch_files(bf_batch *b, batch_stats *s, bf_native_fn code,
+                        bf_tape *tape, uint8_t *tape_lo, uint8_t *tape_hi) {
+  for (uint32_t i = 0; i < b->file_count; i++) {
+    double start = now_seconds();
+    int fd = open(b->files[i], O_RDONLY);
+    if (fd < 0) {
+      fprintf(stderr, "Could not open file: %s\n", b->files[i]);
+    }
+
+    batch_run_one(b, s, b->files[i], start, fd, code, tape, tape_lo,
+                  tape_hi);
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+// Every record is copied to an in-memory file the code reads as its input,
+// a pipe could fill up before the code starts reading
+static void batch_records(bf_batch *b, batch_stats *s, bf_native_fn code,
+                          bf_tape *tape, uint8_t *tape_lo, uint8_t *tape_hi) {
+#ifdef __linux__
+  int fd = memfd_create("bjit-record", MFD_CLOEXEC);
+#else
+  FILE *tmp = tmpfile();
+  int fd = tmp != NULL ? fileno(tmp) : -1;
+#endif
+  if (fd < 0) {
+    fprintf(stderr, "Could not create the record file\n");
+    exit(-1);
+  }
+
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  char name[32];
+  while ((len = getdelim(&line, &cap, b->delim, stdin)) > 0) {
+    double start = now_seconds();
+    if (line[len - 1] == b->delim) {
+      len--;
+    }
+
+    bool ok = ftruncate(fd, 0) == 0 && pwrite(fd, line, len, 0) == len &&
+              lseek(fd, 0, SEEK_SET) == 0;
+    snprintf(name, sizeof(name), "record %u", s->runs + 1);
+    batch_run_one(b, s, name, start, ok ? fd : -1, code, tape, tape_lo,
+                  tape_hi);
+  }
+
+  free(line);
+#ifdef __linux__
+  close(fd);
+#else
+  fclose(tmp);
+#endif
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Mean, median, nearest-rank 95th percentile and the slowest run
+static void batch_report(batch_stats *s) {
+  if (s->runs == 0) {
+    fprintf(stderr, "batch: 0 runs\n");
+    return;
+  }
+
+  double total = 0;
+  for (uint32_t i = 0; i < s->runs; i++) {
+    total += s->latencies[i];
+  }
+  qsort(s->latencies, s->runs, sizeof(double), compare_doubles);
+
+  uint32_t n = s->runs;
+  double median = n % 2 ? s->latencies[n / 2]
+                        : (s->latencies[n / 2 - 1] + s->latencies[n / 2]) / 2;
+  uint32_t rank = (uint32_t)(((uint64_t)n * 95 + 99) / 100);
+  fprintf(stderr,
+          "batch: %u runs, %u failed, latency mean %.1f us, p50 %.1f us, "
+          "p95 %.1f us, max %.1f us\n",
+          n, s->failed, total / n * 1e6, median * 1e6,
+          s->latencies[rank - 1] * 1e6, s->latencies[n - 1] * 1e6);
+}
+
+uint32_t batch_run(bf_batch *b, bf_native_fn code, bf_tape *tape,
+                   uint8_t *tape_lo, uint8_t *tape_hi) {
+  batch_stats s = {.runs = 0,
+                   .failed = 0,
+                   .max = 64,
+                   .latencies = malloc(sizeof(double) * 64)};
+
+  if (b->records) {
+    batch_records(b, &s, code, tape, tape_lo, tape_hi);
+  } else {
+    batch_files(b, &s, code, tape, tape_lo, tape_hi);
+  }
+
+  batch_report(&s);
+  free(s.latencies);
+  return s.failed;
+}
@@ -0,0 +1,283 @@
+#include "bf_cache.h"
+#include "bf.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC (0x32434A42) // "BJC2"
+#define CACHE_SUFFIX ".bjc"
+#define CACHE_STATS_FILE "stats"
+#define CACHE_PATH_MAX (4096)
+
+#define FNV_OFFSET (0xcbf29ce484222325ull)
+#define FNV_PRIME (0x100000001b3ull)
+
+// Start of every entry, the code follows it
+typedef struct {
+  uint32_t magic;
+  uint32_t relocs; // Absolute addresses to patch, entries only hold 0
+  uint64_t key;
+  uint64_t code_size;
+  uint64_t scan_reach;
+  uint64_t max_reach;
+  uint8_t pad[24]; // The code starts 64 bytes in
+} cache_header;
+
+typedef struct {
+  char name[32];
+  uint64_t size;
+  int64_t mtime;
+} cache_file;
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len) {
+  const uint8_t *bytes = data;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ bytes[i]) * FNV_PRIME;
+  }
+  return h;
+}
+
+void cache_init(bf_cache *c, const char *dir, uint64_t max_bytes,
+                bf_source *src, bf_target target, bool safe,
+                uint8_t cell_size) {
+  uint64_t h = fnv1a(FNV_OFFSET, BJIT_VERSION, sizeof(BJIT_VERSION));
+
+#ifdef __linux__
+  // A rebuilt bjit can emit different code under the same version
+  struct stat exe;
+  if (stat("/proc/self/exe", &exe) == 0) {
+    h = fnv1a(h, &exe.st_size, sizeof(exe.st_size));
+    h = fnv1a(h, &exe.st_mtime, sizeof(exe.st_mtime));
+  }
+#endif
+
+  uint8_t flags[3] = {(uint8_t)target, safe, cell_size};
+  h = fnv1a(h, flags, sizeof(flags));
+  h = fnv1a(h, &src->len, sizeof(src->len));
+  h = fnv1a(h, src->data, src->len);
+
+  *c = (bf_cache){.dir = dir, .max_bytes = max_bytes, .key = h};
+  mkdir(dir, 0755); // Fails if it's already there
+}
+
+// False if the path doesn't fit, the file is then treated as missing
+static bool cache_path(bf_cache *c, const char *name, char *out,
+                       size_t size) {
+  int n = snprintf(out, size, "%s/%s", c->dir, name);
+  return n >= 0 && (size_t)n < size;
+}
+
+// The hits and misses of every run, "<hits> <misses>" in the stats file
+static bool cache_read_stats(int fd, uint64_t *hits, uint64_t *misses) {
+  char buf[64] = {0};
+  unsigned long long h = 0, m = 0;
+  ssize_t n = pread(fd, buf, sizeof(buf) - 1, 0);
+  bool ok = n > 0 && sscanf(buf, "%llu %llu", &h, &m) == 2;
+  *hits = h;
+  *misses = m;
+  return ok;
+}
+
+static void cache_count(bf_cache *c, bool hit) {
+  char path[CACHE_PATH_MAX];
+  if (!cache_path(c, CACHE_STATS_FILE, path, sizeof(path))) {
+    return;
+  }
+  int fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    return;
+  }
+
+  // Runs of bjit share the file
+  flock(fd, LOCK_EX);
+  uint64_t hits, misses;
+  cache_read_stats(fd, &hits, &misses);
+  hits += hit;
+  misses += !hit;
+
+  char buf[64];
+  int n = snprintf(buf, sizeof(buf), "%llu %llu\n", (unsigned long long)hits,
+                   (unsigned long long)misses);
+  if (pwrite(fd, buf, n, 0) == n) {
+    ftruncate(fd, n);
+  }
+  close(fd);
+}
+
+bool cache_load(bf_cache *c, bf_cache_entry *entry) {
+  char name[32], path[CACHE_PATH_MAX];
+  snprintf(name, sizeof(name), "%016llx" CACHE_SUFFIX,
+           (unsigned long long)c->key);
+
+  int fd = cache_path(c, name, path, sizeof(path)) ? open(path, O_RDONLY) : -1;
+  if (fd < 0) {
+    cache_count(c, false);
+    return false;
+  }
+
+  struct stat st;
+  uint8_t *map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(cache_header)) {
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_EXEC, MAP_PRIVATE, fd, 0);
+  }
+
+  cache_header *header = (cache_header *)map;
+  bool hit = map != MAP_FAILED && header->magic == CACHE_MAGIC &&
+             header->key == c->key && header->relocs == 0 &&
+             sizeof(cache_header) + header->code_size == (size_t)st.st_size;
+  if (hit) {
+    futimens(fd, NULL); // Most recently used, for the eviction
+    *entry = (bf_cache_entry){
+        .map = map,
+        .map_size = st.st_size,
+        .code = (bf_native_fn)(map + sizeof(cache_header)),
+        .scan_reach = header->scan_reach,
+        .max_reach = header->max_reach};
+  } else if (map != MAP_FAILED) {
+    munmap(map, st.st_size);
+  }
+
+  close(fd);
+  cache_count(c, hit);
+  return hit;
+}
+
+void cache_unmap(bf_cache_entry *entry) {
+  munmap(entry->map, entry->map_size);
+  entry->map = NULL;
+}
+
+static int compare_mtimes(const void *a, const void *b) {
+  const cache_file *x = a, *y = b;
+  return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+// Every entry in the cache, the count is returned and the bytes in *total
+static cache_file *cache_list(bf_cache *c, uint32_t *count, uint64_t *total) {
+  uint32_t max = 64;
+  cache_file *files = malloc(sizeof(cache_file) * max);
+  *count = 0;
+  *total = 0;
+
+  DIR *dir = opendir(c->dir);
+  if (dir == NULL) {
+    return files;
+  }
+
+  struct dirent *ent;
+  while ((ent = readdir(dir)) != NULL) {
+    size_t len = strlen(ent->d_name);
+    size_t suffix = strlen(CACHE_SUFFIX);
+    if (len <= suffix || len >= sizeof(files->name) ||
+        strcmp(ent->d_name + len - suffix, CACHE_SUFFIX) != 0) {
+      continue;
+    }
+
+    char path[CACHE_PATH_MAX];
+    struct stat st;
+    if (!cache_path(c, ent->d_name, path, sizeof(path)) ||
+        stat(path, &st) != 0) {
+      continue;
+    }
+
+    if (*count == max) {
+      max *= 2;
+      files = realloc(files, sizeof(cache_file) * max);
+    }
+    cache_file *f = &files[(*count)++];
+    snprintf(f->name, sizeof(f->name), "%s", ent->d_name);
+    f->size = st.st_size;
+    f->mtime = st.st_mtime;
+    *total += st.st_size;
+  }
+  closedir(dir);
+
+  return files;
+}
+
+// Least recently used first, until everything fits in max_bytes
+static void cache_evict(bf_cache *c) {
+  uint32_t count;
+  uint64_t total;
+  cache_file *files = cache_list(c, &count, &total);
+  qsort(files, count, sizeof(cache_file), compare_mtimes);
+
+  for (uint32_t i = 0; i < count && total > c->max_bytes; i++) {
+    char path[CACHE_PATH_MAX];
+    if (cache_path(c, files[i].name, path, sizeof(path)) &&
+        unlink(path) == 0) {
+      total -= files[i].size;
+    }
+  }
+
+  free(files);
+}
+
+void cache_store(bf_cache *c, microasm *bin, uint64_t scan_reach,
+                 uint64_t max_reach) {
+  // NOTE: A failed store is quiet, the next run just misses again
+  char name[48], path[CACHE_PATH_MAX], tmp_path[CACHE_PATH_MAX];
+  snprintf(name, sizeof(name), "%016llx" CACHE_SUFFIX,
+           (unsigned long long)c->key);
+  if (!cache_path(c, name, path, sizeof(path))) {
+    return;
+  }
+  snprintf(name, sizeof(name), "%016llx" CACHE_SUFFIX ".%d.tmp",
+           (unsigned long long)c->key, (int)getpid());
+  if (!cache_path(c, name, tmp_path, sizeof(tmp_path))) {
+    return;
+  }
+
+  FILE *f = fopen(tmp_path, "w");
+  if (f == NULL) {
+    return;
+  }
+
+  uint8_t *code = (uint8_t *)(bin->dest_end - bin->dest_size);
+  cache_header header = {.magic = CACHE_MAGIC,
+                         .key = c->key,
+                         .code_size = bin->dest - code,
+                         .scan_reach = scan_reach,
+                         .max_reach = max_reach};
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            fwrite(code, header.code_size, 1, f) == 1;
+  ok &= fclose(f) == 0;
+
+  // NOTE: Readers only ever see a whole entry, or none
+  if (!ok || rename(tmp_path, path) != 0) {
+    unlink(tmp_path);
+    return;
+  }
+
+  cache_evict(c);
+}
+
+void cache_report(bf_cache *c) {
+  char path[CACHE_PATH_MAX];
+  uint64_t hits = 0, misses = 0;
+  int fd = cache_path(c, CACHE_STATS_FILE, path, sizeof(path))
+               ? open(path, O_RDONLY)
+               : -1;
+  if (fd >= 0) {
+    cache_read_stats(fd, &hits, &misses);
+    close(fd);
+  }
+
+  uint32_t count;
+  uint64_t total;
+  free(cache_list(c, &count, &total));
+
+  uint64_t runs = hits + misses;
+  fprintf(stderr,
+          "cache: %llu hits, %llu misses (%.1f%% hit rate), %u entries, "
+          "%.2f of %.2f MB\n",
+          (unsigned long long)hits, (unsigned long long)misses,
+          runs > 0 ? 100.0 * hits / runs : 0.0, count,
+          total / (1024.0 * 1024), c->max_bytes / (1024.0 * 1024));
+}
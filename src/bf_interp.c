@@ -0,0 +1,284 @@
+#include "bf_interp.h"
+#include "bf_backend.h"
+#include "bf_tape.h"
+#include "stack.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// NOTE: The tokens are translated once into a flat array of instructions
+// with their jump targets resolved to pointers. With GCC/Clang each
+// instruction also holds the address of its handler, so dispatch is a
+// single indirect jump (direct threading). Other compilers get a switch.
+#ifndef INTERP_THREADED
+#if defined(__GNUC__)
+#define INTERP_THREADED (1)
+#else
+#define INTERP_THREADED (0)
+#endif
+#endif
+
+typedef enum {
+  I_ADD,      // cell[offset] += arg
+  I_SET,      // cell[offset] = arg
+  I_MUL,      // cell[offset] += cell[src_offset] * arg, if that isn't 0
+  I_MOVE,     // Move the pointer by arg cells
+  I_JZ,       // Jump past the matching I_JNZ if the cell is 0
+  I_JNZ,      // Jump past the matching I_JZ if the cell isn't 0
+  I_ADD_JNZ,  // I_ADD then I_JNZ, the end of most counting loops
+  I_MOVE_JNZ, // I_MOVE then I_JNZ, the end of unbalanced loops
+  I_SCAN_R1,  // `[>]`, uses memchr
+  I_SCAN_R,   // Move right by arg cells until the cell is 0
+  I_SCAN_L,   // Move left by arg cells until the cell is 0
+  I_PRINT,
+  I_INPUT,
+  I_TIER_JZ,  // I_JZ that enters native code for the loop once there is some
+  I_TIER_JNZ, // I_JNZ that counts back-edges and enters native code too
+  I_CHECK,    // Stop unless cells offset..check_hi are on the tape
+  I_CHECK_IF, // Same if the cell at arg isn't 0
+  I_GUARD,    // Jump to the unchecked copy if offset..check_hi are on the tape,
+              // testing the ends in arg
+  I_JMP,
+  I_END,
+  I_COUNT
+} interp_op;
+
+typedef struct interp_insn {
+  const void *handler;
+  interp_op op;
+  int32_t offset;
+  int32_t arg;
+  union {
+    struct interp_insn *target; // Jumps and their superinstructions
+    uint32_t jump;              // Index of target while translating
+    int32_t src_offset;         // I_MUL
+  };
+  int32_t check_hi; // Last cell of I_CHECK, I_CHECK_IF and I_GUARD
+} interp_insn;
+
+typedef struct {
+  uint32_t maxSize;
+  uint32_t size;
+  interp_insn *data;
+} insn_list;
+
+static void insns_push(insn_list *insns, interp_insn insn) {
+  if (insns->size == insns->maxSize) {
+    insns->maxSize *= 2;
+    insns->data = realloc(insns->data, sizeof(interp_insn) * insns->maxSize);
+  }
+
+  insns->data[insns->size++] = insn;
+}
+
+static int32_t move_of(Token *tok) {
+  return tok->token == INC_CUR ? (int32_t)tok->token_data
+                               : -(int32_t)tok->token_data;
+}
+
+// With a tier the loops are numbered in arg and never fused, every entry
+// and back-edge goes through I_TIER_JZ / I_TIER_JNZ
+static insn_list translate(TokenList *tokens, bool tiered) {
+  insn_list insns = {.maxSize = tokens->size + 1,
+                     .size = 0,
+                     .data = malloc(sizeof(interp_insn) * (tokens->size + 1))};
+  Stack s_loops = stack_init(1024);
+  Stack s_guards = stack_init(64);
+  uint32_t loop_count = 0;
+  uint32_t joined = UINT32_MAX; // Jump target of the last GUARD_END
+
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token *tok = &tokens->data[i];
+    interp_insn insn = {.offset = tok->offset};
+
+    switch (tok->token) {
+    case ADD:
+    case SUB:
+      insn.op = I_ADD;
+      insn.arg = tok->token == ADD ? (int32_t)tok->token_data
+                                   : -(int32_t)tok->token_data;
+      break;
+    case INC_CUR:
+    case DEC_CUR:
+      insn.op = I_MOVE;
+      insn.arg = move_of(tok);
+      break;
+    case SET_CELL:
+      insn.op = I_SET;
+      insn.arg = tok->token_data;
+      break;
+    case MUL_CELL:
+      insn.op = I_MUL;
+      insn.arg = tok->token_data;
+      insn.src_offset = tok->src_offset;
+      break;
+    case SCAN_RIGHT:
+      insn.op = tok->token_data == 1 ? I_SCAN_R1 : I_SCAN_R;
+      insn.arg = tok->token_data;
+      break;
+    case SCAN_LEFT:
+      insn.op = I_SCAN_L;
+      insn.arg = tok->token_data;
+      break;
+    case PRINT:
+      insn.op = I_PRINT;
+      break;
+    case INPUT:
+      insn.op = I_INPUT;
+      break;
+    case CHECK_BOUNDS:
+    case CHECK_BOUNDS_IF:
+      insn.op = tok->token == CHECK_BOUNDS ? I_CHECK : I_CHECK_IF;
+      insn.arg = (int32_t)tok->token_data;
+      insn.check_hi = tok->check_hi;
+      break;
+    case GUARD_RANGE:
+      insn.op = I_GUARD;
+      insn.arg = (int32_t)tok->token_data;
+      insn.check_hi = tok->check_hi;
+      stack_push(&s_guards, insns.size);
+      break;
+    case GUARD_ELSE: {
+      uint32_t guard;
+      stack_pop(&s_guards, &guard);
+      insns.data[guard].jump = insns.size + 1;
+      insn.op = I_JMP;
+      stack_push(&s_guards, insns.size);
+      break;
+    }
+    case GUARD_END: {
+      uint32_t jmp;
+      stack_pop(&s_guards, &jmp);
+      insns.data[jmp].jump = insns.size;
+      joined = insns.size;
+      continue; // Nothing to run
+    }
+    case JUMP_IF_ZERO:
+      insn.op = tiered ? I_TIER_JZ : I_JZ;
+      insn.arg = loop_count++;
+      stack_push(&s_loops, insns.size);
+      break;
+    case JUMP_IF_NOT_ZERO: {
+      uint32_t lpos;
+      stack_pop(&s_loops, &lpos);
+      insn.op = I_JNZ;
+
+      if (tiered) {
+        insn.op = I_TIER_JNZ;
+        insn.arg = insns.data[lpos].arg;
+        insn.jump = lpos + 1;
+        insns.data[lpos].jump = insns.size + 1;
+        break;
+      }
+
+      // Fuse the move or add right before the ']' into it, unless the
+      // checked copy of a guarded body jumps in between
+      interp_insn *prev = insns.size > lpos + 1 && joined != insns.size
+                              ? &insns.data[insns.size - 1]
+                              : NULL;
+      if (prev != NULL && prev->op == I_MOVE) {
+        insn = *prev;
+        insn.op = I_MOVE_JNZ;
+        insns.size--;
+      } else if (prev != NULL && prev->op == I_ADD) {
+        insn = *prev;
+        insn.op = I_ADD_JNZ;
+        insns.size--;
+      }
+
+      insn.jump = lpos + 1;
+      insns.data[lpos].jump = insns.size + 1;
+      break;
+    }
+    }
+
+    insns_push(&insns, insn);
+  }
+
+  insns_push(&insns, (interp_insn){.op = I_END});
+  stack_free(&s_loops);
+  stack_free(&s_guards);
+
+  for (uint32_t i = 0; i < insns.size; i++) {
+    interp_insn *insn = &insns.data[i];
+    if (insn->op == I_JZ || insn->op == I_JNZ || insn->op == I_ADD_JNZ ||
+        insn->op == I_MOVE_JNZ || insn->op == I_TIER_JZ ||
+        insn->op == I_TIER_JNZ || insn->op == I_GUARD || insn->op == I_JMP) {
+      insn->target = insns.data + insn->jump;
+    }
+  }
+
+  return insns;
+}
+
+typedef struct {
+  uint8_t *volatile out_pos; // Read by the tape's fault handler
+  uint8_t *in_pos;
+  uint8_t *in_end;
+  uint8_t out[OUTPUT_BUF_SIZE];
+  uint8_t in[INPUT_BUF_SIZE];
+} interp_io;
+
+static void interp_flush(interp_io *io) {
+  uint8_t *pos = io->out;
+
+  // write() can return early, loop until the whole buffer is out
+  while (pos < io->out_pos) {
+    ssize_t n = write(STDOUT_FILENO, pos, io->out_pos - pos);
+    if (n <= 0) {
+      break;
+    }
+    pos += n;
+  }
+
+  io->out_pos = io->out;
+}
+
+// Returns false on EOF, the output is flushed first like the JIT does
+static bool interp_refill(interp_io *io) {
+  interp_flush(io);
+
+  ssize_t n = read(STDIN_FILENO, io->in, INPUT_BUF_SIZE);
+  io->in_pos = io->in;
+  io->in_end = io->in + (n > 0 ? n : 0);
+  return n > 0;
+}
+
+#define INTERP_CELL uint8_t
+#define INTERP_RUN interp_run_8
+#include "bf_interp_run.h"
+
+#define INTERP_CELL uint16_t
+#define INTERP_RUN interp_run_16
+#include "bf_interp_run.h"
+
+#define INTERP_CELL uint32_t
+#define INTERP_RUN interp_run_32
+#include "bf_interp_run.h"
+
+void interpret_bf(TokenList *tokens, bf_data *bf, bf_tier *tier) {
+  insn_list insns = translate(tokens, tier != NULL);
+
+  interp_io *io = malloc(sizeof(interp_io));
+  io->out_pos = io->out;
+  io->in_pos = io->in_end = io->in;
+  tape_watch_output(io->out, &io->out_pos);
+
+  switch (bf->cell_size) {
+  case 2:
+    interp_run_16(&insns, bf, tier, io);
+    break;
+  case 4:
+    interp_run_32(&insns, bf, tier, io);
+    break;
+  default:
+    interp_run_8(&insns, bf, tier, io);
+    break;
+  }
+
+  tape_watch_output(NULL, NULL);
+  free(io);
+  free(insns.data);
+}
@@ -0,0 +1,236 @@
+// NOTE: The body of the interpreter, included by bf_interp.c once per cell
+// width with INTERP_CELL set to the cell type and INTERP_RUN to the name of
+// the function. Computed goto rules out sharing one function that's inlined
+// per width.
+
+static void INTERP_RUN(insn_list *insns, bf_data *bf, bf_tier *tier,
+                       interp_io *io) {
+  INTERP_CELL *p = (INTERP_CELL *)bf->data + bf->position;
+  INTERP_CELL *tape = (INTERP_CELL *)bf->tape;
+  INTERP_CELL *tape_end = (INTERP_CELL *)bf->tape_end;
+  INTERP_CELL *classic_end = (INTERP_CELL *)bf->data + BF_TAPE_SIZE;
+  interp_insn *ip = insns->data;
+
+#if INTERP_THREADED
+  static const void *const labels[I_COUNT] = {
+      [I_ADD] = &&op_I_ADD,         [I_SET] = &&op_I_SET,
+      [I_MUL] = &&op_I_MUL,         [I_MOVE] = &&op_I_MOVE,
+      [I_JZ] = &&op_I_JZ,           [I_JNZ] = &&op_I_JNZ,
+      [I_ADD_JNZ] = &&op_I_ADD_JNZ, [I_MOVE_JNZ] = &&op_I_MOVE_JNZ,
+      [I_SCAN_R1] = &&op_I_SCAN_R1, [I_SCAN_R] = &&op_I_SCAN_R,
+      [I_SCAN_L] = &&op_I_SCAN_L,   [I_PRINT] = &&op_I_PRINT,
+      [I_INPUT] = &&op_I_INPUT,     [I_TIER_JZ] = &&op_I_TIER_JZ,
+      [I_TIER_JNZ] = &&op_I_TIER_JNZ, [I_CHECK] = &&op_I_CHECK,
+      [I_CHECK_IF] = &&op_I_CHECK_IF, [I_GUARD] = &&op_I_GUARD,
+      [I_JMP] = &&op_I_JMP,           [I_END] = &&op_I_END};
+
+  for (uint32_t i = 0; i < insns->size; i++) {
+    insns->data[i].handler = labels[insns->data[i].op];
+  }
+
+#define OP(name) op_##name:
+#define DISPATCH() goto *ip->handler
+#define NEXT()                                                                 \
+  do {                                                                         \
+    ip++;                                                                      \
+    DISPATCH();                                                                \
+  } while (0)
+
+  DISPATCH();
+#else
+#define OP(name) case name:
+// NOTE: No do/while here, continue has to reach the dispatch loop
+#define NEXT()                                                                 \
+  {                                                                            \
+    ip++;                                                                      \
+    continue;                                                                  \
+  }
+#define DISPATCH() continue
+
+  for (;;) {
+    switch (ip->op) {
+#endif
+
+  OP(I_ADD) {
+    p[ip->offset] += ip->arg;
+    NEXT();
+  }
+  OP(I_SET) {
+    p[ip->offset] = ip->arg;
+    NEXT();
+  }
+  OP(I_MUL) {
+    // Like the compiled code, don't touch the cell if the loop never ran
+    INTERP_CELL src = p[ip->src_offset];
+    if (src != 0) {
+      p[ip->offset] += (uint32_t)src * (uint32_t)ip->arg;
+    }
+    NEXT();
+  }
+  OP(I_MOVE) {
+    p += ip->arg;
+    NEXT();
+  }
+  OP(I_JZ) {
+    if (p[0] == 0) {
+      ip = ip->target;
+      DISPATCH();
+    }
+    NEXT();
+  }
+  OP(I_ADD_JNZ) {
+    p[ip->offset] += ip->arg;
+    if (p[0] != 0) {
+      ip = ip->target;
+      DISPATCH();
+    }
+    NEXT();
+  }
+  OP(I_MOVE_JNZ) {
+    p += ip->arg;
+    if (p[0] != 0) {
+      ip = ip->target;
+      DISPATCH();
+    }
+    NEXT();
+  }
+  OP(I_JNZ) {
+    if (p[0] != 0) {
+      ip = ip->target;
+      DISPATCH();
+    }
+    NEXT();
+  }
+  OP(I_SCAN_R1) {
+    // memchr only finds zero bytes, wider cells walk
+    if (sizeof(INTERP_CELL) == 1) {
+      INTERP_CELL *zero =
+          p < classic_end ? memchr(p, 0, classic_end - p) : NULL;
+      if (zero != NULL) {
+        p = zero;
+        NEXT();
+      }
+    }
+    // Off the end of the tape, walk like the compiled code would
+    while (*p != 0) {
+      p++;
+    }
+    NEXT();
+  }
+  OP(I_SCAN_R) {
+    while (*p != 0) {
+      p += ip->arg;
+    }
+    NEXT();
+  }
+  OP(I_SCAN_L) {
+    while (*p != 0) {
+      p -= ip->arg;
+    }
+    NEXT();
+  }
+  OP(I_PRINT) {
+    *io->out_pos++ = (uint8_t)p[ip->offset]; // The low byte
+    if (io->out_pos == io->out + OUTPUT_BUF_SIZE) {
+      interp_flush(io);
+    }
+    NEXT();
+  }
+  OP(I_INPUT) {
+    // EOF leaves the cell as is
+    if (io->in_pos != io->in_end || interp_refill(io)) {
+      p[ip->offset] = *io->in_pos++;
+    }
+    NEXT();
+  }
+  // NOTE: On-stack replacement only happens at the head of a loop, where
+  // the tape pointer is all the state there is. The native code runs the
+  // rest of the loop and returns the pointer once the cell is 0.
+  OP(I_TIER_JZ) {
+    if (p[0] == 0) {
+      ip = ip->target;
+      DISPATCH();
+    }
+
+    bf_native_fn native = tier_native(tier, ip->arg);
+    if (native != NULL) {
+      interp_flush(io);
+      p = (INTERP_CELL *)native((uint8_t *)p, bf->tape, bf->tape_end,
+                                BF_STDIO_FDS);
+      if (p == NULL) {
+        goto out_of_bounds;
+      }
+      ip = ip->target;
+      DISPATCH();
+    }
+    NEXT();
+  }
+  OP(I_TIER_JNZ) {
+    if (p[0] == 0) {
+      NEXT();
+    }
+
+    bf_native_fn native = tier_native(tier, ip->arg);
+    if (native != NULL) {
+      interp_flush(io);
+      p = (INTERP_CELL *)native((uint8_t *)p, bf->tape, bf->tape_end,
+                                BF_STDIO_FDS);
+      if (p == NULL) {
+        goto out_of_bounds;
+      }
+      NEXT();
+    }
+
+    tier_backedge(tier, ip->arg);
+    ip = ip->target;
+    DISPATCH();
+  }
+  OP(I_CHECK) {
+    if (p + ip->offset < tape || p + ip->check_hi >= tape_end) {
+      goto out_of_bounds;
+    }
+    NEXT();
+  }
+  OP(I_CHECK_IF) {
+    if (p[ip->arg] != 0 &&
+        (p + ip->offset < tape || p + ip->check_hi >= tape_end)) {
+      goto out_of_bounds;
+    }
+    NEXT();
+  }
+  OP(I_GUARD) {
+    if ((!(ip->arg & BOUNDS_LO) || p + ip->offset >= tape) &&
+        (!(ip->arg & BOUNDS_HI) || p + ip->check_hi < tape_end)) {
+      ip = ip->target;
+      DISPATCH();
+    }
+    NEXT();
+  }
+  OP(I_JMP) {
+    ip = ip->target;
+    DISPATCH();
+  }
+  OP(I_END) { goto done; }
+
+#if !INTERP_THREADED
+    default:
+      goto done;
+    }
+  }
+#endif
+
+#undef OP
+#undef NEXT
+#undef DISPATCH
+
+out_of_bounds:
+  interp_flush(io);
+  bf_out_of_bounds();
+
+done:
+  interp_flush(io);
+  bf->position = p - (INTERP_CELL *)bf->data;
+}
+
+#undef INTERP_CELL
+#undef INTERP_RUN
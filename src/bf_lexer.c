@@ -1,129 +1,96 @@
 #include "bf_lexer.h"
 #include "stack.h"
 #include <memory.h>
-#include <stdio.h>
 #include <stdlib.h>
 
-#define ARR_INC_SIZE (1024)
+#define ARR_INIT_SIZE (1024)
 
-Token *tokenize_bf(FILE *bf_file) {
-
-  int next_tok_loc = 0;
-  int cur_bf_tok_size = 1024;
-  Token *bf_tokens = malloc(sizeof(Token) * cur_bf_tok_size);
-
-  int oper_bin;
-
-  while ((oper_bin = fgetc(bf_file)) != EOF) {
-    if (next_tok_loc == cur_bf_tok_size) {
-      bf_tokens = realloc(bf_tokens, cur_bf_tok_size + ARR_INC_SIZE);
-      cur_bf_tok_size += ARR_INC_SIZE;
-    }
+static void tokens_push(TokenList *tokens, Token token) {
+  if (tokens->size == tokens->maxSize) {
+    tokens->maxSize *= 2;
+    tokens->data = realloc(tokens->data, sizeof(Token) * tokens->maxSize);
+  }
 
-    char oper = (char)oper_bin;
-    Stack s_loops = stack_init(1024 * 8);
+  tokens->data[tokens->size++] = token;
+}
 
-    uint32_t loop_id = 0;
+// Maps every byte of the source to its token + 1, 0 means comment
+static const uint8_t lexer_table[256] = {
+    ['+'] = ADD + 1,          ['-'] = SUB + 1,
+    ['>'] = INC_CUR + 1,      ['<'] = DEC_CUR + 1,
+    ['['] = JUMP_IF_ZERO + 1, [']'] = JUMP_IF_NOT_ZERO + 1,
+    ['.'] = PRINT + 1,        [','] = INPUT + 1,
+};
+
+// Unmatched brackets free everything, set *error and return no tokens
+static TokenList lexer_fail(TokenList *tokens, Stack *s_loops,
+                            const char **error, const char *message) {
+  tokens_free(tokens);
+  stack_free(s_loops);
+  *error = message;
+  return (TokenList){.data = NULL};
+}
 
-    switch (oper) {
-    case '>': {
-      int count = 1;
-      int ch_int = 0;
-      while ((ch_int = fgetc(bf_file)) != EOF) {
-        char ch = (char)ch_int;
+TokenList tokenize_bf(const char *src, size_t len, const char **error,
+                      bf_timings *timings) {
+  TokenList tokens = {.maxSize = ARR_INIT_SIZE,
+                      .size = 0,
+                      .data = malloc(sizeof(Token) * ARR_INIT_SIZE)};
 
-        if (ch != '>') {
-          ungetc(ch, bf_file);
-          break;
-        }
+  Stack s_loops = stack_init(1024);
 
-        count++;
-      }
+  for (size_t i = 0; i < len; i++) {
+    uint8_t op_bin = lexer_table[(uint8_t)src[i]];
 
-      Token token = {.token = INC_CUR, .token_data = count};
-      bf_tokens[next_tok_loc] = token;
-      break;
+    // Everything else is a comment
+    if (op_bin == 0) {
+      continue;
     }
 
-    case '<': {
-      int count = 1;
-      int ch_int = 0;
-      while ((ch_int = fgetc(bf_file)) != EOF) {
-        char ch = (char)ch_int;
-
-        if (ch != '<') {
-          ungetc(ch, bf_file);
-          break;
-        }
+    token_t op = (token_t)(op_bin - 1);
 
-        count++;
-      }
-
-      Token token = {.token = DEC_CUR, .token_data = count};
-      bf_tokens[next_tok_loc] = token;
-      break;
+    // Combine runs of the same operation into 1 token
+    if (op <= DEC_CUR && tokens.size > 0 &&
+        tokens.data[tokens.size - 1].token == op) {
+      tokens.data[tokens.size - 1].token_data++;
+      continue;
     }
 
-    case '+': {
-      int count = 1;
-      int ch_int = 0;
-      while ((ch_int = fgetc(bf_file)) != EOF) {
-        char ch = (char)ch_int;
-
-        if (ch != '+') {
-          ungetc(ch, bf_file);
-          break;
-        }
+    Token token = {.token = op, .token_data = 1, .offset = 0, .jump = 0};
 
-        count++;
-      }
-
-      Token token = {.token = ADD, .token_data = count};
-      bf_tokens[next_tok_loc] = token;
-      break;
+    // Brackets keep where they are in the source, for --profile
+    if (op == JUMP_IF_ZERO || op == JUMP_IF_NOT_ZERO) {
+      token.token_data = (uint32_t)i;
     }
 
-    case '-': {
-      int count = 1;
-      int ch_int = 0;
-      while ((ch_int = fgetc(bf_file)) != EOF) {
-        char ch = (char)ch_int;
-
-        if (ch != '-') {
-          ungetc(ch, bf_file);
-          break;
-        }
-
-        count++;
+    if (op == JUMP_IF_ZERO) {
+      stack_push(&s_loops, tokens.size);
+    } else if (op == JUMP_IF_NOT_ZERO) {
+      uint32_t loop_pos;
+      if (!stack_pop(&s_loops, &loop_pos)) {
+        return lexer_fail(&tokens, &s_loops, error, "extra ']' in bf code");
       }
 
-      Token token = {.token = SUB, .token_data = count};
-      bf_tokens[next_tok_loc] = token;
-      break;
+      token.jump = loop_pos;
+      tokens.data[loop_pos].jump = tokens.size;
     }
 
-    case '[': {
-      uint32_t *cur_loop_pos = malloc(4);
-      *cur_loop_pos = loop_id++;
-      stack_push(&s_loops, &cur_loop_pos);
-
-      Token token = {.token = JUMP_IF_ZERO, .token_data = loop_id};
-      bf_tokens[next_tok_loc] = token;
-      break;
-    }
+    tokens_push(&tokens, token);
+  }
 
-    case ']': {
-      uint32_t *relative_loop_pos = stack_pop(&s_loops);
+  if (s_loops.size != 0) {
+    return lexer_fail(&tokens, &s_loops, error, "Missing ']'");
+  }
 
-      Token token = {.token = JUMP_IF_NOT_ZERO,
-                     .token_data = *relative_loop_pos};
-      bf_tokens[next_tok_loc] = token;
-      break;
-    }
-    }
+  timings_stack(timings, &s_loops);
+  stack_free(&s_loops);
 
-    next_tok_loc++;
-  }
+  return tokens;
+}
 
-  return NULL;
+void tokens_free(TokenList *tokens) {
+  free(tokens->data);
+  tokens->data = NULL;
+  tokens->size = 0;
+  tokens->maxSize = 0;
 }
@@ -0,0 +1,796 @@
+#include "bf_opt.h"
+#include "stack.h"
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define MUL_MAX_CELLS (16)
+#define MUL_MAX_OFFSET (4095)
+
+// Recomputes the matching bracket indices after a pass moved tokens around
+static void tokens_link(TokenList *tokens) {
+  Stack s_loops = stack_init(1024);
+
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token *tok = &tokens->data[i];
+
+    if (tok->token == JUMP_IF_ZERO) {
+      stack_push(&s_loops, i);
+    } else if (tok->token == JUMP_IF_NOT_ZERO) {
+      uint32_t loop_pos;
+      stack_pop(&s_loops, &loop_pos);
+      tok->jump = loop_pos;
+      tokens->data[loop_pos].jump = i;
+    }
+  }
+
+  stack_free(&s_loops);
+}
+
+// Inverse of an odd number modulo 2^32, which is also its inverse modulo
+// every smaller power of two (Newton's iteration doubles the correct bits)
+static uint32_t mod_inverse(uint32_t d) {
+  uint32_t x = d;
+  for (int i = 0; i < 4; i++) {
+    x *= 2 - d * x;
+  }
+  return x;
+}
+
+// `[-]`, `[+]` and any other loop that only adds an odd amount to the
+// current cell always ends with the cell at 0
+static bool is_clear_loop(TokenList *tokens, uint32_t i) {
+  if (i + 2 >= tokens->size) {
+    return false;
+  }
+
+  Token *body = &tokens->data[i + 1];
+  return tokens->data[i].token == JUMP_IF_ZERO &&
+         (body->token == ADD || body->token == SUB) &&
+         (body->token_data & 1) && body->offset == 0 &&
+         tokens->data[i + 2].token == JUMP_IF_NOT_ZERO;
+}
+
+static void opt_clear_loops(TokenList *tokens) {
+  uint32_t out = 0;
+
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token tok = tokens->data[i];
+
+    if (is_clear_loop(tokens, i)) {
+      tok = (Token){.token = SET_CELL, .token_data = 0, .offset = 0};
+      i += 2;
+    }
+
+    tokens->data[out++] = tok;
+  }
+
+  tokens->size = out;
+  tokens_link(tokens);
+}
+
+// `[>]`, `[<<]` and friends move until they find a zero cell
+static void opt_scan_loops(TokenList *tokens) {
+  uint32_t out = 0;
+
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token tok = tokens->data[i];
+
+    if (tok.token == JUMP_IF_ZERO && tok.jump == i + 2) {
+      Token *body = &tokens->data[i + 1];
+
+      if (body->token == INC_CUR || body->token == DEC_CUR) {
+        tok = (Token){.token = body->token == INC_CUR ? SCAN_RIGHT : SCAN_LEFT,
+                      .token_data = body->token_data,
+                      .offset = 0};
+        i += 2;
+      }
+    }
+
+    tokens->data[out++] = tok;
+  }
+
+  tokens->size = out;
+  tokens_link(tokens);
+}
+
+// Balanced loops that only add constants to cells, like `[->+>+++<<]`, run
+// (cell * -1/d) times where d is what one iteration adds to the loop cell.
+// That's a closed form as long as d is odd, so the loop becomes one MUL_CELL
+// per touched cell followed by clearing the loop cell.
+static uint32_t mul_loop(TokenList *tokens, uint32_t i, Token *out) {
+  Token *tok = tokens->data;
+  uint32_t end = tok[i].jump;
+
+  int32_t offsets[MUL_MAX_CELLS];
+  uint32_t deltas[MUL_MAX_CELLS];
+  uint32_t cells = 1;
+  offsets[0] = 0;
+  deltas[0] = 0;
+
+  int32_t offset = 0;
+  for (uint32_t j = i + 1; j < end; j++) {
+    switch (tok[j].token) {
+    case INC_CUR:
+      offset += tok[j].token_data;
+      break;
+    case DEC_CUR:
+      offset -= tok[j].token_data;
+      break;
+    case ADD:
+    case SUB: {
+      if (offset > MUL_MAX_OFFSET || offset < -MUL_MAX_OFFSET) {
+        return 0;
+      }
+
+      uint32_t c = 0;
+      while (c < cells && offsets[c] != offset) {
+        c++;
+      }
+      if (c == cells) {
+        if (cells == MUL_MAX_CELLS) {
+          return 0;
+        }
+        offsets[cells] = offset;
+        deltas[cells++] = 0;
+      }
+
+      if (tok[j].token == ADD) {
+        deltas[c] += tok[j].token_data;
+      } else {
+        deltas[c] -= tok[j].token_data;
+      }
+      break;
+    }
+    default:
+      return 0;
+    }
+  }
+
+  if (offset != 0 || (deltas[0] & 1) == 0) {
+    return 0;
+  }
+
+  uint32_t step = -mod_inverse(deltas[0]);
+  uint32_t count = 0;
+  for (uint32_t c = 1; c < cells; c++) {
+    if (deltas[c] != 0) {
+      out[count++] = (Token){.token = MUL_CELL,
+                             .token_data = deltas[c] * step,
+                             .offset = offsets[c],
+                             .src_offset = 0};
+    }
+  }
+  out[count++] = (Token){.token = SET_CELL, .token_data = 0, .offset = 0};
+
+  return count;
+}
+
+static void opt_mul_loops(TokenList *tokens) {
+  uint32_t out = 0;
+  Token mul[MUL_MAX_CELLS];
+
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token tok = tokens->data[i];
+
+    if (tok.token == JUMP_IF_ZERO) {
+      uint32_t count = mul_loop(tokens, i, mul);
+
+      // The replacement is never longer than the loop it replaces
+      if (count > 0) {
+        uint32_t end = tok.jump;
+        for (uint32_t c = 0; c < count; c++) {
+          tokens->data[out++] = mul[c];
+        }
+        i = end;
+        continue;
+      }
+    }
+
+    tokens->data[out++] = tok;
+  }
+
+  tokens->size = out;
+  tokens_link(tokens);
+}
+
+// Pointer moves inside a basic block are folded into the offsets of the
+// operations that follow them: `>+>+>+<<<` becomes ADD@1 ADD@2 ADD@3 with no
+// moves at all. The pointer is only moved, once, before anything that needs
+// it to be exact: loops, scans and the end of the program.
+static void opt_fold_offsets(TokenList *tokens) {
+  uint32_t out = 0;
+  int32_t offset = 0;
+
+  // Never longer than the input, each flush replaces at least one move
+  for (uint32_t i = 0; i <= tokens->size; i++) {
+    Token tok = {.token = JUMP_IF_ZERO};
+    if (i < tokens->size) {
+      tok = tokens->data[i];
+    }
+
+    switch (tok.token) {
+    case INC_CUR:
+      offset += tok.token_data;
+      continue;
+    case DEC_CUR:
+      offset -= tok.token_data;
+      continue;
+    case ADD:
+    case SUB:
+    case SET_CELL:
+    case PRINT:
+    case INPUT:
+      tok.offset += offset;
+      break;
+    case MUL_CELL:
+      tok.offset += offset;
+      tok.src_offset += offset;
+      break;
+    case JUMP_IF_ZERO:
+    case JUMP_IF_NOT_ZERO:
+    case SCAN_RIGHT:
+    case SCAN_LEFT:
+      if (offset != 0) {
+        tokens->data[out++] = (Token){
+            .token = offset > 0 ? INC_CUR : DEC_CUR,
+            .token_data = offset > 0 ? offset : -offset,
+            .offset = 0};
+        offset = 0;
+      }
+      break;
+    default: // --safe tokens are only added after this
+      break;
+    }
+
+    if (i < tokens->size) {
+      tokens->data[out++] = tok;
+    }
+  }
+
+  tokens->size = out;
+  tokens_link(tokens);
+}
+
+// Folds the arithmetic around SET_CELL into the constant: `[-]+++` becomes
+// SET_CELL 3, and the `+` of `+[-]` is dropped since the store overwrites it
+static void opt_fold_sets(TokenList *tokens) {
+  uint32_t out = 0;
+
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token tok = tokens->data[i];
+
+    if (out > 0) {
+      Token *prev = &tokens->data[out - 1];
+
+      if (prev->token == SET_CELL && prev->offset == tok.offset) {
+        if (tok.token == ADD) {
+          prev->token_data += tok.token_data;
+          continue;
+        }
+        if (tok.token == SUB) {
+          prev->token_data -= tok.token_data;
+          continue;
+        }
+      }
+
+      if (tok.token == SET_CELL && prev->offset == tok.offset &&
+          (prev->token == ADD || prev->token == SUB ||
+           prev->token == SET_CELL)) {
+        *prev = tok;
+        continue;
+      }
+    }
+
+    tokens->data[out++] = tok;
+  }
+
+  tokens->size = out;
+  tokens_link(tokens);
+}
+
+void optimize_bf(TokenList *tokens, bf_timings *timings) {
+  opt_clear_loops(tokens);
+  timings_phase(timings, "opt: clear loops");
+  opt_scan_loops(tokens);
+  timings_phase(timings, "opt: scan loops");
+  opt_mul_loops(tokens);
+  timings_phase(timings, "opt: mul loops");
+  opt_fold_offsets(tokens);
+  timings_phase(timings, "opt: fold offsets");
+  opt_fold_sets(tokens);
+  timings_phase(timings, "opt: fold sets");
+}
+
+// NOTE: In --safe mode the program may only touch cells on the tape. A
+// CHECK_BOUNDS in front of a run of operations covers all of them with one
+// range, up to the next move, loop, scan or I/O so no output is lost when a
+// check fails. Ranges that are already known to be on the tape aren't
+// checked again, and only the ends that stick out of them are tested.
+//
+// That's still a few checks per iteration in a loop. Loops that touch the
+// same cells every iteration (balanced, with only balanced loops inside) or
+// that move by a constant stride have the range of one iteration known up
+// front, including their inner loops and MUL_CELL targets. They are
+// versioned: a GUARD_RANGE tests that range, on the loop's entry if it's
+// balanced or every iteration if it moves, and picks between an unchecked
+// copy and the checked one. The checked copy only runs when the program is
+// about to fail or touches cells the range says it might but doesn't.
+//
+// Only loops with a scan or a loop that moves by a data dependent amount
+// inside are left with checks on every run of operations.
+
+// Loops with more tokens than this only get the checked copy, so code size
+// stays linear in the nesting depth
+#define GUARD_MAX_TOKENS (256)
+
+typedef enum { LOOP_BALANCED, LOOP_STRIDE, LOOP_DYNAMIC } loop_kind;
+
+// Cell offsets relative to the pointer, empty when lo > hi
+typedef struct {
+  int64_t lo;
+  int64_t hi;
+} cell_range;
+
+#define RANGE_EMPTY ((cell_range){.lo = 0, .hi = -1})
+#define RANGE_CURRENT ((cell_range){.lo = 0, .hi = 0})
+
+// Every cell one iteration of a loop can touch, relative to the pointer at
+// the '['
+typedef struct {
+  loop_kind kind;
+  cell_range cells;
+  int64_t stride; // Net move of one iteration
+} loop_range;
+
+typedef struct {
+  uint32_t id;
+  uint32_t lpos;
+  int64_t pos; // Net move since the '['
+  cell_range cells;
+  bool dynamic; // Moves by a data dependent amount
+  bool moves;   // Doesn't end on the cell it started on
+  bool guarded;
+} loop_frame;
+
+static cell_range range_add(cell_range r, int64_t offset) {
+  if (r.lo > r.hi) {
+    return (cell_range){.lo = offset, .hi = offset};
+  }
+  if (offset < r.lo) {
+    r.lo = offset;
+  }
+  if (offset > r.hi) {
+    r.hi = offset;
+  }
+  return r;
+}
+
+static cell_range range_union(cell_range a, cell_range b) {
+  if (b.lo > b.hi) {
+    return a;
+  }
+  return range_add(range_add(a, b.lo), b.hi);
+}
+
+static bool range_covers(cell_range r, cell_range sub) {
+  return sub.lo > sub.hi || (r.lo <= sub.lo && sub.hi <= r.hi);
+}
+
+// Both ranges are on the tape, keep the one that says more if they aren't
+// contiguous
+static cell_range range_merge(cell_range known, cell_range r) {
+  if (known.lo > known.hi) {
+    return r;
+  }
+  if (r.lo <= known.hi + 1 && known.lo <= r.hi + 1) {
+    return range_union(known, r);
+  }
+  return r.hi - r.lo > known.hi - known.lo ? r : known;
+}
+
+static bool range_fits(cell_range r) {
+  return r.lo >= INT32_MIN && r.hi <= INT32_MAX;
+}
+
+static loop_frame *frames_push(loop_frame *frames, uint32_t *depth,
+                               uint32_t *max_depth, loop_frame frame) {
+  if (*depth == *max_depth) {
+    *max_depth *= 2;
+    frames = realloc(frames, sizeof(loop_frame) * *max_depth);
+  }
+  frames[(*depth)++] = frame;
+  return frames;
+}
+
+// Classifies every loop, indexed by the order of the '['
+static loop_range *loop_ranges(TokenList *tokens, uint32_t loop_count) {
+  loop_range *loops = malloc(sizeof(loop_range) * (loop_count + 1));
+  uint32_t depth = 0, max_depth = 64;
+  loop_frame *frames = malloc(sizeof(loop_frame) * max_depth);
+  uint32_t next_loop = 0;
+
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token *tok = &tokens->data[i];
+    loop_frame *f = depth > 0 ? &frames[depth - 1] : NULL;
+
+    switch (tok->token) {
+    case INC_CUR:
+    case DEC_CUR:
+      if (f != NULL) {
+        f->pos += tok->token == INC_CUR ? (int64_t)tok->token_data
+                                        : -(int64_t)tok->token_data;
+      }
+      break;
+    case ADD:
+    case SUB:
+    case SET_CELL:
+    case PRINT:
+    case INPUT:
+      if (f != NULL) {
+        f->cells = range_add(f->cells, f->pos + tok->offset);
+      }
+      break;
+    case MUL_CELL:
+      if (f != NULL) {
+        f->cells = range_add(f->cells, f->pos + tok->src_offset);
+        f->cells = range_add(f->cells, f->pos + tok->offset);
+      }
+      break;
+    case SCAN_RIGHT:
+    case SCAN_LEFT:
+      if (f != NULL) {
+        f->dynamic = true;
+      }
+      break;
+    case JUMP_IF_ZERO:
+      frames = frames_push(frames, &depth, &max_depth,
+                           (loop_frame){.id = next_loop++,
+                                        .pos = 0,
+                                        .cells = RANGE_CURRENT,
+                                        .dynamic = false});
+      break;
+    case JUMP_IF_NOT_ZERO: {
+      loop_frame done = frames[--depth];
+      done.cells = range_add(done.cells, done.pos); // The ']' test
+
+      loop_range *loop = &loops[done.id];
+      *loop = (loop_range){
+          .kind = LOOP_DYNAMIC, .cells = done.cells, .stride = done.pos};
+      if (!done.dynamic && range_fits(done.cells)) {
+        loop->kind = done.pos == 0 ? LOOP_BALANCED : LOOP_STRIDE;
+      }
+
+      // The pointer after an unbalanced loop isn't known in its parent
+      if (depth > 0) {
+        loop_frame *parent = &frames[depth - 1];
+        if (loop->kind == LOOP_BALANCED) {
+          parent->cells = range_union(
+              parent->cells, (cell_range){.lo = parent->pos + done.cells.lo,
+                                          .hi = parent->pos + done.cells.hi});
+        } else {
+          parent->dynamic = true;
+        }
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+
+  free(frames);
+  return loops;
+}
+
+static void tokens_append(TokenList *tokens, Token token) {
+  if (tokens->size == tokens->maxSize) {
+    tokens->maxSize *= 2;
+    tokens->data = realloc(tokens->data, sizeof(Token) * tokens->maxSize);
+  }
+  tokens->data[tokens->size++] = token;
+}
+
+static void tokens_append_range(TokenList *tokens, TokenList *from,
+                                uint32_t start, uint32_t end) {
+  for (uint32_t i = start; i < end; i++) {
+    tokens_append(tokens, from->data[i]);
+  }
+}
+
+static Token range_token(token_t token, cell_range r) {
+  return (Token){.token = token,
+                 .token_data = 0,
+                 .offset = (int32_t)r.lo,
+                 .check_hi = (int32_t)r.hi};
+}
+
+static bool is_cell_op(token_t token) {
+  return token == ADD || token == SUB || token == SET_CELL ||
+         token == PRINT || token == INPUT || token == MUL_CELL;
+}
+
+// The tokens of opt_bounds_checks while they're being built
+typedef struct {
+  TokenList out;
+  cell_range known;    // On the tape, relative to the pointer
+  uint32_t last_check;    // CHECK_BOUNDS later checks can be folded into
+  int64_t moved;          // Pointer move since last_check
+  cell_range check_known; // What was known before last_check
+} check_state;
+
+#define NO_CHECK (UINT32_MAX)
+
+static void emit(check_state *st, Token tok) {
+  tokens_append(&st->out, tok);
+
+  switch (tok.token) {
+  case INC_CUR:
+  case DEC_CUR: {
+    int64_t move = tok.token == INC_CUR ? (int64_t)tok.token_data
+                                        : -(int64_t)tok.token_data;
+    st->moved += move;
+    if (st->known.lo <= st->known.hi) {
+      st->known.lo -= move;
+      st->known.hi -= move;
+    }
+    break;
+  }
+  case ADD:
+  case SUB:
+  case SET_CELL:
+  case MUL_CELL:
+  case CHECK_BOUNDS_IF:
+    break;
+  case SCAN_RIGHT:
+  case SCAN_LEFT:
+    st->known = RANGE_EMPTY;
+    st->last_check = NO_CHECK;
+    break;
+  default: // I/O and branches
+    st->last_check = NO_CHECK;
+    break;
+  }
+}
+
+// Ends of r that still have to be tested. One in front of or behind a
+// range that's on the tape only needs the test on the far end.
+static uint32_t range_sides(cell_range known, cell_range r) {
+  if (known.lo > known.hi) {
+    return BOUNDS_LO | BOUNDS_HI;
+  }
+  return (known.lo <= r.lo ? 0 : BOUNDS_LO) |
+         (known.hi >= r.hi ? 0 : BOUNDS_HI);
+}
+
+// Checks r unless it's known to be on the tape. A check with only moves and
+// arithmetic since the previous one is folded into it: both are always
+// reached and nothing observable happens in between, so failing early is
+// the same as failing at the second.
+static void emit_check(check_state *st, cell_range r) {
+  if (range_covers(st->known, r)) {
+    return;
+  }
+
+  if (st->last_check != NO_CHECK) {
+    Token *prev = &st->out.data[st->last_check];
+    cell_range hull = range_union(
+        (cell_range){.lo = prev->offset, .hi = prev->check_hi},
+        (cell_range){.lo = r.lo + st->moved, .hi = r.hi + st->moved});
+    if (range_fits(hull)) {
+      prev->token_data = range_sides(st->check_known, hull);
+      prev->offset = (int32_t)hull.lo;
+      prev->check_hi = (int32_t)hull.hi;
+      st->known = range_merge(
+          st->known,
+          (cell_range){.lo = hull.lo - st->moved, .hi = hull.hi - st->moved});
+      return;
+    }
+  }
+
+  Token check = range_token(CHECK_BOUNDS, r);
+  check.token_data = range_sides(st->known, r);
+  tokens_append(&st->out, check);
+  st->last_check = st->out.size - 1;
+  st->moved = 0;
+  st->check_known = st->known;
+  st->known = range_merge(st->known, r);
+}
+
+// Stride loops test the end they move towards every iteration. The other
+// end only has to be on the tape where the loop started.
+static void emit_guard(check_state *st, cell_range r, cell_range known,
+                       int64_t stride) {
+  Token guard = range_token(GUARD_RANGE, r);
+  guard.token_data = range_sides(known, r);
+  if (stride > 0) {
+    guard.token_data |= BOUNDS_HI;
+  } else if (stride < 0) {
+    guard.token_data |= BOUNDS_LO;
+  }
+  emit(st, guard);
+}
+
+uint32_t opt_bounds_checks(TokenList *tokens) {
+  uint32_t loop_count = 0;
+  uint32_t scan_reach = 0;
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token *tok = &tokens->data[i];
+    loop_count += tok->token == JUMP_IF_ZERO;
+    if (tok->token == SCAN_LEFT && tok->token_data > scan_reach) {
+      scan_reach = tok->token_data;
+    }
+  }
+  loop_range *loops = loop_ranges(tokens, loop_count);
+
+  check_state st = {
+      .out = {.maxSize = tokens->size + 64,
+              .size = 0,
+              .data = malloc(sizeof(Token) * (tokens->size + 64))},
+      .known = RANGE_EMPTY,
+      .last_check = NO_CHECK};
+
+  // cells is what was known on the tape at the '['
+  uint32_t depth = 0, max_depth = 64;
+  loop_frame *frames = malloc(sizeof(loop_frame) * max_depth);
+  uint32_t next_loop = 0;
+
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token tok = tokens->data[i];
+
+    if (is_cell_op(tok.token)) {
+      // One check up to the next move, loop, scan or I/O
+      uint32_t end = i;
+      cell_range cells = RANGE_EMPTY;
+      while (end < tokens->size && is_cell_op(tokens->data[end].token)) {
+        Token *op = &tokens->data[end++];
+        cells = range_add(cells, op->token == MUL_CELL ? op->src_offset
+                                                       : op->offset);
+        if (op->token == PRINT || op->token == INPUT) {
+          break;
+        }
+      }
+      emit_check(&st, cells);
+
+      // MUL_CELL targets are only touched if the loop cell isn't 0
+      for (; i < end; i++) {
+        Token *op = &tokens->data[i];
+        bool group_start = op->token == MUL_CELL &&
+                           (i == 0 || tokens->data[i - 1].token != MUL_CELL ||
+                            tokens->data[i - 1].src_offset != op->src_offset);
+        if (group_start) {
+          cell_range targets = RANGE_EMPTY;
+          for (uint32_t j = i; j < end &&
+                               tokens->data[j].token == MUL_CELL &&
+                               tokens->data[j].src_offset == op->src_offset;
+               j++) {
+            targets = range_add(targets, tokens->data[j].offset);
+          }
+          if (!range_covers(st.known, targets)) {
+            Token check = range_token(CHECK_BOUNDS_IF, targets);
+            check.token_data = (uint32_t)op->src_offset;
+            emit(&st, check);
+          }
+        }
+        emit(&st, *op);
+      }
+      i--;
+      continue;
+    }
+
+    switch (tok.token) {
+    case SCAN_RIGHT:
+    case SCAN_LEFT:
+      // NOTE: The scan itself isn't checked. Cells off the tape are never
+      // written so they read as 0 and the scan stops on the first one,
+      // where the check after it catches it. Right of the tape there's
+      // always plenty mapped, left of it the caller maps scan_reach cells.
+      emit_check(&st, RANGE_CURRENT);
+      emit(&st, tok);
+      emit_check(&st, RANGE_CURRENT);
+      break;
+    case JUMP_IF_ZERO: {
+      loop_range *loop = &loops[next_loop++];
+      uint32_t rpos = tok.jump;
+      bool small = rpos - i <= GUARD_MAX_TOKENS;
+
+      emit_check(&st, RANGE_CURRENT);
+
+      // Already on the tape, nothing inside needs a check
+      if (loop->kind == LOOP_BALANCED && range_covers(st.known, loop->cells)) {
+        for (uint32_t j = i + 1; j <= rpos; j++) {
+          next_loop += tokens->data[j].token == JUMP_IF_ZERO;
+        }
+        tokens_append_range(&st.out, tokens, i, rpos + 1);
+        st.last_check = NO_CHECK;
+        i = rpos;
+        break;
+      }
+
+      loop_frame frame = {.lpos = i,
+                          .cells = st.known,
+                          .moves = loop->kind != LOOP_BALANCED,
+                          .guarded = small && loop->kind != LOOP_DYNAMIC};
+      frames = frames_push(frames, &depth, &max_depth, frame);
+
+      if (frame.guarded && loop->kind == LOOP_BALANCED) {
+        emit_guard(&st, loop->cells, frame.cells, 0);
+      }
+      emit(&st, tok);
+      if (frame.guarded && loop->kind == LOOP_STRIDE) {
+        emit_guard(&st, loop->cells, frame.cells, loop->stride);
+      }
+
+      // Every iteration of a balanced loop starts on the same cell
+      if (loop->kind != LOOP_BALANCED) {
+        st.known = RANGE_CURRENT;
+      }
+      break;
+    }
+    case JUMP_IF_NOT_ZERO: {
+      loop_frame frame = frames[--depth];
+      uint32_t lpos = frame.lpos;
+
+      // The ']' test reads the cell the body ended on
+      emit_check(&st, RANGE_CURRENT);
+
+      if (frame.guarded && frame.moves) {
+        emit(&st, (Token){.token = GUARD_ELSE});
+        tokens_append_range(&st.out, tokens, lpos + 1, i);
+        emit(&st, (Token){.token = GUARD_END});
+      }
+      emit(&st, tok);
+      if (frame.guarded && !frame.moves) {
+        emit(&st, (Token){.token = GUARD_ELSE});
+        tokens_append_range(&st.out, tokens, lpos, i + 1);
+        emit(&st, (Token){.token = GUARD_END});
+      }
+
+      st.known = frame.moves ? RANGE_CURRENT : frame.cells;
+      break;
+    }
+    default:
+      emit(&st, tok);
+      break;
+    }
+  }
+
+  free(frames);
+  free(loops);
+  free(tokens->data);
+  *tokens = st.out;
+  tokens_link(tokens);
+
+  return scan_reach;
+}
+
+static uint64_t abs64(int64_t x) { return x < 0 ? -(uint64_t)x : (uint64_t)x; }
+
+// NOTE: Every token but the moves touches a cell, at the pointer plus its
+// offset. Between two touches the pointer moves by one run of moves or one
+// scan step, and each touch is at most the largest offset away from it.
+uint64_t opt_max_reach(TokenList *tokens) {
+  uint64_t moves = 0, max_moves = 0, max_offset = 0;
+
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token *tok = &tokens->data[i];
+
+    if (tok->token == INC_CUR || tok->token == DEC_CUR) {
+      moves += tok->token_data;
+      max_moves = moves > max_moves ? moves : max_moves;
+      continue;
+    }
+    moves = 0;
+
+    if (tok->token == SCAN_RIGHT || tok->token == SCAN_LEFT) {
+      max_moves = tok->token_data > max_moves ? tok->token_data : max_moves;
+    }
+
+    uint64_t offset = abs64(tok->offset);
+    if (tok->token == MUL_CELL && abs64(tok->src_offset) > offset) {
+      offset = abs64(tok->src_offset);
+    }
+    max_offset = offset > max_offset ? offset : max_offset;
+  }
+
+  return max_moves + 2 * max_offset;
+}
@@ -0,0 +1,299 @@
+#include "bf_perf.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+// The jitdump format, see jitdump-specification.txt in perf's documentation
+#define JITDUMP_MAGIC (0x4A695444) // "JiTD"
+#define JITDUMP_VERSION (1)
+#define JIT_CODE_LOAD (0)
+#define JIT_CODE_DEBUG_INFO (2)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t total_size;
+  uint32_t elf_mach;
+  uint32_t pad1;
+  uint32_t pid;
+  uint64_t timestamp;
+  uint64_t flags;
+} jitdump_header;
+
+typedef struct {
+  uint32_t id;
+  uint32_t total_size; // Including this prefix
+  uint64_t timestamp;
+} jitdump_record;
+
+// Followed by the name and the code
+typedef struct {
+  jitdump_record record;
+  uint32_t pid;
+  uint32_t tid;
+  uint64_t vma;
+  uint64_t code_addr;
+  uint64_t code_size;
+  uint64_t code_index;
+} jitdump_code_load;
+
+// Followed by nr_entry jitdump_debug_entry, each followed by a file name
+typedef struct {
+  jitdump_record record;
+  uint64_t code_addr;
+  uint64_t nr_entry;
+} jitdump_debug_info;
+
+typedef struct {
+  uint64_t addr;
+  int32_t line;
+  int32_t discrim;
+} jitdump_debug_entry;
+
+static uint32_t code_offset(microasm *bin) {
+  return bin->dest - (uint8_t *)(bin->dest_end - bin->dest_size);
+}
+
+static void codemap_push(bf_codemap *m, uint32_t offset, uint32_t src_pos,
+                         const char *name) {
+  // A region nothing was emitted into is replaced
+  if (m->count > 0 && m->regions[m->count - 1].offset == offset) {
+    m->count--;
+  }
+
+  if (m->count == m->max) {
+    m->max *= 2;
+    m->regions = realloc(m->regions, sizeof(codemap_region) * m->max);
+  }
+
+  m->regions[m->count++] =
+      (codemap_region){.offset = offset, .src_pos = src_pos, .name = name};
+}
+
+void codemap_init(bf_codemap *m) {
+  *m = (bf_codemap){.count = 0,
+                    .max = 64,
+                    .regions = malloc(sizeof(codemap_region) * 64),
+                    .base = "bf_main",
+                    .loops = stack_init(64)};
+}
+
+void codemap_begin(bf_codemap *m, microasm *bin, const char *name) {
+  if (m == NULL) {
+    return;
+  }
+
+  m->base = name;
+  codemap_push(m, code_offset(bin), 0, name);
+}
+
+void codemap_loop_start(bf_codemap *m, microasm *bin, uint32_t src_pos) {
+  if (m == NULL) {
+    return;
+  }
+
+  stack_push(&m->loops, src_pos);
+  codemap_push(m, code_offset(bin), src_pos, NULL);
+}
+
+void codemap_loop_end(bf_codemap *m, microasm *bin) {
+  if (m == NULL) {
+    return;
+  }
+
+  // The rest belongs to the loop around this one
+  uint32_t src_pos;
+  stack_pop(&m->loops, &src_pos);
+  if (m->loops.size > 0) {
+    codemap_push(m, code_offset(bin), m->loops.data[m->loops.size - 1],
+                 NULL);
+  } else {
+    codemap_push(m, code_offset(bin), 0, m->base);
+  }
+}
+
+void codemap_free(bf_codemap *m) {
+  if (m == NULL) {
+    return;
+  }
+
+  free(m->regions);
+  stack_free(&m->loops);
+  m->regions = NULL;
+  m->count = 0;
+}
+
+// Byte offsets where each line of the source starts, so every loop can be
+// found with a binary search
+static size_t *line_starts(bf_source *src, uint32_t *count) {
+  uint32_t max = 1024;
+  size_t *starts = malloc(sizeof(size_t) * max);
+  starts[0] = 0;
+  *count = 1;
+
+  for (size_t i = 0; i < src->len; i++) {
+    if (src->data[i] != '\n') {
+      continue;
+    }
+    if (*count == max) {
+      max *= 2;
+      starts = realloc(starts, sizeof(size_t) * max);
+    }
+    starts[(*count)++] = i + 1;
+  }
+
+  return starts;
+}
+
+static uint32_t find_line(size_t *starts, uint32_t count, size_t pos) {
+  uint32_t lo = 0, hi = count;
+  while (hi - lo > 1) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (starts[mid] <= pos) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static void region_name(codemap_region *r, size_t *starts, uint32_t lines,
+                        char *out, size_t size) {
+  if (r->name != NULL) {
+    snprintf(out, size, "%s", r->name);
+    return;
+  }
+
+  uint32_t line = find_line(starts, lines, r->src_pos);
+  snprintf(out, size, "loop@L%u:C%zu", line + 1,
+           r->src_pos - starts[line] + 1);
+}
+
+static uint32_t region_end(bf_codemap *m, uint32_t i, size_t code_size) {
+  return i + 1 < m->count ? m->regions[i + 1].offset : (uint32_t)code_size;
+}
+
+void perf_write_map(bf_codemap *m, uint8_t *code, size_t code_size,
+                    bf_source *src) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Could not open file: %s\n", path);
+    return;
+  }
+
+  uint32_t lines;
+  size_t *starts = line_starts(src, &lines);
+  char name[64];
+  for (uint32_t i = 0; i < m->count; i++) {
+    codemap_region *r = &m->regions[i];
+    uint32_t end = region_end(m, i, code_size);
+    if (end <= r->offset) {
+      continue;
+    }
+
+    region_name(r, starts, lines, name, sizeof(name));
+    fprintf(f, "%lx %x %s\n", (unsigned long)(code + r->offset),
+            end - r->offset, name);
+  }
+
+  free(starts);
+  fclose(f);
+}
+
+static uint64_t timestamp_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts); // perf record -k mono
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void perf_write_jitdump(bf_codemap *m, uint8_t *code, size_t code_size,
+                        bf_source *src, const char *src_path,
+                        uint16_t machine) {
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)getpid());
+  FILE *f = fopen(path, "w+");
+  if (f == NULL) {
+    fprintf(stderr, "Could not open file: %s\n", path);
+    return;
+  }
+
+  // NOTE: perf only finds the dump through an executable mapping of it, the
+  // mapping is never used and lasts until the process exits
+  long page = sysconf(_SC_PAGESIZE);
+  if (mmap(NULL, page, PROT_READ | PROT_EXEC, MAP_PRIVATE, fileno(f), 0) ==
+      MAP_FAILED) {
+    fprintf(stderr, "Could not map file: %s\n", path);
+    fclose(f);
+    return;
+  }
+
+  char abs_path[PATH_MAX];
+  if (realpath(src_path, abs_path) == NULL) {
+    snprintf(abs_path, sizeof(abs_path), "%s", src_path);
+  }
+  uint32_t path_size = strlen(abs_path) + 1;
+
+  uint32_t pid = getpid();
+  jitdump_header header = {.magic = JITDUMP_MAGIC,
+                           .version = JITDUMP_VERSION,
+                           .total_size = sizeof(jitdump_header),
+                           .elf_mach = machine,
+                           .pid = pid,
+                           .timestamp = timestamp_ns()};
+  fwrite(&header, sizeof(header), 1, f);
+
+  uint32_t lines;
+  size_t *starts = line_starts(src, &lines);
+  char name[64];
+  for (uint32_t i = 0; i < m->count; i++) {
+    codemap_region *r = &m->regions[i];
+    uint32_t end = region_end(m, i, code_size);
+    if (end <= r->offset) {
+      continue;
+    }
+    uint64_t addr = (uint64_t)(uintptr_t)(code + r->offset);
+
+    // Loops point perf annotate at the line of their '['
+    if (r->name == NULL) {
+      jitdump_debug_info info = {
+          .record = {.id = JIT_CODE_DEBUG_INFO,
+                     .total_size = sizeof(jitdump_debug_info) +
+                                   sizeof(jitdump_debug_entry) + path_size,
+                     .timestamp = timestamp_ns()},
+          .code_addr = addr,
+          .nr_entry = 1};
+      jitdump_debug_entry entry = {
+          .addr = addr, .line = find_line(starts, lines, r->src_pos) + 1};
+      fwrite(&info, sizeof(info), 1, f);
+      fwrite(&entry, sizeof(entry), 1, f);
+      fwrite(abs_path, path_size, 1, f);
+    }
+
+    region_name(r, starts, lines, name, sizeof(name));
+    uint32_t name_size = strlen(name) + 1;
+    jitdump_code_load load = {
+        .record = {.id = JIT_CODE_LOAD,
+                   .total_size = sizeof(jitdump_code_load) + name_size +
+                                 (end - r->offset),
+                   .timestamp = timestamp_ns()},
+        .pid = pid,
+        .tid = pid,
+        .vma = addr,
+        .code_addr = addr,
+        .code_size = end - r->offset,
+        .code_index = i};
+    fwrite(&load, sizeof(load), 1, f);
+    fwrite(name, name_size, 1, f);
+    fwrite(code + r->offset, end - r->offset, 1, f);
+  }
+
+  free(starts);
+  fclose(f);
+}
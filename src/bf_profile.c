@@ -0,0 +1,106 @@
+#include "bf_profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+  uint64_t count;
+} profile_loop;
+
+void profile_init(bf_profile *p, TokenList *tokens) {
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    count += tokens->data[i].token == JUMP_IF_ZERO;
+  }
+
+  // At least one of each so nothing is malloc(0)
+  *p = (bf_profile){.count = count,
+                    .counts = calloc(count + 1, sizeof(uint64_t)),
+                    .starts = malloc(sizeof(uint32_t) * (count + 1)),
+                    .ends = malloc(sizeof(uint32_t) * (count + 1))};
+
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token *tok = &tokens->data[i];
+    if (tok->token == JUMP_IF_ZERO) {
+      p->starts[n] = tok->token_data;
+      p->ends[n] = tokens->data[tok->jump].token_data;
+      n++;
+    }
+  }
+}
+
+static int compare_starts(const void *a, const void *b) {
+  const profile_loop *x = a, *y = b;
+  return (x->start > y->start) - (x->start < y->start);
+}
+
+// Most iterations first, then in source order
+static int compare_counts(const void *a, const void *b) {
+  const profile_loop *x = a, *y = b;
+  if (x->count != y->count) {
+    return x->count < y->count ? 1 : -1;
+  }
+  return compare_starts(a, b);
+}
+
+// The commands of the loop, comments are left out
+static void loop_text(bf_source *src, profile_loop *loop, char *out) {
+  uint32_t n = 0;
+  for (uint32_t i = loop->start; i <= loop->end && i < src->len; i++) {
+    if (memchr("+-<>[].,", src->data[i], 8) == NULL) {
+      continue;
+    }
+    if (n == PROFILE_TEXT_MAX) {
+      strcpy(out + n, "...");
+      return;
+    }
+    out[n++] = src->data[i];
+  }
+  out[n] = '\0';
+}
+
+void profile_report(bf_profile *p, bf_source *src, uint32_t top) {
+  profile_loop *loops = malloc(sizeof(profile_loop) * (p->count + 1));
+  for (uint32_t i = 0; i < p->count; i++) {
+    loops[i] = (profile_loop){
+        .start = p->starts[i], .end = p->ends[i], .count = p->counts[i]};
+  }
+
+  // Merge the copies of a loop
+  qsort(loops, p->count, sizeof(profile_loop), compare_starts);
+  uint32_t unique = 0;
+  for (uint32_t i = 0; i < p->count; i++) {
+    if (unique > 0 && loops[unique - 1].start == loops[i].start) {
+      loops[unique - 1].count += loops[i].count;
+    } else {
+      loops[unique++] = loops[i];
+    }
+  }
+  qsort(loops, unique, sizeof(profile_loop), compare_counts);
+
+  fprintf(stderr, "%-20s %-14s %s\n", "iterations", "location", "loop");
+  char text[PROFILE_TEXT_MAX + 4];
+  for (uint32_t i = 0; i < unique && i < top && loops[i].count > 0; i++) {
+    uint32_t line, col;
+    source_locate(src, loops[i].start, &line, &col);
+
+    char location[32];
+    snprintf(location, sizeof(location), "L%u:C%u", line, col);
+    loop_text(src, &loops[i], text);
+    fprintf(stderr, "%-20llu %-14s %s\n", (unsigned long long)loops[i].count,
+            location, text);
+  }
+  fprintf(stderr, "%u loops compiled\n", unique);
+
+  free(loops);
+}
+
+void profile_free(bf_profile *p) {
+  free(p->counts);
+  free(p->starts);
+  free(p->ends);
+  *p = (bf_profile){.count = 0};
+}
@@ -0,0 +1,87 @@
+#include "bf_source.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define READ_CHUNK_SIZE (64 * 1024)
+
+// Fallback for pipes, FIFOs and anything else that can't be mapped
+static bool source_read(int fd, bf_source *src) {
+  size_t cap = READ_CHUNK_SIZE;
+  size_t len = 0;
+  char *buf = malloc(cap);
+
+  for (;;) {
+    if (len == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+
+    ssize_t n = read(fd, buf + len, cap - len);
+    if (n < 0) {
+      free(buf);
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    len += n;
+  }
+
+  src->data = buf;
+  src->len = len;
+  src->mapped = false;
+  return true;
+}
+
+bool source_load(const char *path, bf_source *src) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+      // The lexer makes a single forward pass over the file
+      madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+      src->data = data;
+      src->len = st.st_size;
+      src->mapped = true;
+      close(fd);
+      return true;
+    }
+  }
+
+  bool ok = source_read(fd, src);
+  close(fd);
+  return ok;
+}
+
+void source_free(bf_source *src) {
+  if (src->mapped) {
+    munmap((void *)src->data, src->len);
+  } else {
+    free((void *)src->data);
+  }
+
+  src->data = NULL;
+  src->len = 0;
+}
+
+void source_locate(bf_source *src, size_t pos, uint32_t *line, uint32_t *col) {
+  *line = 1;
+  size_t line_start = 0;
+  for (size_t i = 0; i < pos && i < src->len; i++) {
+    if (src->data[i] == '\n') {
+      (*line)++;
+      line_start = i + 1;
+    }
+  }
+  *col = (uint32_t)(pos - line_start) + 1;
+}
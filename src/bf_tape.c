@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+
+#include "bf_tape.h"
+#include "bf_backend.h"
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/ucontext.h>
+#include <unistd.h>
+
+// The signal handler can only find the tape through a global
+static bf_tape *active_tape = NULL;
+
+// And the interpreter's buffered output, see tape_watch_output
+static uint8_t *watched_out = NULL;
+static uint8_t *volatile *watched_pos = NULL;
+
+void tape_watch_output(uint8_t *out, uint8_t *volatile *out_pos) {
+  watched_out = out;
+  watched_pos = out_pos;
+}
+
+// snprintf isn't async-signal-safe, this is all the handler needs
+static size_t format_i64(char *buf, int64_t value) {
+  char digits[24];
+  size_t n = 0;
+  uint64_t v = value < 0 ? -(uint64_t)value : (uint64_t)value;
+
+  do {
+    digits[n++] = '0' + v % 10;
+    v /= 10;
+  } while (v != 0);
+
+  size_t len = 0;
+  if (value < 0) {
+    buf[len++] = '-';
+  }
+  while (n > 0) {
+    buf[len++] = digits[--n];
+  }
+  return len;
+}
+
+static void write_all(int fd, const uint8_t *data, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n <= 0) {
+      return;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+// NOTE: Native code keeps its output buffer at the bottom of its I/O frame,
+// the stack pointer is its start, and the write position and end in the
+// registers listed in the backends (r15/rbx, x3/x4). A fault with any
+// other stack pointer came from C code, which has no frame to flush.
+static void flush_native_output(void *ctx) {
+  uint8_t *sp, *pos, *end;
+#if defined(__linux__) && defined(__x86_64__)
+  greg_t *regs = ((ucontext_t *)ctx)->uc_mcontext.gregs;
+  sp = (uint8_t *)regs[REG_RSP];
+  pos = (uint8_t *)regs[REG_R15];
+  end = (uint8_t *)regs[REG_RBX];
+#elif defined(__linux__) && defined(__aarch64__)
+  mcontext_t *mc = &((ucontext_t *)ctx)->uc_mcontext;
+  sp = (uint8_t *)mc->sp;
+  pos = (uint8_t *)mc->regs[3];
+  end = (uint8_t *)mc->regs[4];
+#elif defined(__APPLE__) && defined(__aarch64__)
+  mcontext_t mc = ((ucontext_t *)ctx)->uc_mcontext;
+  sp = (uint8_t *)mc->__ss.__sp;
+  pos = (uint8_t *)mc->__ss.__x[3];
+  end = (uint8_t *)mc->__ss.__x[4];
+#elif defined(__APPLE__) && defined(__x86_64__)
+  mcontext_t mc = ((ucontext_t *)ctx)->uc_mcontext;
+  sp = (uint8_t *)mc->__ss.__rsp;
+  pos = (uint8_t *)mc->__ss.__r15;
+  end = (uint8_t *)mc->__ss.__rbx;
+#else
+  (void)ctx;
+  return;
+#endif
+
+  if (end != sp + OUTPUT_BUF_SIZE || pos < sp || pos > end) {
+    return;
+  }
+  int fd;
+  memcpy(&fd, end + IO_OUT_FD_OFFSET, sizeof(fd));
+  write_all(fd, sp, pos - sp);
+}
+
+static void tape_fault(int sig, siginfo_t *info, void *ctx) {
+  bf_tape *tape = active_tape;
+  uint8_t *addr = info->si_addr;
+
+  // Not the tape, crash like there was no handler
+  if (tape == NULL || addr < tape->map || addr >= tape->map + tape->map_size) {
+    signal(sig, SIG_DFL);
+    return;
+  }
+
+  size_t max_size = TAPE_MAX_SIZE * tape->cell_size;
+  uint8_t *end = tape->origin + tape->committed;
+  uint8_t *limit = tape->origin + max_size;
+  if (addr >= end && addr < limit) {
+    size_t committed = tape->committed * 2;
+    while (tape->origin + committed <= addr) {
+      committed *= 2;
+    }
+    if (committed > max_size) {
+      committed = max_size;
+    }
+
+    if (mprotect(end, committed - tape->committed, PROT_READ | PROT_WRITE) ==
+        0) {
+      tape->committed = committed;
+      return; // The access is retried on the new pages
+    }
+  }
+
+  // The output before the fault goes out like it would have without it. In
+  // --tiered mode the interpreter flushed before it called native code.
+  if (watched_pos != NULL) {
+    write_all(STDOUT_FILENO, watched_out, *watched_pos - watched_out);
+  }
+  flush_native_output(ctx);
+
+  char msg[96] = "tape access out of bounds at cell ";
+  size_t len = strlen(msg);
+  int64_t offset = addr - tape->origin;
+  int64_t cell = offset >= 0 ? offset / tape->cell_size
+                             : -((-offset + tape->cell_size - 1) /
+                                 tape->cell_size);
+  len += format_i64(msg + len, cell);
+  msg[len++] = '\n';
+  write(STDERR_FILENO, msg, len);
+  _exit(-1);
+}
+
+bool tape_init(bf_tape *tape, size_t start, uint8_t cell_size, size_t guard) {
+  size_t left = tape_page_round(start * cell_size);
+  size_t map_size = guard + left + TAPE_MAX_SIZE * cell_size + guard;
+
+  uint8_t *map = mmap(NULL, map_size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+
+  *tape = (bf_tape){.map = map,
+                    .map_size = map_size,
+                    .origin = map + guard + left,
+                    .start = left,
+                    .committed = TAPE_INITIAL_SIZE * cell_size,
+                    .cell_size = cell_size};
+
+  if (mprotect(map + guard, left + tape->committed,
+               PROT_READ | PROT_WRITE) != 0) {
+    munmap(map, map_size);
+    return false;
+  }
+
+  struct sigaction sa = {0};
+  sa.sa_sigaction = tape_fault;
+  sa.sa_flags = SA_SIGINFO;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGSEGV, &sa, NULL);
+#ifdef __APPLE__
+  sigaction(SIGBUS, &sa, NULL); // PROT_NONE faults are SIGBUS on macOS
+#endif
+
+  active_tape = tape;
+  return true;
+}
+
+// NOTE: A run can only have touched the RW part of the tape, the left side
+// and `committed` bytes right of cell 0. Those pages are dropped instead of
+// cleared, the next touch of one maps the zero page again. The pages the
+// run grew the tape by go back to PROT_NONE so the next reset only covers
+// what that run touches.
+bool tape_reset(bf_tape *tape) {
+  uint8_t *rw = tape->origin - tape->start;
+  size_t rw_size = tape->start + tape->committed;
+
+#ifdef __linux__
+  if (madvise(rw, rw_size, MADV_DONTNEED) != 0) {
+    return false;
+  }
+#else
+  // MADV_DONTNEED keeps the contents on macOS, fresh pages replace them
+  if (mmap(rw, rw_size, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    return false;
+  }
+#endif
+
+  size_t initial = TAPE_INITIAL_SIZE * tape->cell_size;
+  if (tape->committed > initial) {
+    if (mprotect(tape->origin + initial, tape->committed - initial,
+                 PROT_NONE) != 0) {
+      return false;
+    }
+    tape->committed = initial;
+  }
+  return true;
+}
+
+void tape_free(bf_tape *tape) {
+  if (active_tape == tape) {
+    active_tape = NULL;
+  }
+  munmap(tape->map, tape->map_size);
+  tape->map = NULL;
+}
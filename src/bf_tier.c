@@ -0,0 +1,144 @@
+#include "bf_tier.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// Copies the tokens of one loop into a program of its own, the brackets
+// are rebased so the backends see a complete program
+static TokenList loop_tokens(TokenList *tokens, uint32_t lpos) {
+  uint32_t rpos = tokens->data[lpos].jump;
+  uint32_t size = rpos - lpos + 1;
+
+  TokenList loop = {.maxSize = size,
+                    .size = size,
+                    .data = malloc(sizeof(Token) * size)};
+
+  for (uint32_t i = 0; i < size; i++) {
+    loop.data[i] = tokens->data[lpos + i];
+    if (loop.data[i].token == JUMP_IF_ZERO ||
+        loop.data[i].token == JUMP_IF_NOT_ZERO) {
+      loop.data[i].jump -= lpos;
+    }
+  }
+
+  return loop;
+}
+
+static void tier_compile(bf_tier *tier, uint32_t id) {
+  tier_loop *loop = &tier->loops[id];
+  TokenList tokens = loop_tokens(tier->tokens, loop->lpos);
+
+  loop->code = asm_init(code_size_estimate(&tokens));
+  const char *error;
+  if (TARGET_HOST == TARGET_X86_64) {
+    error = compile_bf_x86_64(&tokens, &loop->code, tier->cell_size, NULL,
+                              NULL, NULL);
+  } else {
+    error = compile_bf_arm64(&tokens, &loop->code, false, tier->cell_size,
+                             NULL, NULL, NULL);
+  }
+  tokens_free(&tokens);
+
+  // NOTE: A loop that couldn't be compiled just stays interpreted
+  uint8_t *code = error == NULL ? asm_seal(&loop->code) : NULL;
+  if (code == NULL) {
+    return;
+  }
+  atomic_store_explicit(&loop->native, (bf_native_fn)code,
+                        memory_order_release);
+  atomic_fetch_add(&tier->compiled, 1);
+}
+
+static void *tier_thread(void *arg) {
+  bf_tier *tier = arg;
+
+#ifdef __APPLE__
+  // NOTE: MAP_JIT protection is per thread, this one only ever writes
+  pthread_jit_write_protect_np(0);
+#endif
+
+  for (;;) {
+    pthread_mutex_lock(&tier->lock);
+    while (tier->queue_head == tier->queue_tail && !tier->stopping) {
+      pthread_cond_wait(&tier->wake, &tier->lock);
+    }
+
+    if (tier->stopping) {
+      pthread_mutex_unlock(&tier->lock);
+      return NULL;
+    }
+
+    uint32_t id = tier->queue[tier->queue_head++];
+    pthread_mutex_unlock(&tier->lock);
+
+    tier_compile(tier, id);
+  }
+}
+
+void tier_start(bf_tier *tier, TokenList *tokens, uint8_t cell_size) {
+  uint32_t loop_count = 0;
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    loop_count += tokens->data[i].token == JUMP_IF_ZERO;
+  }
+
+  *tier = (bf_tier){.tokens = tokens,
+                    .cell_size = cell_size,
+                    .loops = calloc(loop_count + 1, sizeof(tier_loop)),
+                    .loop_count = loop_count,
+                    .queue = malloc(sizeof(uint32_t) * (loop_count + 1))};
+
+  // A loop can be compiled if no ',' sits between its brackets
+  uint32_t id = 0;
+  uint32_t *inputs_before = malloc(sizeof(uint32_t) * (tokens->size + 1));
+  inputs_before[0] = 0;
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    inputs_before[i + 1] = inputs_before[i] + (tokens->data[i].token == INPUT);
+  }
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    if (tokens->data[i].token == JUMP_IF_ZERO) {
+      uint32_t rpos = tokens->data[i].jump;
+      tier->loops[id].lpos = i;
+      tier->loops[id].compilable = inputs_before[rpos] == inputs_before[i];
+      id++;
+    }
+  }
+  free(inputs_before);
+
+  pthread_mutex_init(&tier->lock, NULL);
+  pthread_cond_init(&tier->wake, NULL);
+  if (pthread_create(&tier->thread, NULL, tier_thread, tier) != 0) {
+    printf("failed to start the compiler thread!\n");
+    exit(-1);
+  }
+}
+
+void tier_request(bf_tier *tier, uint32_t loop) {
+  if (tier->loops[loop].queued || !tier->loops[loop].compilable) {
+    return;
+  }
+  tier->loops[loop].queued = true;
+
+  pthread_mutex_lock(&tier->lock);
+  tier->queue[tier->queue_tail++] = loop;
+  pthread_cond_signal(&tier->wake);
+  pthread_mutex_unlock(&tier->lock);
+}
+
+// Stops the compiler thread, loops still in the queue are dropped
+void tier_stop(bf_tier *tier) {
+  pthread_mutex_lock(&tier->lock);
+  tier->stopping = true;
+  pthread_cond_signal(&tier->wake);
+  pthread_mutex_unlock(&tier->lock);
+  pthread_join(tier->thread, NULL);
+
+  for (uint32_t i = 0; i < tier->loop_count; i++) {
+    if (tier->loops[i].code.dest != NULL) {
+      asm_free(&tier->loops[i].code);
+    }
+  }
+
+  pthread_mutex_destroy(&tier->lock);
+  pthread_cond_destroy(&tier->wake);
+  free(tier->loops);
+  free(tier->queue);
+}
@@ -0,0 +1,79 @@
+#include "bf_timings.h"
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static double clock_seconds(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void timings_start(bf_timings *t) {
+  if (t == NULL) {
+    return;
+  }
+
+  *t = (bf_timings){.wall_mark = clock_seconds(CLOCK_MONOTONIC),
+                    .cpu_mark = clock_seconds(CLOCK_PROCESS_CPUTIME_ID)};
+}
+
+void timings_phase(bf_timings *t, const char *name) {
+  if (t == NULL || t->count == TIMINGS_MAX_PHASES) {
+    return;
+  }
+
+  double wall = clock_seconds(CLOCK_MONOTONIC);
+  double cpu = clock_seconds(CLOCK_PROCESS_CPUTIME_ID);
+  t->phases[t->count++] = (timing_phase){
+      .name = name, .wall = wall - t->wall_mark, .cpu = cpu - t->cpu_mark};
+  t->wall_mark = wall;
+  t->cpu_mark = cpu;
+}
+
+double timings_wall(bf_timings *t, const char *name) {
+  for (uint32_t i = 0; t != NULL && i < t->count; i++) {
+    if (strcmp(t->phases[i].name, name) == 0) {
+      return t->phases[i].wall;
+    }
+  }
+  return 0;
+}
+
+void timings_stack(bf_timings *t, Stack *s) {
+  if (t != NULL) {
+    t->stack_bytes += sizeof(uint32_t) * s->maxSize;
+  }
+}
+
+void timings_report(bf_timings *t) {
+  if (t == NULL) {
+    return;
+  }
+
+  double wall = 0, cpu = 0;
+  fprintf(stderr, "%-20s %12s %12s\n", "phase", "wall (ms)", "cpu (ms)");
+  for (uint32_t i = 0; i < t->count; i++) {
+    timing_phase *p = &t->phases[i];
+    fprintf(stderr, "%-20s %12.3f %12.3f\n", p->name, p->wall * 1e3,
+            p->cpu * 1e3);
+    wall += p->wall;
+    cpu += p->cpu;
+  }
+  fprintf(stderr, "%-20s %12.3f %12.3f\n", "total", wall * 1e3, cpu * 1e3);
+
+  // ru_maxrss is in KB on Linux and in bytes on macOS
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  long peak_kb = usage.ru_maxrss / 1024;
+#else
+  long peak_kb = usage.ru_maxrss;
+#endif
+  fprintf(stderr, "peak RSS: %ld KB\n", peak_kb);
+  fprintf(stderr,
+          "allocated: tokens %zu B, stacks %zu B, loop tables %zu B, "
+          "code buffer %zu B\n",
+          t->token_bytes, t->stack_bytes, t->loop_bytes, t->code_bytes);
+}
@@ -0,0 +1,537 @@
+#include "bf.h"
+#include "bf_backend.h"
+#include "stack.h"
+#include "x86asm.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// NOTE: Register usage of the x86-64 backend, it mirrors the ARM64 one:
+//   r12  address of the current cell
+//   r13  start of the tape, for the scans' bounds and --safe checks
+//   r9   end of the tape, for the --safe checks
+//   r14b cached cell, see x86_cache
+//   r15  output buffer write position, rbx its end (and the input buffer)
+//   rbp  input buffer read position, r10 the end of its data
+// Everything else is scratch. syscall only clobbers rax, rcx and r11.
+#define TAPE_REG (X86_R12)
+#define BASE_REG (X86_R13)
+#define END_REG (X86_R9)
+#define CELL_REG (X86_R14)
+#define OUT_REG (X86_R15)
+#define OUT_END_REG (X86_RBX)
+#define IN_REG (X86_RBP)
+#define IN_END_REG (X86_R10)
+
+static const uint8_t saved_regs[] = {X86_RBX, X86_RBP, X86_R12,
+                                     X86_R13, X86_R14, X86_R15};
+
+// One cell cached in r14 within a basic block, like x13 on ARM64. Only the
+// low size bytes are meaningful: 8-bit cells use r14b which wraps on its
+// own, wider ones are added to in full and stored and tested at their size.
+typedef struct {
+  bool valid;
+  bool dirty;
+  int32_t offset;
+  uint8_t size; // Bytes per cell
+} x86_cache;
+
+static void x86_cache_flush(microasm *bin, x86_cache *cache) {
+  if (cache->valid && cache->dirty) {
+    asm_x86_store_n(bin, cache->size, CELL_REG, TAPE_REG,
+                    cache->offset * cache->size);
+    cache->dirty = false;
+  }
+}
+
+static void x86_cache_load(microasm *bin, x86_cache *cache, int32_t offset) {
+  if (cache->valid && cache->offset == offset) {
+    return;
+  }
+
+  x86_cache_flush(bin, cache);
+  asm_x86_load_n(bin, cache->size, CELL_REG, TAPE_REG, offset * cache->size);
+  cache->valid = true;
+  cache->dirty = false;
+  cache->offset = offset;
+}
+
+// Writes out the output buffer, called with call. rsi/rdx/rdi/rax are scratch
+static void x86_emit_output_flush(microasm *bin) {
+  asm_x86_lea(bin, X86_RSI, OUT_END_REG, -OUTPUT_BUF_SIZE);
+  asm_x86_regmov(bin, X86_RDX, OUT_REG);
+  asm_x86_regsub(bin, X86_RDX, X86_RSI);
+  asm_x86_jcc(bin, X86_COND_E, 0);
+  uint32_t to_empty = bin->count;
+
+  // write() can return early, loop until the whole buffer is out
+  uint32_t write = bin->count;
+  asm_x86_immmov(bin, X86_RAX, 1); // write
+  asm_x86_load_n(bin, 4, X86_RDI, OUT_END_REG, IO_OUT_FD_OFFSET);
+  asm_x86_syscall(bin);
+  asm_x86_immcmp(bin, X86_RAX, 0);
+  asm_x86_jcc(bin, X86_COND_LE, 0);
+  uint32_t to_error = bin->count;
+  asm_x86_regadd(bin, X86_RSI, X86_RAX);
+  asm_x86_regsub(bin, X86_RDX, X86_RAX);
+  asm_x86_jcc(bin, X86_COND_NE, write);
+
+  asm_x86_patch_rel32(bin, to_empty, bin->count);
+  asm_x86_patch_rel32(bin, to_error, bin->count);
+  asm_x86_lea(bin, OUT_REG, OUT_END_REG, -OUTPUT_BUF_SIZE);
+  asm_x86_ret(bin);
+}
+
+// Refills the input buffer, flushing the output first. On EOF rbp == r10
+static void x86_emit_input_refill(microasm *bin, uint32_t output_flush) {
+  asm_x86_call(bin, output_flush);
+
+  asm_x86_regmov(bin, X86_RSI, OUT_END_REG);
+  asm_x86_immmov(bin, X86_RDX, INPUT_READ_SIZE);
+  asm_x86_immmov(bin, X86_RAX, 0); // read
+  asm_x86_load_n(bin, 4, X86_RDI, OUT_END_REG, IO_IN_FD_OFFSET);
+  asm_x86_syscall(bin);
+
+  asm_x86_regmov(bin, IN_REG, X86_RSI);
+  asm_x86_regmov(bin, IN_END_REG, X86_RSI);
+  asm_x86_immcmp(bin, X86_RAX, 0);
+  asm_x86_jcc(bin, X86_COND_LE, 0);
+  uint32_t to_eof = bin->count;
+  asm_x86_regadd(bin, IN_END_REG, X86_RAX);
+  asm_x86_patch_rel32(bin, to_eof, bin->count);
+  asm_x86_ret(bin);
+}
+
+// Scans that visit at least 4 cells of a 16 byte block check it at once with
+// SSE2, the same way as the NEON version: only the cells the loop would
+// visit are kept in the pcmpeq mask, and blocks are only loaded inside the
+// tape. Steps are in bytes, a cell is size of them.
+static void x86_emit_scan(microasm *bin, bool right, uint32_t stride,
+                          uint8_t size) {
+  uint32_t step = stride * size;
+
+  asm_x86_cmp_mem_imm_n(bin, size, TAPE_REG, 0, 0);
+  asm_x86_jcc(bin, X86_COND_E, 0);
+  uint32_t to_done = bin->count;
+
+  uint32_t to_done_vec = 0;
+  if (step <= 4) {
+    // Left scans load the block that ends with the current cell. The mask
+    // keeps the first byte of each cell going right and the last going
+    // left, so either way the found bit is the byte to move to (right) or
+    // 15 bytes past it (left).
+    uint32_t block = (16 / step) * step;
+    uint32_t mask = 0;
+    for (uint32_t byte = 0; byte < 16; byte += step) {
+      mask |= 1 << (right ? byte : 15 - byte);
+    }
+
+    asm_x86_pxor(bin, 1, 1);
+    asm_x86_lea(bin, X86_RDX, BASE_REG,
+                right ? BF_TAPE_SIZE * size - 16 : 16 - size);
+
+    uint32_t vec = bin->count;
+    asm_x86_regcmp(bin, TAPE_REG, X86_RDX);
+    asm_x86_jcc(bin, right ? X86_COND_A : X86_COND_B, 0);
+    uint32_t to_scalar = bin->count;
+
+    asm_x86_movdqu_load(bin, 0, TAPE_REG, right ? 0 : size - 16);
+    asm_x86_pcmpeq_n(bin, size, 0, 1);
+    asm_x86_pmovmskb(bin, X86_RAX, 0);
+    if (step != 1) {
+      asm_x86_and32_imm(bin, X86_RAX, mask);
+    }
+    asm_x86_test32(bin, X86_RAX, X86_RAX);
+    asm_x86_jcc(bin, X86_COND_NE, 0);
+    uint32_t to_found = bin->count;
+
+    if (right) {
+      asm_x86_immadd(bin, TAPE_REG, block);
+    } else {
+      asm_x86_immsub(bin, TAPE_REG, block);
+    }
+    asm_x86_jmp(bin, vec);
+
+    asm_x86_patch_rel32(bin, to_found, bin->count);
+    if (right) {
+      asm_x86_bsf32(bin, X86_RAX, X86_RAX);
+    } else {
+      asm_x86_bsr32(bin, X86_RAX, X86_RAX);
+      asm_x86_immsub(bin, TAPE_REG, 15);
+    }
+    asm_x86_regadd(bin, TAPE_REG, X86_RAX);
+    asm_x86_jmp(bin, 0);
+    to_done_vec = bin->count;
+
+    // The block loop stops on a cell it hasn't checked yet
+    asm_x86_patch_rel32(bin, to_scalar, bin->count);
+    asm_x86_cmp_mem_imm_n(bin, size, TAPE_REG, 0, 0);
+    asm_x86_jcc(bin, X86_COND_E, 0);
+    to_scalar = bin->count;
+
+    uint32_t scalar = bin->count;
+    if (right) {
+      asm_x86_immadd(bin, TAPE_REG, step);
+    } else {
+      asm_x86_immsub(bin, TAPE_REG, step);
+    }
+    asm_x86_cmp_mem_imm_n(bin, size, TAPE_REG, 0, 0);
+    asm_x86_jcc(bin, X86_COND_NE, scalar);
+
+    asm_x86_patch_rel32(bin, to_done, bin->count);
+    asm_x86_patch_rel32(bin, to_done_vec, bin->count);
+    asm_x86_patch_rel32(bin, to_scalar, bin->count);
+    return;
+  }
+
+  uint32_t scalar = bin->count;
+  if (right) {
+    asm_x86_immadd(bin, TAPE_REG, step);
+  } else {
+    asm_x86_immsub(bin, TAPE_REG, step);
+  }
+  asm_x86_cmp_mem_imm_n(bin, size, TAPE_REG, 0, 0);
+  asm_x86_jcc(bin, X86_COND_NE, scalar);
+
+  asm_x86_patch_rel32(bin, to_done, bin->count);
+}
+
+// NOTE: --safe checks compare the addresses of the first and last cell of a
+// range with r13 and r9. A CHECK_BOUNDS jumps to the out of bounds exit if
+// either end in sides is off the tape, the jumps are patched from s_oob at
+// the end. lo and hi are in bytes.
+static void x86_emit_check(microasm *bin, Stack *s_oob, int32_t lo,
+                           int32_t hi, uint32_t sides) {
+  if (sides & BOUNDS_LO) {
+    asm_x86_lea(bin, X86_RAX, TAPE_REG, lo);
+    asm_x86_regcmp(bin, X86_RAX, BASE_REG);
+    asm_x86_jcc(bin, X86_COND_B, 0);
+    stack_push(s_oob, bin->count);
+  }
+  if (sides & BOUNDS_HI) {
+    asm_x86_lea(bin, X86_RAX, TAPE_REG, hi);
+    asm_x86_regcmp(bin, X86_RAX, END_REG);
+    asm_x86_jcc(bin, X86_COND_AE, 0);
+    stack_push(s_oob, bin->count);
+  }
+}
+
+// A GUARD_RANGE falls through to the checked copy if the range is off the
+// tape, and otherwise jumps past the GUARD_ELSE. That jump is patched there,
+// it's left on s_guards. Only the ends in sides are compared.
+static void x86_emit_guard(microasm *bin, Stack *s_guards, int32_t lo,
+                           int32_t hi, uint32_t sides) {
+  if (!(sides & BOUNDS_HI)) {
+    asm_x86_lea(bin, X86_RAX, TAPE_REG, lo);
+    asm_x86_regcmp(bin, X86_RAX, BASE_REG);
+    asm_x86_jcc(bin, X86_COND_AE, 0);
+    stack_push(s_guards, bin->count);
+    return;
+  }
+
+  uint32_t to_checked = 0;
+  if (sides & BOUNDS_LO) {
+    asm_x86_lea(bin, X86_RAX, TAPE_REG, lo);
+    asm_x86_regcmp(bin, X86_RAX, BASE_REG);
+    asm_x86_jcc(bin, X86_COND_B, 0);
+    to_checked = bin->count;
+  }
+  asm_x86_lea(bin, X86_RAX, TAPE_REG, hi);
+  asm_x86_regcmp(bin, X86_RAX, END_REG);
+  asm_x86_jcc(bin, X86_COND_B, 0);
+  stack_push(s_guards, bin->count);
+  if (to_checked != 0) {
+    asm_x86_patch_rel32(bin, to_checked, bin->count);
+  }
+}
+
+const char *compile_bf_x86_64(TokenList *tokens, microasm *bin,
+                              uint8_t cell_size, uint64_t *profile,
+                              bf_codemap *codemap, bf_timings *timings) {
+  const char *error = NULL;
+  Stack s_loops = stack_init(1024);
+  Stack s_oob = stack_init(64);
+  Stack s_guards = stack_init(64);
+  uint32_t guard_max = 64;
+  x86_cache *guard_cache = malloc(sizeof(x86_cache) * guard_max);
+  x86_cache cache = {.valid = false, .size = cell_size};
+  uint32_t mul_skip = 0;
+
+  codemap_begin(codemap, bin, "bf_main");
+  asm_x86_jmp(bin, 0); // Jump over the I/O subroutines
+  uint32_t to_entry = bin->count;
+  const uint32_t output_flush = bin->count;
+  codemap_begin(codemap, bin, "bf_output_flush");
+  x86_emit_output_flush(bin);
+  const uint32_t input_refill = bin->count;
+  codemap_begin(codemap, bin, "bf_input_refill");
+  x86_emit_input_refill(bin, output_flush);
+  asm_x86_patch_rel32(bin, to_entry, bin->count);
+  codemap_begin(codemap, bin, "bf_main");
+
+  for (uint32_t i = 0; i < sizeof(saved_regs); i++) {
+    asm_x86_push(bin, saved_regs[i]);
+  }
+  asm_x86_immmov(bin, X86_RAX, IO_FRAME_SIZE / IO_PROBE_SIZE);
+  const uint32_t probe = bin->count;
+  asm_x86_immsub(bin, X86_RSP, IO_PROBE_SIZE);
+  asm_x86_movzx8_load(bin, X86_R11, X86_RSP, 0);
+  asm_x86_immsub(bin, X86_RAX, 1);
+  asm_x86_jcc(bin, X86_COND_NE, probe);
+  asm_x86_regmov(bin, OUT_REG, X86_RSP);
+  asm_x86_lea(bin, OUT_END_REG, X86_RSP, OUTPUT_BUF_SIZE);
+  asm_x86_store_n(bin, 8, X86_RCX, OUT_END_REG, IO_IN_FD_OFFSET); // fds
+  asm_x86_regmov(bin, IN_REG, OUT_END_REG); // The input buffer is empty
+  asm_x86_regmov(bin, IN_END_REG, OUT_END_REG);
+  asm_x86_regmov(bin, TAPE_REG, X86_RDI);
+  asm_x86_regmov(bin, BASE_REG, X86_RSI);
+  asm_x86_regmov(bin, END_REG, X86_RDX);
+
+  for (uint32_t i = 0; i < tokens->size; i++) {
+    Token *tok = &tokens->data[i];
+
+    switch (tok->token) {
+    case INC_CUR: {
+      asm_x86_immadd(bin, TAPE_REG, tok->token_data * cell_size);
+      cache.offset -= tok->token_data;
+      break;
+    }
+    case DEC_CUR: {
+      asm_x86_immsub(bin, TAPE_REG, tok->token_data * cell_size);
+      cache.offset += tok->token_data;
+      break;
+    }
+    case JUMP_IF_ZERO: {
+      codemap_loop_start(codemap, bin, tok->token_data);
+      x86_cache_flush(bin, &cache);
+      x86_cache_load(bin, &cache, 0);
+      asm_x86_test_n(bin, cell_size, CELL_REG, CELL_REG);
+      asm_x86_jcc(bin, X86_COND_E, 0); // Patched at the ']'
+      stack_push(&s_loops, bin->count);
+
+      // The ']' jumps back here, so this counts iterations
+      if (profile != NULL) {
+        asm_x86_immmov(bin, X86_RAX, (uint64_t)(uintptr_t)profile++);
+        asm_x86_add_mem64_imm(bin, X86_RAX, 0, 1);
+      }
+      break;
+    }
+    case JUMP_IF_NOT_ZERO: {
+      uint32_t lpos;
+      if (!stack_pop(&s_loops, &lpos)) {
+        error = "extra ']' in bf code";
+        break;
+      }
+
+      x86_cache_flush(bin, &cache);
+      x86_cache_load(bin, &cache, 0);
+      asm_x86_test_n(bin, cell_size, CELL_REG, CELL_REG);
+      asm_x86_jcc(bin, X86_COND_NE, lpos);
+      asm_x86_patch_rel32(bin, lpos, bin->count);
+      codemap_loop_end(codemap, bin);
+      break;
+    }
+    case ADD: {
+      x86_cache_load(bin, &cache, tok->offset);
+      if (cell_size == 1) {
+        asm_x86_add8_imm(bin, CELL_REG, (uint8_t)tok->token_data);
+      } else {
+        asm_x86_immadd(bin, CELL_REG, (int32_t)tok->token_data);
+      }
+      cache.dirty = true;
+      break;
+    }
+    case SUB: {
+      x86_cache_load(bin, &cache, tok->offset);
+      if (cell_size == 1) {
+        asm_x86_sub8_imm(bin, CELL_REG, (uint8_t)tok->token_data);
+      } else {
+        asm_x86_immsub(bin, CELL_REG, (int32_t)tok->token_data);
+      }
+      cache.dirty = true;
+      break;
+    }
+    case SET_CELL: {
+      if (cache.offset == tok->offset) {
+        cache.valid = false;
+      }
+      asm_x86_store_imm_n(bin, cell_size, TAPE_REG, tok->offset * cell_size,
+                          tok->token_data);
+      break;
+    }
+    case MUL_CELL: {
+      // Consecutive MUL_CELLs come from the same loop and share r14b
+      if (i == 0 || tokens->data[i - 1].token != MUL_CELL ||
+          tokens->data[i - 1].src_offset != tok->src_offset) {
+        x86_cache_load(bin, &cache, tok->src_offset);
+
+        // The loop would never have run, don't touch the other cells
+        asm_x86_test_n(bin, cell_size, CELL_REG, CELL_REG);
+        asm_x86_jcc(bin, X86_COND_E, 0);
+        mul_skip = bin->count;
+      }
+
+      // Only the low size bytes of the product matter
+      uint32_t mask = cell_size == 4 ? UINT32_MAX : (1u << (cell_size * 8)) - 1;
+      uint32_t factor = tok->token_data & mask;
+      int32_t disp = tok->offset * cell_size;
+      if (factor == 1) {
+        asm_x86_add_mem_n(bin, cell_size, TAPE_REG, disp, CELL_REG);
+      } else if (factor == mask) {
+        asm_x86_sub_mem_n(bin, cell_size, TAPE_REG, disp, CELL_REG);
+      } else {
+        asm_x86_imul32_imm(bin, X86_RAX, CELL_REG, (int32_t)factor);
+        asm_x86_add_mem_n(bin, cell_size, TAPE_REG, disp, X86_RAX);
+      }
+
+      if (i + 1 == tokens->size || tokens->data[i + 1].token != MUL_CELL ||
+          tokens->data[i + 1].src_offset != tok->src_offset) {
+        asm_x86_patch_rel32(bin, mul_skip, bin->count);
+      }
+      break;
+    }
+    case SCAN_RIGHT:
+    case SCAN_LEFT: {
+      x86_cache_flush(bin, &cache);
+      cache.valid = false;
+      x86_emit_scan(bin, tok->token == SCAN_RIGHT, tok->token_data,
+                    cell_size);
+      break;
+    }
+    case PRINT: {
+      uint8_t value_reg = CELL_REG;
+      if (!cache.valid || cache.offset != tok->offset) {
+        value_reg = X86_RAX; // The low byte is the first one
+        asm_x86_movzx8_load(bin, value_reg, TAPE_REG, tok->offset * cell_size);
+      }
+
+      asm_x86_store8(bin, value_reg, OUT_REG, 0);
+      asm_x86_immadd(bin, OUT_REG, 1);
+      asm_x86_regcmp(bin, OUT_REG, OUT_END_REG);
+      asm_x86_jcc(bin, X86_COND_NE, 0);
+      uint32_t to_skip = bin->count;
+      asm_x86_call(bin, output_flush);
+      asm_x86_patch_rel32(bin, to_skip, bin->count);
+      break;
+    }
+    case INPUT: {
+      // r14b ends up holding the new value, or the old one on EOF
+      x86_cache_load(bin, &cache, tok->offset);
+
+      asm_x86_regcmp(bin, IN_REG, IN_END_REG);
+      asm_x86_jcc(bin, X86_COND_NE, 0);
+      uint32_t to_fast = bin->count;
+      asm_x86_call(bin, input_refill);
+      asm_x86_regcmp(bin, IN_REG, IN_END_REG);
+      asm_x86_jcc(bin, X86_COND_E, 0); // EOF leaves the cell as is
+      uint32_t to_eof = bin->count;
+
+      asm_x86_patch_rel32(bin, to_fast, bin->count);
+      asm_x86_movzx8_load(bin, CELL_REG, IN_REG, 0);
+      asm_x86_immadd(bin, IN_REG, 1);
+      asm_x86_patch_rel32(bin, to_eof, bin->count);
+
+      cache.dirty = true;
+      break;
+    }
+    case CHECK_BOUNDS: {
+      x86_emit_check(bin, &s_oob, tok->offset * cell_size,
+                     tok->check_hi * cell_size, tok->token_data);
+      break;
+    }
+    case CHECK_BOUNDS_IF: {
+      int32_t cond = (int32_t)tok->token_data;
+      if (cache.valid && cache.offset == cond) {
+        asm_x86_test_n(bin, cell_size, CELL_REG, CELL_REG);
+      } else {
+        asm_x86_cmp_mem_imm_n(bin, cell_size, TAPE_REG, cond * cell_size, 0);
+      }
+      asm_x86_jcc(bin, X86_COND_E, 0);
+      uint32_t to_skip = bin->count;
+      x86_emit_check(bin, &s_oob, tok->offset * cell_size,
+                     tok->check_hi * cell_size, BOUNDS_LO | BOUNDS_HI);
+      asm_x86_patch_rel32(bin, to_skip, bin->count);
+      break;
+    }
+    // Both copies start with the cache of the guard, which doesn't touch
+    // it, and end with nothing cached
+    case GUARD_RANGE: {
+      x86_cache_flush(bin, &cache);
+      if (s_guards.size == guard_max) {
+        guard_max *= 2;
+        guard_cache = realloc(guard_cache, sizeof(x86_cache) * guard_max);
+      }
+      guard_cache[s_guards.size] = cache;
+      x86_emit_guard(bin, &s_guards, tok->offset * cell_size,
+                     tok->check_hi * cell_size, tok->token_data);
+      break;
+    }
+    case GUARD_ELSE: {
+      x86_cache_flush(bin, &cache);
+      uint32_t to_fast;
+      stack_pop(&s_guards, &to_fast);
+      cache = guard_cache[s_guards.size];
+      asm_x86_jmp(bin, 0);
+      stack_push(&s_guards, bin->count);
+      asm_x86_patch_rel32(bin, to_fast, bin->count);
+      break;
+    }
+    case GUARD_END: {
+      x86_cache_flush(bin, &cache);
+      cache.valid = false;
+      uint32_t to_end;
+      stack_pop(&s_guards, &to_end);
+      asm_x86_patch_rel32(bin, to_end, bin->count);
+      break;
+    }
+    }
+  }
+
+  if (s_loops.size != 0) {
+    error = "Missing ']'";
+  }
+
+  x86_cache_flush(bin, &cache);
+  asm_x86_call(bin, output_flush);
+  asm_x86_immadd(bin, X86_RSP, IO_FRAME_SIZE);
+  asm_x86_regmov(bin, X86_RAX, TAPE_REG); // Return the current cell
+  for (int i = sizeof(saved_regs) - 1; i >= 0; i--) {
+    asm_x86_pop(bin, saved_regs[i]);
+  }
+  asm_x86_ret(bin);
+  timings_phase(timings, "emit");
+
+  // NOTE: A failed --safe check returns NULL instead of the current cell.
+  // The output so far is still written, the cache isn't since the program
+  // stops here anyway.
+  if (s_oob.size != 0) {
+    codemap_begin(codemap, bin, "bf_out_of_bounds");
+    uint32_t oob = bin->count;
+    for (uint32_t i = 0; i < s_oob.size; i++) {
+      asm_x86_patch_rel32(bin, s_oob.data[i], oob);
+    }
+
+    asm_x86_call(bin, output_flush);
+    asm_x86_immadd(bin, X86_RSP, IO_FRAME_SIZE);
+    asm_x86_immmov(bin, X86_RAX, 0);
+    for (int i = sizeof(saved_regs) - 1; i >= 0; i--) {
+      asm_x86_pop(bin, saved_regs[i]);
+    }
+    asm_x86_ret(bin);
+  }
+
+  timings_phase(timings, "backpatch");
+
+  if (timings != NULL) {
+    timings_stack(timings, &s_loops);
+    timings_stack(timings, &s_oob);
+    timings_stack(timings, &s_guards);
+    timings->loop_bytes += sizeof(x86_cache) * guard_max;
+  }
+  stack_free(&s_loops);
+  stack_free(&s_oob);
+  stack_free(&s_guards);
+  free(guard_cache);
+
+  return bin->failed ? "failed to grow JIT memory!" : error;
+}
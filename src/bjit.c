@@ -0,0 +1,180 @@
+#include "bjit.h"
+#include "bf_backend.h"
+#include "bf_lexer.h"
+#include "bf_opt.h"
+#include "bf_tape.h"
+#include "microasm.h"
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#ifdef __APPLE__
+#include <pthread.h> // Apple only
+#endif
+
+struct bjit_program {
+  microasm code;
+  bf_native_fn fn;
+  uint8_t cell_size;
+  bool safe;
+  size_t tape_start; // Cells left of cell 0 the program may use
+  size_t tape_left;  // Cells left of cell 0 to map, see opt_bounds_checks
+  size_t guard;      // Bytes of each guard, see tape_guard_size
+};
+
+static bjit_program *compile_fail(bjit_status *status, bjit_status error) {
+  if (status != NULL) {
+    *status = error;
+  }
+  return NULL;
+}
+
+bjit_program *bjit_compile(const char *buf, size_t len,
+                           const bjit_options *opts, bjit_status *status) {
+  bjit_options defaults = {.safe = false, .cell_bits = 8, .tape_start = 0};
+  if (opts == NULL) {
+    opts = &defaults;
+  }
+
+  uint8_t cell_bits = opts->cell_bits == 0 ? 8 : opts->cell_bits;
+  if ((cell_bits != 8 && cell_bits != 16 && cell_bits != 32) ||
+      opts->tape_start > TAPE_MAX_SIZE) {
+    return compile_fail(status, BJIT_ERR_OPTIONS);
+  }
+
+  const char *error;
+  TokenList tokens = tokenize_bf(buf, len, &error, NULL);
+  if (tokens.data == NULL) {
+    return compile_fail(status, BJIT_ERR_SYNTAX);
+  }
+  optimize_bf(&tokens, NULL);
+  uint8_t cell_size = cell_bits / 8;
+  size_t guard = tape_guard_size(opt_max_reach(&tokens), cell_size);
+
+  size_t tape_left = opts->tape_start;
+  if (opts->safe) {
+    tape_left += opt_bounds_checks(&tokens);
+  }
+
+  bjit_program *prog = malloc(sizeof(bjit_program));
+  if (prog == NULL ||
+      !asm_try_init(&prog->code, code_size_estimate(&tokens))) {
+    free(prog);
+    tokens_free(&tokens);
+    return compile_fail(status, BJIT_ERR_MEMORY);
+  }
+
+#ifdef __APPLE__
+  pthread_jit_write_protect_np(0); // Turn off so it is RW- (Apple only)
+#endif
+
+  if (TARGET_HOST == TARGET_X86_64) {
+    error = compile_bf_x86_64(&tokens, &prog->code, cell_size, NULL, NULL,
+                              NULL);
+  } else {
+    error = compile_bf_arm64(&tokens, &prog->code, false, cell_size, NULL,
+                             NULL, NULL);
+  }
+  tokens_free(&tokens);
+
+#ifdef __APPLE__
+  pthread_jit_write_protect_np(1); // Turn on so it is R-X (Apple only)
+#endif
+
+  // NOTE: The lexer already matched the brackets, only a code buffer that
+  // couldn't grow or be made executable fails here
+  prog->fn = error == NULL ? (bf_native_fn)asm_seal(&prog->code) : NULL;
+  if (prog->fn == NULL) {
+    bjit_free(prog);
+    return compile_fail(status, BJIT_ERR_MEMORY);
+  }
+  prog->cell_size = cell_size;
+  prog->safe = opts->safe;
+  prog->tape_start = opts->tape_start;
+  prog->tape_left = tape_left;
+  prog->guard = guard;
+
+  if (status != NULL) {
+    *status = BJIT_OK;
+  }
+  return prog;
+}
+
+void bjit_free(bjit_program *prog) {
+  if (prog == NULL) {
+    return;
+  }
+
+  asm_free(&prog->code);
+  free(prog);
+}
+
+// NOTE: Unlike bf_tape there's no SIGSEGV handler to grow the tape, the
+// signal disposition belongs to the host process. The whole right side is
+// RW up front like the startup stub of an executable, untouched pages cost
+// nothing until a program writes them.
+bjit_status bjit_tape_init(bjit_tape *tape, const bjit_program *prog) {
+  asm_tape_layout layout =
+      tape_aot_layout(prog->tape_left, prog->tape_start, prog->safe,
+                      prog->cell_size, prog->guard);
+
+  uint8_t *map = mmap(NULL, layout.map_size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED) {
+    return BJIT_ERR_MEMORY;
+  }
+
+  if (mprotect(map + layout.rw_offset, layout.rw_size,
+               PROT_READ | PROT_WRITE) != 0) {
+    munmap(map, layout.map_size);
+    return BJIT_ERR_MEMORY;
+  }
+
+  *tape = (bjit_tape){.map = map,
+                      .map_size = layout.map_size,
+                      .origin = map + layout.origin_offset,
+                      .left = layout.origin_offset - layout.rw_offset,
+                      .guard = layout.rw_offset,
+                      .cell_size = prog->cell_size};
+  return BJIT_OK;
+}
+
+void bjit_tape_free(bjit_tape *tape) {
+  if (tape->map != NULL) {
+    munmap(tape->map, tape->map_size);
+  }
+  tape->map = NULL;
+}
+
+bjit_status bjit_run(const bjit_program *prog, bjit_tape *tape,
+                     const bjit_io *io) {
+  if (tape->map == NULL || tape->cell_size != prog->cell_size ||
+      tape->left < prog->tape_left * prog->cell_size ||
+      tape->guard < prog->guard) {
+    return BJIT_ERR_OPTIONS;
+  }
+
+  uint64_t fds = io == NULL ? BF_STDIO_FDS : BF_IO_FDS(io->in_fd, io->out_fd);
+  uint8_t *start = tape->origin - prog->tape_start * prog->cell_size;
+  uint8_t *end = tape->origin + tape_limit(prog->safe) * prog->cell_size;
+
+  if (prog->fn(tape->origin, start, end, fds) == NULL) {
+    return BJIT_ERR_OUT_OF_BOUNDS;
+  }
+  return BJIT_OK;
+}
+
+const char *bjit_status_string(bjit_status status) {
+  switch (status) {
+  case BJIT_OK:
+    return "ok";
+  case BJIT_ERR_OPTIONS:
+    return "unsupported options";
+  case BJIT_ERR_SYNTAX:
+    return "unmatched brackets";
+  case BJIT_ERR_MEMORY:
+    return "out of memory";
+  case BJIT_ERR_OUT_OF_BOUNDS:
+    return "tape access out of bounds";
+  }
+  return "unknown error";
+}
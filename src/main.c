@@ -1,6 +1,16 @@
 #include "bf.h"
+#include "bf_backend.h"
+#include "bf_batch.h"
+#include "bf_cache.h"
+#include "bf_interp.h"
+#include "bf_lexer.h"
+#include "bf_opt.h"
+#include "bf_profile.h"
+#include "bf_source.h"
+#include "bf_tape.h"
 #include "microasm.h"
 #include "stack.h"
+#include <elf.h>
 #include <memory.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -13,304 +23,294 @@
 #define ANSI_RESET_COLOR "\x1b[0m"
 
 #ifdef __APPLE__
-#include <libkern/OSCacheControl.h> // Apple only
-#include <pthread.h>                // Apple only
+#include <pthread.h> // Apple only
 #endif
 
-uint8_t *compile_bf(FILE *bf_file, bool debug, bool dump, char *dump_path) {
-
-#ifdef __APPLE__
-  uint8_t *memory = mmap(NULL, JIT_MEM_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
-                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_JIT, -1, 0);
-#else
-  uint8_t *memory = mmap(NULL, JIT_MEM_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
-                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-#endif
-
-  microasm bin = {.count = 0,
-                  .dest = memory,
-                  .dest_end = (uint64_t)memory + JIT_MEM_SIZE,
-                  .dest_size = JIT_MEM_SIZE};
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-  Stack s_loops = stack_init(16384 * 8);
+// Returns the arena holding the code, it's still writable so it can be
+// dumped. asm_seal makes it executable.
+microasm compile_bf(TokenList *tokens, bf_target target, bool debug, bool dump,
+                    char *dump_path, size_t tape_left, size_t tape_start,
+                    size_t guard, bool safe, uint8_t cell_size,
+                    uint64_t *profile, bf_codemap *codemap,
+                    bf_timings *timings) {
+  microasm bin = asm_init(code_size_estimate(tokens));
+
+  const char *error;
+  if (target == TARGET_X86_64) {
+    error = compile_bf_x86_64(tokens, &bin, cell_size, profile, codemap,
+                              timings);
+  } else {
+    error = compile_bf_arm64(tokens, &bin, debug, cell_size, profile,
+                             codemap, timings);
+  }
+  if (error != NULL) {
+    printf("%s\n", error);
+    exit(-1);
+  }
 
-  uint32_t loop_count = 0;
-  uint32_t depth = 0;
+  if (timings != NULL) {
+    timings->code_bytes = bin.dest_size;
+  }
 
-  uint64_t *lpos = malloc(16384 * 8);
-  uint64_t *rpos = malloc(16384 * 8);
+  if (dump && dump_path != NULL) {
+    asm_write_exec(dump_path, &bin,
+                   target == TARGET_X86_64 ? EM_X86_64 : EM_AARCH64,
+                   tape_aot_layout(tape_left, tape_start, safe, cell_size,
+                                   guard));
+    timings_phase(timings, "write executable");
+  }
 
-  const uint8_t pos_reg = 9;
-  const uint8_t data_reg = 10;
-  const uint8_t cur_loop_point_reg = 11;
-  const uint8_t value_at_pos_reg = 12;
-  const uint8_t loop_lpos = 14;
-  const uint8_t loop_rpos = 15;
+  return bin;
+}
 
-#ifdef __APPLE__
-  const uint8_t write_syscall = 4;
-#else
-  const uint8_t write_syscall = 64;
-#endif
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    printf("No brainfuck source file passed!\n");
+    return -1;
+  }
 
-  asm_arm64_regmov(&bin, data_reg, 0);
-  asm_arm64_immmov(&bin, pos_reg, 0);
+  char *dump_path = NULL;
+  bool dump_bin = false;
+  bool debug = false;
+  bf_timings timing_state;
+  bf_timings *timings = NULL; // Only set with -t
+  bool interpret = false;
+  bool tiered = false;
+  bool safe = false;
+  bool profiling = false;
+  bool perf_map = false;
+  bool perf_jitdump = false;
+  char *cache_dir = NULL;
+  uint64_t cache_max = CACHE_DEFAULT_MAX_BYTES;
+  bool cache_stats = false;
+  bf_batch batch = {.files = malloc(sizeof(char *) * argc),
+                    .file_count = 0,
+                    .records = false,
+                    .delim = '\n'};
+  bool batch_null = false;
+  uint32_t profile_top = PROFILE_DEFAULT_TOP;
+  size_t tape_start = 0;
+  uint8_t cell_size = 1;
+  bf_target target = TARGET_HOST;
 
-  int oper_bin;
-  while ((oper_bin = fgetc(bf_file)) != EOF) {
-    char oper = (char)oper_bin;
+  for (int i = 1; i < argc - 1; i++) {
+    if (strcmp(argv[i], "-d") == 0) {
+      debug = true;
+    }
 
-    // x0 = data
-    switch (oper) {
-    case '>': {
-      int addptr_loop_count = 1;
-      int addptr_ch_int = 0;
-      while ((addptr_ch_int = fgetc(bf_file)) != EOF) {
-        char ch = (char)addptr_ch_int;
+    if (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--timings") == 0) {
+      timings = &timing_state;
+    }
 
-        if (ch != '>') {
-          ungetc(ch, bf_file);
-          break;
-        }
+    if (strcmp(argv[i], "-i") == 0) {
+      interpret = true;
+    }
 
-        addptr_loop_count++;
-      }
-      asm_arm64_immadd(&bin, pos_reg, pos_reg, addptr_loop_count);
-      break;
+    if (strcmp(argv[i], "--tiered") == 0) {
+      interpret = true;
+      tiered = true;
     }
-    case '<': {
-      int subptr_loop_count = 1;
-      int subptr_ch_int = 0;
-      while ((subptr_ch_int = fgetc(bf_file)) != EOF) {
-        char ch = (char)subptr_ch_int;
 
-        if (ch != '<') {
-          ungetc(ch, bf_file);
-          break;
-        }
+    if (strcmp(argv[i], "--safe") == 0) {
+      safe = true;
+    }
 
-        subptr_loop_count++;
-      }
-      asm_arm64_immsub(&bin, pos_reg, pos_reg, subptr_loop_count);
-      break;
+    if (strcmp(argv[i], "--profile") == 0) {
+      profiling = true;
     }
-    case '[': {
-      lpos[loop_count] = (uint64_t)bin.dest + (4 * 4);
 
-      if (debug) {
-        printf("L: loop id: %i\n", loop_count);
+    if (strcmp(argv[i], "--profile-top") == 0) {
+      if (argc - 1 == ++i) {
+        printf("You did not provide how many loops to print!\n");
+        return -1;
       }
 
-      uint32_t *loop_id = malloc(4);
-      *loop_id = loop_count;
-      stack_push(&s_loops, loop_id);
-
-      asm_arm64_regadd(&bin, value_at_pos_reg, pos_reg, data_reg,
-                       0);                           // Value at position
-      asm_arm64_regldrb(&bin, 13, value_at_pos_reg); // Load value to x13
-      // asm_arm64_immadd(&bin, 2, loop_rpos, loop_count * 8);
-      // asm_arm64_regldr(&bin, 3, 2); // Load saved address
-      asm_arm64_pcrelbranch_nz(
-          &bin, 13,
-          2);               // If x13 is not zero, jump over br instruction
-      asm_arm64_b(&bin, 0); // Will be backpatched later
-
-      loop_count++;
-
-      // asm_arm64_getpcval(&bin, cur_loop_point_reg); // Get current location
-      // asm_arm64_immadd(&bin, loop_rpos, loop_rpos,
-      //                  8); // Increment loop position
-      // asm_arm64_regadd(&bin, 12, loop_lpos, loop_rpos,
-      //                  0); // Calculate offset inside array
-      // asm_arm64_immadd(&bin, cur_loop_point_reg, cur_loop_point_reg, 20);
-      // asm_arm64_regstr(&bin, cur_loop_point_reg,
-      //                  12); // Write position in memory
-      break;
-    }
-    case ']': {
-      uint32_t *loop_id_ptr = (uint32_t *)stack_pop(&s_loops);
-      if (loop_id_ptr == NULL) {
-        printf("extra ']' in bf code\n");
-        exit(-1);
+      char *end;
+      profile_top = strtoul(argv[i], &end, 10);
+      if (*end != '\0' || profile_top == 0) {
+        printf("Invalid --profile-top: %s\n", argv[i]);
+        return -1;
       }
-      uint32_t loop_id = *loop_id_ptr;
+      profiling = true;
+    }
 
-      free(loop_id_ptr);
+    if (strcmp(argv[i], "--perf-map") == 0) {
+      perf_map = true;
+    }
 
-      // Used for '[' to know where to jump if == 0
-      rpos[loop_id] = (uint64_t)bin.dest + (4 * 4);
+    if (strcmp(argv[i], "--perf-jitdump") == 0) {
+      perf_jitdump = true;
+    }
 
-      if (debug) {
-        printf("R: loop id: %i\n", loop_id);
+    if (strcmp(argv[i], "--cache-dir") == 0) {
+      if (argc - 1 == ++i) {
+        printf("You did not provide a cache directory!\n");
+        return -1;
       }
 
-      asm_arm64_regadd(&bin, value_at_pos_reg, pos_reg, data_reg,
-                       0);                           // Value at position
-      asm_arm64_regldrb(&bin, 13, value_at_pos_reg); // Load value to x13
-      asm_arm64_pcrelbranch_ze(&bin, 13, 2); // If x13 is zero, jump (3 * 4)
-      // asm_arm64_immadd(&bin, 4, loop_lpos,
-      //                  loop_id * 8);               // sizeof(uint64_t) == 8
-      // asm_arm64_regldr(&bin, value_at_pos_reg, 4); // Load saved address
-      // asm_arm64_br(&bin, value_at_pos_reg); // Branch to x12
-      asm_arm64_b(&bin, 0);
-      // asm_arm64_immsub(&bin, loop_rpos, loop_rpos, 8);
-
-      break;
-    }
-    case '+': {
-      // Combine multiple addition operations into 1 instruction
-      int add_loop_count = 1;
-      int add_ch_int = 0;
-      while ((add_ch_int = fgetc(bf_file)) != EOF) {
-        char ch = (char)add_ch_int;
-
-        if (ch != '+') {
-          ungetc(ch, bf_file);
-          break;
-        }
-
-        add_loop_count++;
+      cache_dir = argv[i];
+    }
+
+    if (strcmp(argv[i], "--cache-size") == 0) {
+      if (argc - 1 == ++i) {
+        printf("You did not provide the cache size in MB!\n");
+        return -1;
       }
 
-      asm_arm64_regadd(&bin, value_at_pos_reg, pos_reg, data_reg,
-                       0);                           // Value at position
-      asm_arm64_regldrb(&bin, 13, value_at_pos_reg); // Load value to x13
-      asm_arm64_immadd(&bin, 13, 13, add_loop_count);
-      asm_arm64_regstrb(&bin, 13, value_at_pos_reg);
-      asm_arm64_immmov(&bin, 13, 0); // Clear x13
-      break;
-    }
-    case '-': {
-      // Combine multiple addition operations into 1 instruction
-      int sub_loop_count = 1;
-      int sub_ch_int = 0;
-      while ((sub_ch_int = fgetc(bf_file)) != EOF) {
-        char ch = (char)sub_ch_int;
-
-        if (ch != '-') {
-          ungetc(ch, bf_file);
-          break;
-        }
-
-        sub_loop_count++;
+      char *end;
+      cache_max = strtoull(argv[i], &end, 10) * 1024 * 1024;
+      if (*end != '\0' || cache_max == 0) {
+        printf("Invalid --cache-size: %s\n", argv[i]);
+        return -1;
       }
+    }
 
-      asm_arm64_regadd(&bin, value_at_pos_reg, pos_reg, data_reg,
-                       0);                           // Value at position
-      asm_arm64_regldrb(&bin, 13, value_at_pos_reg); // Load value to x2
-      asm_arm64_immsub(&bin, 13, 13, sub_loop_count);
-      asm_arm64_regstrb(&bin, 13, value_at_pos_reg);
-      asm_arm64_immmov(&bin, 13, 0); // Clear x13
-      break;
+    if (strcmp(argv[i], "--cache-stats") == 0) {
+      cache_stats = true;
     }
-    case '.': {
-      asm_arm64_regadd(&bin, 1, pos_reg, data_reg, 0); // Value at position
-#ifdef __APPLE__
-      asm_arm64_immmov(&bin, 16, write_syscall);
-#else
-      asm_arm64_immmov(&bin, 8, write_syscall); // 0x40 is write syscall
-#endif
-      asm_arm64_immmov(&bin, 0, 1); // STDOUT
-      asm_arm64_immmov(&bin, 2, 1); // Length, which is 1
-      asm_arm64_syscall(&bin, 0);
-      asm_arm64_immmov(&bin, 0, 0);
-      asm_arm64_immmov(&bin, 1, 0);
-      asm_arm64_immmov(&bin, 2, 0);
-      break;
+
+    if (strcmp(argv[i], "--batch") == 0) {
+      if (argc - 1 == ++i) {
+        printf("You did not provide an input file for --batch!\n");
+        return -1;
+      }
+
+      batch.files[batch.file_count++] = argv[i];
     }
-    case ',': {
-      asm_arm64_immmov(&bin, 8, 63);                   // Read syscall
-      asm_arm64_immmov(&bin, 0, 0);                    // STDIN
-      asm_arm64_regadd(&bin, 1, pos_reg, data_reg, 0); // Value at position
-      asm_arm64_immmov(&bin, 2, 1);
-      asm_arm64_syscall(&bin, 0);
-      asm_arm64_immmov(&bin, 0, 0);
-      asm_arm64_immmov(&bin, 1, 0);
-      asm_arm64_immmov(&bin, 2, 0);
-      // printf("bf file has user input, this is not supported yet!\n");
-      // exit(-1);
-      break;
+
+    if (strcmp(argv[i], "--batch-lines") == 0) {
+      batch.records = true;
     }
+
+    if (strcmp(argv[i], "--batch-null") == 0) {
+      batch_null = true;
     }
-  }
 
-  asm_return(&bin);
+    if (strcmp(argv[i], "-c") == 0) {
+      dump_bin = true;
+      if (argc - 1 == ++i) {
+        printf("You did not provide a path to save executable!\n");
+        return -1;
+      }
 
-  // NOTE: Backpatching loop
-  for (int i = loop_count - 1; i >= 0; i--) {
-    uint32_t *l_brack = (uint32_t *)lpos[i];
-    uint32_t *r_brack = (uint32_t *)rpos[i];
+      dump_path = argv[i];
+    }
 
-    int64_t offset = (r_brack - l_brack);
+    if (strcmp(argv[i], "--tape-start") == 0) {
+      if (argc - 1 == ++i) {
+        printf("You did not provide the cells left of cell 0!\n");
+        return -1;
+      }
 
-    uint32_t lpos_b_ins = 0x14000000;
-    lpos_b_ins |= (offset + 1) & ((1 << 26) - 1);
-    *(l_brack - 1) = lpos_b_ins;
+      char *end;
+      tape_start = strtoull(argv[i], &end, 10);
+      if (*end != '\0') {
+        printf("Invalid --tape-start: %s\n", argv[i]);
+        return -1;
+      }
+    }
 
-    uint32_t rpos_b_ins = 0x14000000;
-    rpos_b_ins |= (-offset + 1) & ((1 << 26) - 1);
-    *(r_brack - 1) = rpos_b_ins;
-  }
+    if (strcmp(argv[i], "--cell-bits") == 0) {
+      if (argc - 1 == ++i) {
+        printf("You did not provide the bits per cell!\n");
+        return -1;
+      }
 
-  if (rpos + loop_count * 8 == NULL) {
-    printf("Missing '['\n");
-    exit(-1);
-  }
+      if (strcmp(argv[i], "8") == 0) {
+        cell_size = 1;
+      } else if (strcmp(argv[i], "16") == 0) {
+        cell_size = 2;
+      } else if (strcmp(argv[i], "32") == 0) {
+        cell_size = 4;
+      } else {
+        printf("Invalid --cell-bits: %s (expected 8, 16 or 32)\n", argv[i]);
+        return -1;
+      }
+    }
 
-  if (s_loops.size != 0) {
-    printf("Missing ']'\n");
-    exit(-1);
-  }
+    if (strcmp(argv[i], "--target") == 0) {
+      if (argc - 1 == ++i) {
+        printf("You did not provide a target architecture!\n");
+        return -1;
+      }
 
-  if (debug) {
-    printf("*** loops ***\n");
+      if (strcmp(argv[i], "arm64") == 0 || strcmp(argv[i], "aarch64") == 0) {
+        target = TARGET_ARM64;
+      } else if (strcmp(argv[i], "x86_64") == 0 ||
+                 strcmp(argv[i], "x86-64") == 0) {
+        target = TARGET_X86_64;
+      } else {
+        printf("Unknown target: %s (expected arm64 or x86_64)\n", argv[i]);
+        return -1;
+      }
+    }
 
-    int i = 1;
-    while (lpos[i] != 0) {
-      printf("L: 0x%lx, R: 0x%lx\n", lpos[i], rpos[i]);
-      i++;
+    if (strcmp(argv[i], "-h") == 0) {
+      goto help_menu;
     }
   }
 
-  if (dump && dump_path != NULL) {
-    asm_write_exec(dump_path, &bin);
+  if (interpret && dump_bin) {
+    printf("-i and --tiered run the program, they can't be combined with -c\n");
+    return -1;
   }
 
-  free(s_loops.data);
-  free(lpos);
-  free(rpos);
+  // NOTE: The counters live in this process, only the JIT can fill them
+  if (profiling && (interpret || dump_bin)) {
+    printf("--profile needs the JIT, it can't be combined with -i, --tiered "
+           "or -c\n");
+    return -1;
+  }
 
-  return memory;
-}
+  if ((perf_map || perf_jitdump) && (interpret || dump_bin)) {
+    printf("--perf-map and --perf-jitdump describe the JIT code, they can't be "
+           "combined with -i, --tiered or -c\n");
+    return -1;
+  }
 
-int main(int argc, char **argv) {
-  if (argc < 2) {
-    printf("No brainfuck source file passed!\n");
+  // NOTE: Cached code has no absolute addresses and nothing to name it by
+  if (cache_dir != NULL &&
+      (interpret || dump_bin || profiling || perf_map || perf_jitdump)) {
+    printf("--cache-dir only caches the JIT, it can't be combined with -i, "
+           "--tiered, -c, --profile or --perf-*\n");
     return -1;
   }
 
-  char *dump_path = NULL;
-  bool dump_bin = false;
-  bool debug = false;
+  // NOTE: --batch-null alone reads NUL separated records
+  if (batch_null) {
+    batch.delim = '\0';
+    batch.records |= batch.file_count == 0;
+  }
+  bool batching = batch.records || batch.file_count > 0;
+  batch.verbose = timings != NULL;
 
-  for (int i = 1; i < argc - 1; i++) {
-    if (strcmp(argv[i], "-d") == 0) {
-      debug = true;
-    }
+  if (batch.records && batch.file_count > 0) {
+    printf("--batch runs input files, --batch-lines and --batch-null read "
+           "records from stdin, pick one\n");
+    return -1;
+  }
 
-    if (strcmp(argv[i], "-c") == 0) {
-      dump_bin = true;
-      if (argc - 1 == ++i) {
-        printf("You did not provide a path to save executable!\n");
-        return -1;
-      }
+  if (batching && (interpret || dump_bin || profiling)) {
+    printf("--batch reruns the JIT code, it can't be combined with -i, "
+           "--tiered, -c or --profile\n");
+    return -1;
+  }
 
-      dump_path = argv[i];
-    }
+  if (cache_stats && cache_dir == NULL) {
+    printf("--cache-stats needs --cache-dir <dir>\n");
+    return -1;
+  }
 
-    if (strcmp(argv[i], "-h") == 0) {
-      goto help_menu;
-    }
+  // NOTE: The JIT can only run code for the machine it runs on
+  if (target != TARGET_HOST && !dump_bin) {
+    printf("Running a foreign --target needs -c <output file>\n");
+    return -1;
   }
 
   if (strcmp(argv[argc - 1], "-h") == 0) {
@@ -318,24 +318,40 @@ int main(int argc, char **argv) {
     printf("bfjit, a brainf*ck compiler/JIT\n\n");
     printf("Options: \n");
     printf("  -h\t\t\tPrint help menu\n");
-    printf("  -c <output file>\tCompile Brainf*ck to ARM64 ELF executable\n");
+    printf("  -c <output file>\tCompile Brainf*ck to an ELF executable\n");
+    printf("  --target <arch>\tarm64 or x86_64, defaults to the host\n");
+    printf("  --tape-start <cells>\tCells usable left of cell 0, defaults to 0\n");
+    printf("  --safe\t\tCheck every access is within the %u cell tape\n",
+           BF_TAPE_SIZE);
+    printf("  --cell-bits <bits>\t8, 16 or 32 bit cells, defaults to 8\n");
     printf("  -d\t\t\tEnable Debug Logging\n");
+    printf("  -i\t\t\tRun with the interpreter instead of the JIT\n");
+    printf("  --tiered\t\tInterpret at once, compile hot loops meanwhile\n");
+    printf("  -t, --timings\t\tPrint the time and memory of each phase\n");
+    printf("  --profile\t\tCount loop iterations, print the hottest loops\n");
+    printf("  --profile-top <n>\tLoops --profile prints, defaults to %u\n",
+           PROFILE_DEFAULT_TOP);
+    printf("  --perf-map\t\tWrite /tmp/perf-<pid>.map naming the JIT code\n");
+    printf("  --perf-jitdump\tWrite /tmp/jit-<pid>.dump for perf inject\n");
+    printf("  --cache-dir <dir>\tReuse the code compiled by earlier runs\n");
+    printf("  --cache-size <MB>\tEvict old code past this, defaults to %llu\n",
+           (unsigned long long)(CACHE_DEFAULT_MAX_BYTES >> 20));
+    printf("  --cache-stats\t\tPrint the hits, misses and size of the cache\n");
+    printf("  --batch <input file>\tCompile once, run on every --batch file\n");
+    printf("  --batch-lines\t\tCompile once, run on every line of stdin\n");
+    printf("  --batch-null\t\tNUL instead of newline for records and output\n");
     return 0;
   }
 
-  FILE *bf_file = fopen(argv[argc - 1], "r");
-  if (bf_file == NULL) {
+  timings_start(timings);
+
+  bf_source src;
+  if (!source_load(argv[argc - 1], &src)) {
     printf("Could not open file: %s\n", argv[argc - 1]);
     return -1;
   }
 
-  // Initialize BF struct
-  bf = malloc(sizeof(bf_data));
-  bf->position = 0;
-  bf->data = malloc(30000);
-  bf->loop_stack = malloc(1024 * 8); // Determines how deep nested loops can go
-  bf->loop_pos = 0;
-  memset(bf->data, 0, 30000);
+  timings_phase(timings, "load");
 
 #ifdef __APPLE__
   pthread_jit_write_protect_np(0); // Turn off so it is RW- (Apple only)
@@ -346,54 +362,224 @@ int main(int argc, char **argv) {
     printf("Compiling...\n");
   }
 
-  clock_t t;
-  t = clock();
+  double compile_start = now_seconds();
+
+  // A hit skips straight to running the code
+  bf_cache cache;
+  bf_cache_entry cached = {.map = NULL};
+  if (cache_dir != NULL) {
+    cache_init(&cache, cache_dir, cache_max, &src, target, safe, cell_size);
+    cache_load(&cache, &cached);
+    timings_phase(timings, "cache lookup");
+  }
+
+  TokenList tokens = {.data = NULL};
+  size_t tape_left = tape_start;
+  uint64_t max_reach;
+  if (cached.map != NULL) {
+    tape_left += cached.scan_reach;
+    max_reach = cached.max_reach;
+  } else {
+    const char *error;
+    tokens = tokenize_bf(src.data, src.len, &error, timings);
+    if (tokens.data == NULL) {
+      printf("%s\n", error);
+      exit(-1);
+    }
+    timings_phase(timings, "lex");
+
+    uint32_t lexed_size = tokens.size;
+    optimize_bf(&tokens, timings);
+    max_reach = opt_max_reach(&tokens);
+
+    if (safe) {
+      tape_left += opt_bounds_checks(&tokens);
+      timings_phase(timings, "opt: bounds checks");
+    }
+
+    if (timings != NULL) {
+      timings->token_bytes = sizeof(Token) * tokens.maxSize;
+    }
+
+    if (debug) {
+      printf(ANSI_DEBUG_MSG);
+      printf("Optimized %u tokens down to %u\n", lexed_size, tokens.size);
+    }
+
+    if (timings != NULL) {
+      double lex_time = timings_wall(timings, "lex");
+      fprintf(stderr, "Loaded %zu bytes (%s), lexed %u tokens at %.1f MB/s\n",
+              src.len, src.mapped ? "mmap" : "read", lexed_size,
+              src.len / lex_time / (1024 * 1024));
+    }
+  }
+
+  // The profile and the perf regions need the source to find the loops
+  bf_profile profile = {.counts = NULL};
+  if (profiling) {
+    profile_init(&profile, &tokens);
+  }
+  bf_codemap codemap_state;
+  bf_codemap *codemap = NULL; // Only set with --perf-map or --perf-jitdump
+  if (perf_map || perf_jitdump) {
+    codemap = &codemap_state;
+    codemap_init(codemap);
+  }
+  if (!profiling && codemap == NULL) {
+    source_free(&src);
+  }
 
-  uint8_t *bin = compile_bf(bf_file, debug, dump_bin, dump_path);
+  // Initialize BF struct
+  bf_tape tape;
+  size_t guard = tape_guard_size(max_reach, cell_size);
+  if (!dump_bin && !tape_init(&tape, tape_left, cell_size, guard)) {
+    printf("Could not map the tape\n");
+    return -1;
+  }
+
+  bf = malloc(sizeof(bf_data));
+  bf->position = 0;
+  bf->cell_size = cell_size;
+  bf->data = dump_bin ? NULL : tape.origin;
+  bf->tape = dump_bin ? NULL : tape.origin - tape_start * cell_size;
+  bf->tape_end =
+      dump_bin ? NULL : tape.origin + tape_limit(safe) * cell_size;
+  bf->loop_stack = malloc(1024 * 8); // Determines how deep nested loops can go
+  bf->loop_pos = 0;
+  timings_phase(timings, "tape setup");
+
+  // NOTE: The interpreter runs straight off the tokens
+  microasm code = {.dest = NULL};
+  if (!interpret && cached.map == NULL) {
+    code = compile_bf(&tokens, target, debug, dump_bin, dump_path,
+                      tape_left, tape_start, guard, safe, cell_size,
+                      profile.counts, codemap, timings);
+  }
+
+  if (cache_dir != NULL && code.dest != NULL) {
+    cache_store(&cache, &code, tape_left - tape_start, max_reach);
+    timings_phase(timings, "cache store");
+  }
 
   if (debug) {
     printf(ANSI_DEBUG_MSG);
-    printf("Compilation took %f seconds\n", ((double)t) / CLOCKS_PER_SEC);
+    printf("Compilation took %f seconds\n", now_seconds() - compile_start);
   }
 
-  fclose(bf_file);
-
   if (dump_bin && dump_path != NULL) {
+    timings_report(timings);
     return 0;
   }
 
 #ifdef __APPLE__
-  pthread_jit_write_protect_np(1);          // Turn on so it is R-X (Apple only)
-  sys_icache_invalidate(bin, JIT_MEM_SIZE); // Invalidation  (Apple Sil. only)
+  pthread_jit_write_protect_np(1); // Turn on so it is R-X (Apple only)
 #endif
 
+  uint8_t *bin = NULL;
+  if (code.dest != NULL) {
+    bin = asm_seal(&code);
+    if (bin == NULL) {
+      printf("failed to make JIT memory executable!\n");
+      return -1;
+    }
+    timings_phase(timings, "seal"); // mprotect and icache flush
+  } else if (cached.map != NULL) {
+    bin = (uint8_t *)cached.code;
+  }
+
+  if (codemap != NULL) {
+    size_t code_size = code.dest - bin;
+    if (perf_map) {
+      perf_write_map(codemap, bin, code_size, &src);
+    }
+    if (perf_jitdump) {
+      perf_write_jitdump(codemap, bin, code_size, &src, argv[argc - 1],
+                         target == TARGET_X86_64 ? EM_X86_64 : EM_AARCH64);
+    }
+    codemap_free(codemap);
+    if (!profiling) {
+      source_free(&src);
+    }
+    timings_phase(timings, "perf");
+  }
+
   if (debug) {
     printf(ANSI_DEBUG_MSG);
     printf("Running...\n");
   }
 
-  t = clock();
+  double run_start = now_seconds();
+  uint32_t batch_failed = 0;
+
+  if (tiered) {
+    bf_tier tier;
+    tier_start(&tier, &tokens, cell_size);
+    interpret_bf(&tokens, bf, &tier);
+    tier_stop(&tier);
 
-  uint32_t x0 = ((uint32_t(*)(uint8_t *))bin)(bf->data);
+    if (debug) {
+      printf(ANSI_DEBUG_MSG);
+      printf("Compiled %u of %u loops\n", atomic_load(&tier.compiled),
+             tier.loop_count);
+    }
+  } else if (interpret) {
+    interpret_bf(&tokens, bf, NULL);
+  } else if (batching) {
+    batch_failed = batch_run(&batch, (bf_native_fn)bin, &tape, bf->tape,
+                             bf->tape_end);
+  } else {
+    if (((bf_native_fn)bin)(bf->data, bf->tape, bf->tape_end,
+                            BF_STDIO_FDS) == NULL) {
+      if (profiling) {
+        profile_report(&profile, &src, profile_top);
+      }
+      bf_out_of_bounds();
+    }
+  }
 
-  t = clock() - t;
-  double time_taken = ((double)t) / CLOCKS_PER_SEC;
+  double time_taken = now_seconds() - run_start;
+  timings_phase(timings, "run");
 
   if (debug) {
     printf("\n### DEBUG ###\n");
     printf("bf loc: %p\n", bf->data);
 
     for (int i = 0; i < 16; i++) {
-      printf("cell %i: %u\n", i, bf->data[i]);
+      uint32_t cell = bf->data[i * cell_size];
+      if (cell_size == 2) {
+        cell = ((uint16_t *)bf->data)[i];
+      } else if (cell_size == 4) {
+        cell = ((uint32_t *)bf->data)[i];
+      }
+      printf("cell %i: %u\n", i, cell);
     }
 
     printf("The program took %f seconds to execute\n", time_taken);
   }
 
-  munmap(bin, JIT_MEM_SIZE);
-  free(bf->data);
+  if (code.dest != NULL) {
+    asm_free(&code);
+  }
+  if (cached.map != NULL) {
+    cache_unmap(&cached);
+  }
+  tokens_free(&tokens);
+  tape_free(&tape);
   free(bf->loop_stack);
   free(bf);
+  free(batch.files);
+  timings_phase(timings, "teardown");
+
+  if (profiling) {
+    profile_report(&profile, &src, profile_top);
+    profile_free(&profile);
+    source_free(&src);
+  }
+
+  if (cache_stats) {
+    cache_report(&cache);
+  }
 
-  return 0;
+  timings_report(timings);
+  return batch_failed == 0 ? 0 : -1;
 }
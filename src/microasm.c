@@ -1,17 +1,139 @@
-#include <string.h>
 #define _GNU_SOURCE
 
 #include "microasm.h"
+#include "bf_backend.h"
+#include "x86asm.h"
 #include <elf.h>
 #include <errno.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 
+#ifdef __APPLE__
+#include <libkern/OSCacheControl.h> // Apple only
+#endif
+
+// NOTE: Code is written while the buffer is RW and only becomes RX once
+// asm_seal is called, it's never writable and executable at the same time.
+// On Apple MAP_JIT memory is RWX and W^X is toggled per thread instead.
+#ifdef __APPLE__
+#define ASM_MAP_PROT (PROT_READ | PROT_WRITE | PROT_EXEC)
+#define ASM_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS | MAP_JIT)
+#else
+#define ASM_MAP_PROT (PROT_READ | PROT_WRITE)
+#define ASM_MAP_FLAGS (MAP_PRIVATE | MAP_ANONYMOUS)
+#endif
+
+static size_t page_round(size_t size) {
+  size_t page = ASM_PAGE_SIZE;
+  return (size + page - 1) & ~(page - 1);
+}
+
+// Makes room for n more bytes, doubling the buffer if needed. Branches are
+// patched by instruction index, so the buffer is free to move.
+// NOTE: If it can't grow the buffer is marked failed and emitting starts over
+// at its start, so every write and patch stays inside of it. Nothing in a
+// failed buffer is ever run.
+static bool asm_reserve(microasm *a, int n) {
+  if ((uint64_t)a->dest + n > a->dest_end) {
+    uint8_t *memory = (uint8_t *)(a->dest_end - a->dest_size);
+    size_t used = a->dest - memory;
+    size_t new_size = page_round(
+        a->dest_size * 2 > used + n ? a->dest_size * 2 : used + n);
+
+    // NOTE: The buffer came from mmap, so it can't be realloc'd
+#ifdef __APPLE__
+    uint8_t *new_memory =
+        mmap(NULL, new_size, ASM_MAP_PROT, ASM_MAP_FLAGS, -1, 0);
+    if (new_memory != MAP_FAILED) {
+      memcpy(new_memory, memory, used);
+      munmap(memory, a->dest_size);
+    }
+#else
+    uint8_t *new_memory =
+        mremap(memory, a->dest_size, new_size, MREMAP_MAYMOVE);
+#endif
+    if (new_memory == MAP_FAILED) {
+      a->failed = true;
+      a->dest = memory;
+      a->count = 0;
+      return (uint32_t)n <= a->dest_size;
+    }
+
+    a->dest = new_memory + used;
+    a->dest_end = (uint64_t)new_memory + new_size;
+    a->dest_size = new_size;
+  }
+  return true;
+}
+
+// Maps at least size bytes to emit code into, see code_size_estimate.
+// Returns false if the mapping fails.
+bool asm_try_init(microasm *a, size_t size) {
+  size = page_round(size > 0 ? size : 1);
+
+  uint8_t *memory = mmap(NULL, size, ASM_MAP_PROT, ASM_MAP_FLAGS, -1, 0);
+  if (memory == MAP_FAILED) {
+    return false;
+  }
+
+  *a = (microasm){.count = 0,
+                  .dest = memory,
+                  .dest_end = (uint64_t)memory + size,
+                  .dest_size = size,
+                  .failed = false};
+  return true;
+}
+
+microasm asm_init(size_t size) {
+  microasm a;
+  if (!asm_try_init(&a, size)) {
+    printf("failed to map JIT memory!\n");
+    exit(-1);
+  }
+  return a;
+}
+
+// Makes the emitted code executable and flushes the icache where it isn't
+// coherent with the dcache. Returns the start of the code, or NULL if the
+// buffer failed or can't be made executable.
+uint8_t *asm_seal(microasm *a) {
+  uint8_t *memory = (uint8_t *)(a->dest_end - a->dest_size);
+  if (a->failed) {
+    return NULL;
+  }
+
+#ifdef __APPLE__
+  sys_icache_invalidate(memory, a->dest - memory);
+#else
+  if (mprotect(memory, a->dest_size, PROT_READ | PROT_EXEC) != 0) {
+    return NULL;
+  }
+#if defined(__aarch64__)
+  __builtin___clear_cache((char *)memory, (char *)a->dest);
+#endif
+#endif
+
+  return memory;
+}
+
+// Unmaps the whole buffer, wherever growing it moved it to
+void asm_free(microasm *a) {
+  munmap((uint8_t *)(a->dest_end - a->dest_size), a->dest_size);
+  a->dest = NULL;
+  a->dest_end = 0;
+  a->dest_size = 0;
+}
+
 // https://github.com/spencertipping/jit-tutorial
 void asm_write(microasm *a, int n, ...) {
+  if (!asm_reserve(a, n)) {
+    return;
+  }
+
   va_list bytes;
   va_start(bytes, n);
   for (int i = 0; i < n; i++) {
@@ -20,24 +142,25 @@ void asm_write(microasm *a, int n, ...) {
   va_end(bytes);
 }
 
-void asm_write_32bit(microasm *a, uint32_t instruction) {
-  if ((uint64_t)a->dest == a->dest_end) {
-    printf("increasing JIT\n");
-
-    a->dest = realloc(a->dest, a->dest_size + JIT_MEM_SIZE);
-    a->dest_end = (uint64_t)a->dest + JIT_MEM_SIZE;
-    a->dest_size += JIT_MEM_SIZE;
+void asm_write_bytes(microasm *a, const uint8_t *bytes, int n) {
+  if (!asm_reserve(a, n)) {
+    return;
   }
+  memcpy(a->dest, bytes, n);
+  a->dest += n;
+}
+
+void asm_write_32bit(microasm *a, uint32_t instruction) {
   asm_write(
       a, 4, instruction & ((1 << 8) - 1), instruction >> 8 & ((1 << 8) - 1),
       instruction >> 16 & ((1 << 8) - 1), instruction >> 24 & ((1 << 8) - 1));
   a->count++;
 }
 
-void asm_arm64_immadd(microasm *a, uint8_t rd, uint8_t rn, uint8_t imm) {
+void asm_arm64_immadd(microasm *a, uint8_t rd, uint8_t rn, uint16_t imm) {
   uint32_t instruction = 0x91000000;
   instruction |= (rn << 5) | rd;
-  instruction |= (imm << 10);
+  instruction |= (imm & 0xFFF) << 10;
 
   asm_write_32bit(a, instruction);
 }
@@ -46,16 +169,57 @@ void asm_arm64_regadd(microasm *a, uint8_t rd, uint8_t rn, uint8_t rm,
                       uint8_t imm_shift) {
   uint32_t instruction = 0x8B000000;
   instruction |= (rn << 5) | rd;
-  instruction |= (imm_shift << 10) & ((1 << 5) - 1);
+  instruction |= (imm_shift & ((1 << 6) - 1)) << 10; // LSL amount
+  instruction |= (rm << 16);
+
+  asm_write_32bit(a, instruction);
+}
+
+void asm_arm64_regsub(microasm *a, uint8_t rd, uint8_t rn, uint8_t rm,
+                      uint8_t imm_shift) {
+  uint32_t instruction = 0xCB000000;
+  instruction |= (rn << 5) | rd;
+  instruction |= (imm_shift & ((1 << 6) - 1)) << 10; // LSL amount
+  instruction |= (rm << 16);
+
+  asm_write_32bit(a, instruction);
+}
+
+// rd = ra + rn * rm
+void asm_arm64_madd(microasm *a, uint8_t rd, uint8_t rn, uint8_t rm,
+                    uint8_t ra) {
+  uint32_t instruction = 0x9B000000;
+  instruction |= (rn << 5) | rd;
+  instruction |= (ra << 10);
   instruction |= (rm << 16);
 
   asm_write_32bit(a, instruction);
 }
 
-void asm_arm64_immsub(microasm *a, uint8_t rd, uint8_t rn, uint8_t imm) {
+void asm_arm64_immsub(microasm *a, uint8_t rd, uint8_t rn, uint16_t imm) {
   uint32_t instruction = 0xD1000000;
   instruction |= (rn << 5) | rd;
-  instruction |= (imm << 10);
+  instruction |= (imm & 0xFFF) << 10;
+
+  asm_write_32bit(a, instruction);
+}
+
+// add rd, rn, #(imm << 12)
+void asm_arm64_immadd_lsl12(microasm *a, uint8_t rd, uint8_t rn,
+                            uint16_t imm) {
+  uint32_t instruction = 0x91400000;
+  instruction |= (rn << 5) | rd;
+  instruction |= (imm & 0xFFF) << 10;
+
+  asm_write_32bit(a, instruction);
+}
+
+// sub rd, rn, #(imm << 12)
+void asm_arm64_immsub_lsl12(microasm *a, uint8_t rd, uint8_t rn,
+                            uint16_t imm) {
+  uint32_t instruction = 0xD1400000;
+  instruction |= (rn << 5) | rd;
+  instruction |= (imm & 0xFFF) << 10;
 
   asm_write_32bit(a, instruction);
 }
@@ -67,6 +231,24 @@ void asm_arm64_regstrb(microasm *a, uint8_t rt, uint8_t rn) {
   asm_write_32bit(a, instruction);
 }
 
+// strb wt, [rn, #imm] with 0 <= imm <= 4095
+void asm_arm64_immstrb(microasm *a, uint8_t rt, uint8_t rn, uint16_t imm) {
+  uint32_t instruction = 0x39000000;
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & 0xFFF) << 10;
+
+  asm_write_32bit(a, instruction);
+}
+
+// sturb wt, [rn, #imm] with -256 <= imm <= 255
+void asm_arm64_sturb(microasm *a, uint8_t rt, uint8_t rn, int16_t imm) {
+  uint32_t instruction = 0x38000000;
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & ((1 << 9) - 1)) << 12;
+
+  asm_write_32bit(a, instruction);
+}
+
 void asm_arm64_regstr(microasm *a, uint8_t rt, uint8_t rn) {
   uint32_t instruction = 0xF9000000;
   instruction |= (rn << 5) | rt;
@@ -81,6 +263,24 @@ void asm_arm64_regldrb(microasm *a, uint8_t rt, uint8_t rn) {
   asm_write_32bit(a, instruction);
 }
 
+// ldrb wt, [rn, #imm] with 0 <= imm <= 4095
+void asm_arm64_immldrb(microasm *a, uint8_t rt, uint8_t rn, uint16_t imm) {
+  uint32_t instruction = 0x39400000;
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & 0xFFF) << 10;
+
+  asm_write_32bit(a, instruction);
+}
+
+// ldurb wt, [rn, #imm] with -256 <= imm <= 255
+void asm_arm64_ldurb(microasm *a, uint8_t rt, uint8_t rn, int16_t imm) {
+  uint32_t instruction = 0x38400000;
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & ((1 << 9) - 1)) << 12;
+
+  asm_write_32bit(a, instruction);
+}
+
 void asm_arm64_regldr(microasm *a, uint8_t rt, uint8_t rn) {
   uint32_t instruction = 0xF9400000;
   instruction |= (rn << 5) | rt;
@@ -161,6 +361,13 @@ void asm_arm64_b(microasm *a, uint32_t imm) {
   asm_write_32bit(a, instruction);
 }
 
+void asm_arm64_bl(microasm *a, uint32_t imm) {
+  uint32_t instruction = 0x94000000;
+  instruction |= imm & ((1 << 26) - 1);
+
+  asm_write_32bit(a, instruction);
+}
+
 void asm_arm64_getpcval(microasm *a, uint8_t rd) {
   uint32_t instruction = 0x10000000;
   instruction |= rd;
@@ -168,32 +375,618 @@ void asm_arm64_getpcval(microasm *a, uint8_t rd) {
   asm_write_32bit(a, instruction);
 }
 
+// Loads any 64-bit constant with a movz followed by a movk per halfword
+void asm_arm64_immmov64(microasm *a, uint8_t rd, uint64_t imm) {
+  asm_arm64_immmov(a, rd, imm & 0xFFFF);
+
+  for (uint8_t hw = 1; hw < 4; hw++) {
+    uint16_t part = (imm >> (hw * 16)) & 0xFFFF;
+    if (part != 0) {
+      uint32_t instruction = 0xF2800000;
+      instruction |= rd & ((1 << 5) - 1);
+      instruction |= part << 5;
+      instruction |= hw << 21;
+
+      asm_write_32bit(a, instruction);
+    }
+  }
+}
+
+void asm_arm64_regand(microasm *a, uint8_t rd, uint8_t rn, uint8_t rm) {
+  uint32_t instruction = 0x8A000000;
+  instruction |= (rn << 5) | rd;
+  instruction |= (rm << 16);
+
+  asm_write_32bit(a, instruction);
+}
+
+void asm_arm64_regcmp(microasm *a, uint8_t rn, uint8_t rm) {
+  uint32_t instruction = 0xEB00001F;
+  instruction |= rn << 5;
+  instruction |= rm << 16;
+
+  asm_write_32bit(a, instruction);
+}
+
+// rd = rn >> shift
+// uxtb wd, wn: zero extends the low byte of rn into rd
+void asm_arm64_uxtb(microasm *a, uint8_t rd, uint8_t rn) {
+  uint32_t instruction = 0x53001C00;
+  instruction |= (rn << 5) | rd;
+
+  asm_write_32bit(a, instruction);
+}
+
+void asm_arm64_lsr(microasm *a, uint8_t rd, uint8_t rn, uint8_t shift) {
+  uint32_t instruction = 0xD340FC00;
+  instruction |= (rn << 5) | rd;
+  instruction |= (shift & ((1 << 6) - 1)) << 16;
+
+  asm_write_32bit(a, instruction);
+}
+
+void asm_arm64_rbit(microasm *a, uint8_t rd, uint8_t rn) {
+  uint32_t instruction = 0xDAC00000;
+  instruction |= (rn << 5) | rd;
+
+  asm_write_32bit(a, instruction);
+}
+
+void asm_arm64_clz(microasm *a, uint8_t rd, uint8_t rn) {
+  uint32_t instruction = 0xDAC01000;
+  instruction |= (rn << 5) | rd;
+
+  asm_write_32bit(a, instruction);
+}
+
+// NOTE: Jumps to imm * 4 if the condition holds
+void asm_arm64_bcond(microasm *a, uint8_t cond, uint32_t imm) {
+  uint32_t instruction = 0x54000000;
+  instruction |= cond & ((1 << 4) - 1);
+  instruction |= (imm & ((1 << 19) - 1)) << 5;
+
+  asm_write_32bit(a, instruction);
+}
+
+// Points the branch at instruction index `from` to instruction index `to`
+void asm_arm64_patch_branch(microasm *a, uint32_t from, uint32_t to) {
+  if (a->failed) {
+    return;
+  }
+  uint32_t *instruction = (uint32_t *)a->dest - (a->count - from);
+  int32_t offset = (int32_t)(to - from);
+
+  if ((*instruction & 0x7C000000) == 0x14000000) { // b, bl
+    *instruction &= ~((1 << 26) - 1);
+    *instruction |= offset & ((1 << 26) - 1);
+  } else { // cbz, cbnz, b.cond
+    *instruction &= ~(((1 << 19) - 1) << 5);
+    *instruction |= (offset & ((1 << 19) - 1)) << 5;
+  }
+}
+
+// ldrb wt, [rn, #imm]! (pre-index, rn is updated)
+void asm_arm64_ldrb_pre(microasm *a, uint8_t rt, uint8_t rn, int16_t imm) {
+  uint32_t instruction = 0x38400C00;
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & ((1 << 9) - 1)) << 12;
+
+  asm_write_32bit(a, instruction);
+}
+
+// ldrb wt, [rn], #imm
+void asm_arm64_ldrb_post(microasm *a, uint8_t rt, uint8_t rn, int16_t imm) {
+  uint32_t instruction = 0x38400400;
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & ((1 << 9) - 1)) << 12;
+
+  asm_write_32bit(a, instruction);
+}
+
+// strb wt, [rn], #imm
+void asm_arm64_strb_post(microasm *a, uint8_t rt, uint8_t rn, int16_t imm) {
+  uint32_t instruction = 0x38000400;
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & ((1 << 9) - 1)) << 12;
+
+  asm_write_32bit(a, instruction);
+}
+
+// NOTE: The _n loads and stores access size bytes (1, 2 or 4, so ldrb,
+// ldrh or a 32-bit ldr), the loads zero extend into xt. The operand size
+// sits in the top two bits of all of them.
+static uint32_t arm64_size_bits(uint8_t size) {
+  return (uint32_t)__builtin_ctz(size) << 30;
+}
+
+// ldr wt, [rn, #imm * size] with 0 <= imm <= 4095
+void asm_arm64_immldr_n(microasm *a, uint8_t size, uint8_t rt, uint8_t rn,
+                        uint16_t imm) {
+  uint32_t instruction = 0x39400000 | arm64_size_bits(size);
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & 0xFFF) << 10;
+
+  asm_write_32bit(a, instruction);
+}
+
+// str wt, [rn, #imm * size] with 0 <= imm <= 4095
+void asm_arm64_immstr_n(microasm *a, uint8_t size, uint8_t rt, uint8_t rn,
+                        uint16_t imm) {
+  uint32_t instruction = 0x39000000 | arm64_size_bits(size);
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & 0xFFF) << 10;
+
+  asm_write_32bit(a, instruction);
+}
+
+// ldur wt, [rn, #imm] with -256 <= imm <= 255, imm is in bytes
+void asm_arm64_ldur_n(microasm *a, uint8_t size, uint8_t rt, uint8_t rn,
+                      int16_t imm) {
+  uint32_t instruction = 0x38400000 | arm64_size_bits(size);
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & ((1 << 9) - 1)) << 12;
+
+  asm_write_32bit(a, instruction);
+}
+
+// stur wt, [rn, #imm] with -256 <= imm <= 255, imm is in bytes
+void asm_arm64_stur_n(microasm *a, uint8_t size, uint8_t rt, uint8_t rn,
+                      int16_t imm) {
+  uint32_t instruction = 0x38000000 | arm64_size_bits(size);
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & ((1 << 9) - 1)) << 12;
+
+  asm_write_32bit(a, instruction);
+}
+
+// ldr wt, [rn, #imm]! (pre-index, rn is updated), imm is in bytes
+void asm_arm64_ldr_pre_n(microasm *a, uint8_t size, uint8_t rt, uint8_t rn,
+                         int16_t imm) {
+  uint32_t instruction = 0x38400C00 | arm64_size_bits(size);
+  instruction |= (rn << 5) | rt;
+  instruction |= (imm & ((1 << 9) - 1)) << 12;
+
+  asm_write_32bit(a, instruction);
+}
+
+// uxtb/uxth wd, wn or mov wd, wn: zero extends the low size bytes of rn
+void asm_arm64_uxt_n(microasm *a, uint8_t size, uint8_t rd, uint8_t rn) {
+  if (size == 4) {
+    asm_write_32bit(a, 0x2A0003E0 | (rn << 16) | rd);
+    return;
+  }
+
+  uint32_t instruction = size == 2 ? 0x53003C00 : 0x53001C00;
+  instruction |= (rn << 5) | rd;
+
+  asm_write_32bit(a, instruction);
+}
+
+// ldur qt, [rn, #imm]
+void asm_arm64_ldurq(microasm *a, uint8_t qt, uint8_t rn, int16_t imm) {
+  uint32_t instruction = 0x3CC00000;
+  instruction |= (rn << 5) | qt;
+  instruction |= (imm & ((1 << 9) - 1)) << 12;
+
+  asm_write_32bit(a, instruction);
+}
+
+// cmeq vd, vn, #0 on 16 bytes of size byte elements (.16b, .8h or .4s)
+void asm_arm64_neon_cmeqz(microasm *a, uint8_t size, uint8_t vd,
+                          uint8_t vn) {
+  uint32_t instruction = 0x4E209800 | (uint32_t)__builtin_ctz(size) << 22;
+  instruction |= (vn << 5) | vd;
+
+  asm_write_32bit(a, instruction);
+}
+
+// shrn vd.8b, vn.8h, #4
+// Squeezes a 16 byte compare mask into 64 bits, 4 bits per byte
+void asm_arm64_neon_shrn4(microasm *a, uint8_t vd, uint8_t vn) {
+  uint32_t instruction = 0x0F0C8400;
+  instruction |= (vn << 5) | vd;
+
+  asm_write_32bit(a, instruction);
+}
+
+// fmov xd, dn
+void asm_arm64_fmov_to_gp(microasm *a, uint8_t rd, uint8_t vn) {
+  uint32_t instruction = 0x9E660000;
+  instruction |= (vn << 5) | rd;
+
+  asm_write_32bit(a, instruction);
+}
+
 void asm_return(microasm *a) {
   uint32_t instruction = 0xd65f03c0;
 
   asm_write_32bit(a, instruction);
 }
 
+// NOTE: `CRT` of bfjit
+// Reserves the tape as PROT_NONE, makes its usable part RW, calls the JIT
+// compiled code with cell 0 as both the current cell and the tape, then
+// unmaps the tape and exits. Out of bounds accesses hit a guard page.
+// The stubs are emitted into stub, the code follows them directly.
+#define STUB_MAP_FLAGS (0x4022) // MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE
+#define STUB_VADDR (0x400138)   // Where the stub is loaded, it's ET_EXEC
+#define STUB_SA_FLAGS (0x04000004) // SA_SIGINFO | SA_RESTORER
+#define STUB_SIGSEGV (11)
+#define STUB_GROW_SIZE (1 << 20) // Committed at a time right of cell 0
+
+static const char stub_oob_msg[] = "tape access out of bounds\n";
+static const char stub_map_msg[] = "Could not map the tape\n";
+
+// Bytes in the middle of the stub, padded to whole ARM64 instructions.
+// Returns their address in the loaded executable.
+static uint64_t emit_stub_data(microasm *stub, bool arm64, const char *data,
+                               size_t len) {
+  uint64_t addr = STUB_VADDR + (arm64 ? stub->count * 4 : stub->count);
+  uint8_t zeros[4] = {0};
+  size_t padding = (4 - len % 4) % 4;
+
+  asm_write_bytes(stub, (const uint8_t *)data, len);
+  asm_write_bytes(stub, zeros, padding);
+  stub->count += arm64 ? (len + padding) / 4 : len + padding;
+  return addr;
+}
+
+// NOTE: Only commit_size bytes of the tape are RW at the start, a strict
+// overcommit policy charges all of them. A fault on the rest of the right
+// side is found from the tape base the code keeps in x10 (r13 on x86-64),
+// the SIGSEGV handler makes the STUB_GROW_SIZE bytes around it RW and
+// returns to retry the access.
+// Any other fault kills the program, but the code still holds up to
+// OUTPUT_BUF_SIZE bytes of output. The handler finds the buffer the same
+// way the JIT's does, at the stack pointer of the fault with its write
+// position and end in x3/x4 (r15/rbx on x86-64), writes it out and exits
+// like a failed --safe check. x86-64 doesn't deliver signals to handlers
+// without a restorer, so both stubs have one.
+// A failed mmap or mprotect exits with 255 and a message like the JIT.
+static void emit_mapper_arm64(microasm *stub, asm_tape_layout *tape) {
+  asm_arm64_b(stub, 0); // Jump over the handler
+  uint32_t to_setup = stub->count - 1;
+  uint64_t msg = emit_stub_data(stub, true, stub_oob_msg,
+                                sizeof(stub_oob_msg) - 1);
+
+  uint64_t map_msg = emit_stub_data(stub, true, stub_map_msg,
+                                    sizeof(stub_map_msg) - 1);
+  uint64_t grow_max = tape->rw_size - (tape->origin_offset - tape->rw_offset);
+
+  // x0 is the signal, x1 the siginfo and x2 the ucontext. The fault's
+  // registers are in uc_mcontext at 176: regs at +8, sp at +256. si_addr is
+  // at 16 in the siginfo.
+  uint64_t handler = STUB_VADDR + stub->count * 4;
+  asm_arm64_regmov(stub, 19, 1);
+  asm_arm64_regmov(stub, 20, 2);
+  asm_arm64_immldr_n(stub, 8, 9, 2, 264 / 8); // x10, the tape
+  asm_arm64_immmov64(stub, 11, tape->origin_offset - tape->tape_offset);
+  asm_arm64_regadd(stub, 9, 9, 11, 0);
+  asm_arm64_immldr_n(stub, 8, 11, 1, 16 / 8);
+  asm_arm64_regsub(stub, 11, 11, 9, 0); // Offset from cell 0
+  asm_arm64_immmov64(stub, 12, grow_max);
+  asm_arm64_regcmp(stub, 11, 12);
+  uint32_t to_flush = stub->count;
+  asm_arm64_bcond(stub, ARM64_COND_HS, 0);
+  asm_arm64_immmov64(stub, 12, ~(uint64_t)(STUB_GROW_SIZE - 1));
+  asm_arm64_regand(stub, 11, 11, 12);
+  asm_arm64_immmov(stub, 8, 226); // mprotect
+  asm_arm64_regadd(stub, 0, 9, 11, 0);
+  asm_arm64_immmov64(stub, 1, STUB_GROW_SIZE);
+  asm_arm64_immmov(stub, 2, 3); // PROT_READ | PROT_WRITE
+  asm_arm64_syscall(stub, 0);
+  asm_arm64_pcrelbranch_nz(stub, 0, 2);
+  asm_return(stub); // x30 is the restorer
+  asm_arm64_patch_branch(stub, to_flush, stub->count);
+  asm_arm64_regmov(stub, 1, 19);
+  asm_arm64_regmov(stub, 2, 20);
+
+  asm_arm64_immldr_n(stub, 8, 1, 2, 432 / 8);  // Start of the buffer
+  asm_arm64_immldr_n(stub, 8, 10, 2, 208 / 8); // Write position
+  asm_arm64_immldr_n(stub, 8, 11, 2, 216 / 8); // End of the buffer
+  asm_arm64_immadd_lsl12(stub, 9, 1, OUTPUT_BUF_SIZE >> 12);
+  asm_arm64_regcmp(stub, 9, 11);
+  uint32_t to_msg_frame = stub->count;
+  asm_arm64_bcond(stub, ARM64_COND_NE, 0);
+  asm_arm64_regcmp(stub, 10, 1);
+  uint32_t to_msg_empty = stub->count;
+  asm_arm64_bcond(stub, ARM64_COND_LS, 0);
+  asm_arm64_regsub(stub, 2, 10, 1, 0);
+
+  uint32_t write = stub->count;
+  asm_arm64_immmov(stub, 8, 64); // write
+  asm_arm64_immadd_lsl12(stub, 0, 11, INPUT_BUF_SIZE >> 12);
+  asm_arm64_ldur_n(stub, 4, 0, 0, IO_OUT_FD_OFFSET - INPUT_BUF_SIZE);
+  asm_arm64_syscall(stub, 0);
+  asm_arm64_immcmp(stub, 0, 0);
+  uint32_t to_msg_error = stub->count;
+  asm_arm64_bcond(stub, ARM64_COND_LE, 0);
+  asm_arm64_regadd(stub, 1, 1, 0, 0);
+  asm_arm64_regsub(stub, 2, 2, 0, 0);
+  asm_arm64_pcrelbranch_nz(stub, 2, 0);
+  asm_arm64_patch_branch(stub, stub->count - 1, write);
+
+  asm_arm64_patch_branch(stub, to_msg_frame, stub->count);
+  asm_arm64_patch_branch(stub, to_msg_empty, stub->count);
+  asm_arm64_patch_branch(stub, to_msg_error, stub->count);
+  asm_arm64_immmov64(stub, 1, msg);
+  asm_arm64_immmov(stub, 8, 64); // write
+  asm_arm64_immmov(stub, 0, 2);
+  asm_arm64_immmov(stub, 2, sizeof(stub_oob_msg) - 1);
+  asm_arm64_syscall(stub, 0);
+  asm_arm64_immmov(stub, 8, 94); // exit_group
+  asm_arm64_immmov(stub, 0, 255);
+  asm_arm64_syscall(stub, 0);
+
+  uint64_t restorer = STUB_VADDR + stub->count * 4;
+  asm_arm64_immmov(stub, 8, 139); // rt_sigreturn
+  asm_arm64_syscall(stub, 0);
+
+  uint32_t map_failed = stub->count;
+  asm_arm64_immmov64(stub, 1, map_msg);
+  asm_arm64_immmov(stub, 8, 64); // write
+  asm_arm64_immmov(stub, 0, 2);
+  asm_arm64_immmov(stub, 2, sizeof(stub_map_msg) - 1);
+  asm_arm64_syscall(stub, 0);
+  asm_arm64_immmov(stub, 8, 94); // exit_group
+  asm_arm64_immmov(stub, 0, 255);
+  asm_arm64_syscall(stub, 0);
+
+  // rt_sigaction(SIGSEGV, &act, NULL, 8), act is built on the stack
+  asm_arm64_patch_branch(stub, to_setup, stub->count);
+  asm_arm64_immsub(stub, 31, 31, 32);
+  asm_arm64_immmov64(stub, 9, handler);
+  asm_arm64_immstr_n(stub, 8, 9, 31, 0);
+  asm_arm64_immmov64(stub, 9, STUB_SA_FLAGS);
+  asm_arm64_immstr_n(stub, 8, 9, 31, 1);
+  asm_arm64_immmov64(stub, 9, restorer);
+  asm_arm64_immstr_n(stub, 8, 9, 31, 2);
+  asm_arm64_immstr_n(stub, 8, 31, 31, 3); // Empty sa_mask, xzr
+  asm_arm64_immmov(stub, 8, 134); // rt_sigaction
+  asm_arm64_immmov(stub, 0, STUB_SIGSEGV);
+  asm_arm64_immadd(stub, 1, 31, 0);
+  asm_arm64_immmov(stub, 2, 0);
+  asm_arm64_immmov(stub, 3, 8);
+  asm_arm64_syscall(stub, 0);
+  asm_arm64_immadd(stub, 31, 31, 32);
+
+  asm_arm64_immmov(stub, 8, 222); // mmap
+  asm_arm64_immmov(stub, 0, 0);
+  asm_arm64_immmov64(stub, 1, tape->map_size);
+  asm_arm64_immmov(stub, 2, 0); // PROT_NONE
+  asm_arm64_immmov64(stub, 3, STUB_MAP_FLAGS);
+  asm_arm64_immmov64(stub, 4, (uint64_t)-1);
+  asm_arm64_immmov(stub, 5, 0);
+  asm_arm64_syscall(stub, 0);
+  asm_arm64_immmov64(stub, 9, (uint64_t)-4095); // -errno
+  asm_arm64_regcmp(stub, 0, 9);
+  asm_arm64_bcond(stub, ARM64_COND_HS, 0);
+  asm_arm64_patch_branch(stub, stub->count - 1, map_failed);
+  asm_arm64_regmov(stub, 19, 0); // Callee saved, kept for the munmap
+
+  asm_arm64_immmov(stub, 8, 226); // mprotect
+  asm_arm64_immmov64(stub, 9, tape->rw_offset);
+  asm_arm64_regadd(stub, 0, 19, 9, 0);
+  asm_arm64_immmov64(stub, 1, tape->commit_size);
+  asm_arm64_immmov(stub, 2, 3); // PROT_READ | PROT_WRITE
+  asm_arm64_syscall(stub, 0);
+  asm_arm64_pcrelbranch_nz(stub, 0, 0);
+  asm_arm64_patch_branch(stub, stub->count - 1, map_failed);
+
+  asm_arm64_immmov64(stub, 9, tape->origin_offset);
+  asm_arm64_regadd(stub, 0, 19, 9, 0);
+  asm_arm64_immmov64(stub, 9, tape->tape_offset);
+  asm_arm64_regadd(stub, 1, 19, 9, 0);
+  asm_arm64_immmov64(stub, 9, tape->end_offset);
+  asm_arm64_regadd(stub, 2, 19, 9, 0);
+  asm_arm64_immmov64(stub, 3, (uint64_t)1 << 32); // stdin and stdout
+  asm_arm64_bl(stub, 0);
+  uint32_t call = stub->count - 1;
+
+  // NULL is a failed --safe check, exit like the JIT's exit(-1)
+  asm_arm64_immmov(stub, 20, 255);
+  asm_arm64_pcrelbranch_ze(stub, 0, 2);
+  asm_arm64_immmov(stub, 20, 0);
+
+  asm_arm64_regmov(stub, 0, 19);
+  asm_arm64_immmov64(stub, 1, tape->map_size);
+  asm_arm64_immmov(stub, 8, 215); // munmap
+  asm_arm64_syscall(stub, 0);
+  asm_arm64_immmov(stub, 8, 93); // exit
+  asm_arm64_regmov(stub, 0, 20);
+  asm_arm64_syscall(stub, 0);
+
+  asm_arm64_patch_branch(stub, call, stub->count);
+}
+
+// Same as above, the tape is kept in rbx and the exit status in r12 (callee
+// saved)
+static void emit_mapper_x86_64(microasm *stub, asm_tape_layout *tape) {
+  asm_x86_jmp(stub, 0); // Jump over the handler
+  uint32_t to_setup = stub->count;
+  uint64_t msg = emit_stub_data(stub, false, stub_oob_msg,
+                                sizeof(stub_oob_msg) - 1);
+
+  uint64_t map_msg = emit_stub_data(stub, false, stub_map_msg,
+                                    sizeof(stub_map_msg) - 1);
+  uint64_t grow_max = tape->rw_size - (tape->origin_offset - tape->rw_offset);
+
+  // rdi is the signal, rsi the siginfo and rdx the ucontext. The fault's
+  // registers are in uc_mcontext.gregs at 40: r13 at 80, r15 at 96, rbx at
+  // 128 and rsp at 160. si_addr is at 16 in the siginfo.
+  uint64_t handler = STUB_VADDR + stub->count;
+  asm_x86_regmov(stub, X86_R12, X86_RSI);
+  asm_x86_regmov(stub, X86_R14, X86_RDX);
+  asm_x86_load_n(stub, 8, X86_R8, X86_RDX, 80); // r13, the tape
+  asm_x86_immmov(stub, X86_RAX, tape->origin_offset - tape->tape_offset);
+  asm_x86_regadd(stub, X86_R8, X86_RAX);
+  asm_x86_load_n(stub, 8, X86_R11, X86_RSI, 16);
+  asm_x86_regsub(stub, X86_R11, X86_R8); // Offset from cell 0
+  asm_x86_immmov(stub, X86_RAX, grow_max);
+  asm_x86_regcmp(stub, X86_R11, X86_RAX);
+  asm_x86_jcc(stub, X86_COND_AE, 0);
+  uint32_t to_flush = stub->count;
+  // The offset is below 4GB, the 32 bit and also clears the top half
+  asm_x86_and32_imm(stub, X86_R11, ~(uint32_t)(STUB_GROW_SIZE - 1));
+  asm_x86_immmov(stub, X86_RAX, 10); // mprotect
+  asm_x86_regmov(stub, X86_RDI, X86_R8);
+  asm_x86_regadd(stub, X86_RDI, X86_R11);
+  asm_x86_immmov(stub, X86_RSI, STUB_GROW_SIZE);
+  asm_x86_immmov(stub, X86_RDX, 3); // PROT_READ | PROT_WRITE
+  asm_x86_syscall(stub);
+  asm_x86_immcmp(stub, X86_RAX, 0);
+  asm_x86_jcc(stub, X86_COND_NE, 0);
+  uint32_t to_failed = stub->count;
+  asm_x86_ret(stub); // To the restorer
+  asm_x86_patch_rel32(stub, to_flush, stub->count);
+  asm_x86_patch_rel32(stub, to_failed, stub->count);
+  asm_x86_regmov(stub, X86_RSI, X86_R12);
+  asm_x86_regmov(stub, X86_RDX, X86_R14);
+
+  asm_x86_load_n(stub, 8, X86_RSI, X86_RDX, 160); // Start of the buffer
+  asm_x86_load_n(stub, 8, X86_R8, X86_RDX, 96);   // Write position
+  asm_x86_load_n(stub, 8, X86_R9, X86_RDX, 128);  // End of the buffer
+  asm_x86_lea(stub, X86_RAX, X86_RSI, OUTPUT_BUF_SIZE);
+  asm_x86_regcmp(stub, X86_RAX, X86_R9);
+  asm_x86_jcc(stub, X86_COND_NE, 0);
+  uint32_t to_msg_frame = stub->count;
+  asm_x86_regmov(stub, X86_RDX, X86_R8);
+  asm_x86_regsub(stub, X86_RDX, X86_RSI);
+  asm_x86_jcc(stub, X86_COND_BE, 0);
+  uint32_t to_msg_empty = stub->count;
+
+  uint32_t write = stub->count;
+  asm_x86_immmov(stub, X86_RAX, 1); // write
+  asm_x86_load_n(stub, 4, X86_RDI, X86_R9, IO_OUT_FD_OFFSET);
+  asm_x86_syscall(stub);
+  asm_x86_immcmp(stub, X86_RAX, 0);
+  asm_x86_jcc(stub, X86_COND_LE, 0);
+  uint32_t to_msg_error = stub->count;
+  asm_x86_regadd(stub, X86_RSI, X86_RAX);
+  asm_x86_regsub(stub, X86_RDX, X86_RAX);
+  asm_x86_jcc(stub, X86_COND_NE, write);
+
+  asm_x86_patch_rel32(stub, to_msg_frame, stub->count);
+  asm_x86_patch_rel32(stub, to_msg_empty, stub->count);
+  asm_x86_patch_rel32(stub, to_msg_error, stub->count);
+  asm_x86_immmov(stub, X86_RAX, 1); // write
+  asm_x86_immmov(stub, X86_RDI, 2);
+  asm_x86_immmov(stub, X86_RSI, msg);
+  asm_x86_immmov(stub, X86_RDX, sizeof(stub_oob_msg) - 1);
+  asm_x86_syscall(stub);
+  asm_x86_immmov(stub, X86_RAX, 231); // exit_group
+  asm_x86_immmov(stub, X86_RDI, 255);
+  asm_x86_syscall(stub);
+
+  uint64_t restorer = STUB_VADDR + stub->count;
+  asm_x86_immmov(stub, X86_RAX, 15); // rt_sigreturn
+  asm_x86_syscall(stub);
+
+  uint32_t map_failed = stub->count;
+  asm_x86_immmov(stub, X86_RAX, 1); // write
+  asm_x86_immmov(stub, X86_RDI, 2);
+  asm_x86_immmov(stub, X86_RSI, map_msg);
+  asm_x86_immmov(stub, X86_RDX, sizeof(stub_map_msg) - 1);
+  asm_x86_syscall(stub);
+  asm_x86_immmov(stub, X86_RAX, 231); // exit_group
+  asm_x86_immmov(stub, X86_RDI, 255);
+  asm_x86_syscall(stub);
+
+  // rt_sigaction(SIGSEGV, &act, NULL, 8), act is pushed in reverse
+  asm_x86_patch_rel32(stub, to_setup, stub->count);
+  asm_x86_immmov(stub, X86_RAX, 0); // Empty sa_mask
+  asm_x86_push(stub, X86_RAX);
+  asm_x86_immmov(stub, X86_RAX, restorer);
+  asm_x86_push(stub, X86_RAX);
+  asm_x86_immmov(stub, X86_RAX, STUB_SA_FLAGS);
+  asm_x86_push(stub, X86_RAX);
+  asm_x86_immmov(stub, X86_RAX, handler);
+  asm_x86_push(stub, X86_RAX);
+  asm_x86_immmov(stub, X86_RAX, 13); // rt_sigaction
+  asm_x86_immmov(stub, X86_RDI, STUB_SIGSEGV);
+  asm_x86_regmov(stub, X86_RSI, X86_RSP);
+  asm_x86_immmov(stub, X86_RDX, 0);
+  asm_x86_immmov(stub, X86_R10, 8);
+  asm_x86_syscall(stub);
+  asm_x86_immadd(stub, X86_RSP, 32);
+
+  asm_x86_immmov(stub, X86_RAX, 9); // mmap
+  asm_x86_immmov(stub, X86_RDI, 0);
+  asm_x86_immmov(stub, X86_RSI, tape->map_size);
+  asm_x86_immmov(stub, X86_RDX, 0); // PROT_NONE
+  asm_x86_immmov(stub, X86_R10, STUB_MAP_FLAGS);
+  asm_x86_immmov(stub, X86_R8, (uint64_t)-1);
+  asm_x86_immmov(stub, X86_R9, 0);
+  asm_x86_syscall(stub);
+  asm_x86_immcmp(stub, X86_RAX, -4095); // -errno
+  asm_x86_jcc(stub, X86_COND_AE, map_failed);
+  asm_x86_regmov(stub, X86_RBX, X86_RAX);
+
+  asm_x86_immmov(stub, X86_RAX, 10); // mprotect
+  asm_x86_immmov(stub, X86_RDI, tape->rw_offset);
+  asm_x86_regadd(stub, X86_RDI, X86_RBX);
+  asm_x86_immmov(stub, X86_RSI, tape->commit_size);
+  asm_x86_immmov(stub, X86_RDX, 3); // PROT_READ | PROT_WRITE
+  asm_x86_syscall(stub);
+  asm_x86_immcmp(stub, X86_RAX, 0);
+  asm_x86_jcc(stub, X86_COND_NE, map_failed);
+
+  asm_x86_immmov(stub, X86_RDI, tape->origin_offset);
+  asm_x86_regadd(stub, X86_RDI, X86_RBX);
+  asm_x86_immmov(stub, X86_RSI, tape->tape_offset);
+  asm_x86_regadd(stub, X86_RSI, X86_RBX);
+  asm_x86_immmov(stub, X86_RDX, tape->end_offset);
+  asm_x86_regadd(stub, X86_RDX, X86_RBX);
+  asm_x86_immmov(stub, X86_RCX, (uint64_t)1 << 32); // stdin and stdout
+  asm_x86_call(stub, 0);
+  uint32_t call = stub->count;
+
+  asm_x86_immmov(stub, X86_R12, 0);
+  asm_x86_immcmp(stub, X86_RAX, 0);
+  asm_x86_jcc(stub, X86_COND_NE, 0);
+  uint32_t to_ok = stub->count;
+  asm_x86_immmov(stub, X86_R12, 255);
+  asm_x86_patch_rel32(stub, to_ok, stub->count);
+
+  asm_x86_regmov(stub, X86_RDI, X86_RBX);
+  asm_x86_immmov(stub, X86_RSI, tape->map_size);
+  asm_x86_immmov(stub, X86_RAX, 11); // munmap
+  asm_x86_syscall(stub);
+  asm_x86_immmov(stub, X86_RAX, 60); // exit
+  asm_x86_regmov(stub, X86_RDI, X86_R12);
+  asm_x86_syscall(stub);
+
+  asm_x86_patch_rel32(stub, call, stub->count);
+}
+
 // This man is the goat: https://www.youtube.com/watch?v=JM9jX2aqkog
-void asm_write_exec(char *filename, microasm *bin) {
-  // NOTE: `CRT` of bfjit
-  // Allocates the Brainf*ck array and jumps to the JIT compiled code
-  // Gracefully returns on successful execution
-  const uint8_t mapper_bin[] = {
-      0xc8, 0x1b, 0x80, 0xd2, 0x00, 0x00, 0x80, 0xd2, 0x01, 0xa6, 0x8e, 0xd2,
-      0x62, 0x00, 0x80, 0xd2, 0x43, 0x04, 0x80, 0xd2, 0x04, 0x00, 0x80, 0x92,
-      0x05, 0x00, 0x80, 0xd2, 0x01, 0x00, 0x00, 0xd4, 0x06, 0x00, 0x00, 0x94,
-      0xe8, 0x1a, 0x80, 0xd2, 0x01, 0x00, 0x00, 0xd4, 0xa8, 0x0b, 0x80, 0xd2,
-      0x00, 0x00, 0x80, 0xd2, 0x01, 0x00, 0x00, 0xd4};
-
-  const size_t prog_len = sizeof(mapper_bin) + (bin->count * 4);
+// machine is EM_AARCH64 or EM_X86_64, and picks the startup stub
+void asm_write_exec(char *filename, microasm *bin, uint16_t machine,
+                    asm_tape_layout tape) {
+  microasm stub = asm_init(0);
+  size_t code_len = bin->count * 4;
+
+  if (machine == EM_X86_64) {
+    emit_mapper_x86_64(&stub, &tape);
+    code_len = bin->count; // count is in bytes on x86-64
+  } else if (machine == EM_AARCH64) {
+    emit_mapper_arm64(&stub, &tape);
+  } else {
+    printf("unsupported ELF machine: %u\n", machine);
+    exit(-1);
+  }
+
+  const uint8_t *mapper_bin = (uint8_t *)(stub.dest_end - stub.dest_size);
+  const size_t mapper_len = stub.dest - mapper_bin;
+  const size_t prog_len = mapper_len + code_len;
 
   Elf64_Ehdr elf_header = {.e_ident = {ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3,
                                        ELFCLASS64, ELFDATA2LSB, EV_CURRENT,
                                        ELFOSABI_SYSV, 0, 0, 0, 0, 0, 0, 0, 0},
                            .e_type = ET_EXEC,
-                           .e_machine = EM_AARCH64,
-                           .e_entry = 0x400138,
+                           .e_machine = machine,
+                           .e_version = EV_CURRENT,
+                           .e_entry = STUB_VADDR,
                            .e_phoff = 64,
                            .e_shoff = 64 + 56,
                            .e_flags = 0,
@@ -206,8 +999,8 @@ void asm_write_exec(char *filename, microasm *bin) {
 
   Elf64_Phdr elf_phdr = {.p_type = PT_LOAD,
                          .p_offset = 0x138,
-                         .p_vaddr = 0x400138,
-                         .p_paddr = 0x400138,
+                         .p_vaddr = STUB_VADDR,
+                         .p_paddr = STUB_VADDR,
                          .p_filesz = prog_len,
                          .p_memsz = prog_len,
                          .p_flags = PF_X | PF_R,
@@ -230,7 +1023,7 @@ void asm_write_exec(char *filename, microasm *bin) {
       .sh_name = 7,
       .sh_type = SHT_PROGBITS,
       .sh_flags = SHF_ALLOC | SHF_EXECINSTR,
-      .sh_addr = 0x400138,
+      .sh_addr = STUB_VADDR,
       .sh_offset = 0x000138,
       .sh_size = prog_len,
       .sh_link = 0,
@@ -264,10 +1057,11 @@ void asm_write_exec(char *filename, microasm *bin) {
   fwrite(&elf_shdr_null, 1, sizeof(elf_shdr_null), f);
   fwrite(&elf_shdr_text, 1, sizeof(elf_shdr_text), f);
   fwrite(&elf_shdr_shstrtab, 1, sizeof(elf_shdr_shstrtab), f);
-  fwrite(mapper_bin, 1, sizeof(mapper_bin), f);
-  fwrite(bin->dest - bin->count * 4, 1, bin->count * 4, f);
+  fwrite(mapper_bin, 1, mapper_len, f);
+  fwrite(bin->dest - code_len, 1, code_len, f);
   fwrite(shstrtab, 1, sizeof(shstrtab), f);
 
   chmod(filename, S_IRUSR | S_IWUSR | S_IXUSR);
   fclose(f);
+  asm_free(&stub);
 }
@@ -0,0 +1,430 @@
+#include "x86asm.h"
+#include <stdbool.h>
+#include <string.h>
+
+#define X86_NO_PREFIX (0)
+
+static void x86_emit(microasm *a, const uint8_t *bytes, int n) {
+  asm_write_bytes(a, bytes, n);
+  a->count += n;
+}
+
+// spl, bpl, sil and dil can only be encoded with a REX prefix
+static bool x86_needs_byte_rex(uint8_t r) { return r >= 4 && r <= 7; }
+
+static int x86_rex(uint8_t *p, bool w, uint8_t reg, uint8_t rm, bool force) {
+  uint8_t rex = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | ((rm >> 3) & 1);
+  if (rex == 0x40 && !force) {
+    return 0;
+  }
+
+  *p = rex;
+  return 1;
+}
+
+// ModRM, SIB and displacement for [base + disp]
+static int x86_modrm_mem(uint8_t *p, uint8_t reg, uint8_t base,
+                         int32_t disp) {
+  int n = 0;
+  uint8_t mod = 2;
+  if (disp == 0 && (base & 7) != X86_RBP) { // rbp/r13 always need a disp
+    mod = 0;
+  } else if (disp >= -128 && disp <= 127) {
+    mod = 1;
+  }
+
+  p[n++] = (mod << 6) | ((reg & 7) << 3) | (base & 7);
+  if ((base & 7) == X86_RSP) { // rsp/r12 as a base need a SIB
+    p[n++] = 0x24;
+  }
+
+  if (mod == 1) {
+    p[n++] = (uint8_t)disp;
+  } else if (mod == 2) {
+    memcpy(p + n, &disp, 4);
+    n += 4;
+  }
+
+  return n;
+}
+
+static void x86_op_mem(microasm *a, uint8_t prefix, bool w, bool force_rex,
+                       const uint8_t *op, int op_len, uint8_t reg,
+                       uint8_t base, int32_t disp, const uint8_t *imm,
+                       int imm_len) {
+  uint8_t buf[32];
+  int n = 0;
+
+  if (prefix != X86_NO_PREFIX) {
+    buf[n++] = prefix;
+  }
+  n += x86_rex(buf + n, w, reg, base, force_rex);
+  memcpy(buf + n, op, op_len);
+  n += op_len;
+  n += x86_modrm_mem(buf + n, reg, base, disp);
+  memcpy(buf + n, imm, imm_len);
+  n += imm_len;
+
+  x86_emit(a, buf, n);
+}
+
+static void x86_op_reg(microasm *a, uint8_t prefix, bool w, bool force_rex,
+                       const uint8_t *op, int op_len, uint8_t reg, uint8_t rm,
+                       const uint8_t *imm, int imm_len) {
+  uint8_t buf[32];
+  int n = 0;
+
+  if (prefix != X86_NO_PREFIX) {
+    buf[n++] = prefix;
+  }
+  n += x86_rex(buf + n, w, reg, rm, force_rex);
+  memcpy(buf + n, op, op_len);
+  n += op_len;
+  buf[n++] = 0xC0 | ((reg & 7) << 3) | (rm & 7);
+  memcpy(buf + n, imm, imm_len);
+  n += imm_len;
+
+  x86_emit(a, buf, n);
+}
+
+// op r/m64, imm8 or imm32, the ALU group is selected with ext
+static void x86_alu_imm(microasm *a, uint8_t ext, uint8_t r, int32_t imm) {
+  if (imm >= -128 && imm <= 127) {
+    uint8_t imm8 = (uint8_t)imm;
+    x86_op_reg(a, X86_NO_PREFIX, true, false, (uint8_t[]){0x83}, 1, ext, r,
+               &imm8, 1);
+  } else {
+    x86_op_reg(a, X86_NO_PREFIX, true, false, (uint8_t[]){0x81}, 1, ext, r,
+               (uint8_t *)&imm, 4);
+  }
+}
+
+void asm_x86_push(microasm *a, uint8_t r) {
+  if (r >= 8) {
+    x86_emit(a, (uint8_t[]){0x41, 0x50 + (r & 7)}, 2);
+  } else {
+    x86_emit(a, (uint8_t[]){0x50 + r}, 1);
+  }
+}
+
+void asm_x86_pop(microasm *a, uint8_t r) {
+  if (r >= 8) {
+    x86_emit(a, (uint8_t[]){0x41, 0x58 + (r & 7)}, 2);
+  } else {
+    x86_emit(a, (uint8_t[]){0x58 + r}, 1);
+  }
+}
+
+void asm_x86_ret(microasm *a) { x86_emit(a, (uint8_t[]){0xC3}, 1); }
+
+void asm_x86_syscall(microasm *a) { x86_emit(a, (uint8_t[]){0x0F, 0x05}, 2); }
+
+// mov dst, src
+void asm_x86_regmov(microasm *a, uint8_t dst, uint8_t src) {
+  x86_op_reg(a, X86_NO_PREFIX, true, false, (uint8_t[]){0x89}, 1, src, dst,
+             NULL, 0);
+}
+
+// mov dst, imm, as a 32-bit move when it zero extends to the same value
+void asm_x86_immmov(microasm *a, uint8_t dst, uint64_t imm) {
+  uint8_t buf[10];
+  int n = 0;
+
+  if (imm <= UINT32_MAX) {
+    n += x86_rex(buf, false, 0, dst, false);
+    buf[n++] = 0xB8 + (dst & 7);
+    uint32_t imm32 = (uint32_t)imm;
+    memcpy(buf + n, &imm32, 4);
+    n += 4;
+  } else {
+    n += x86_rex(buf, true, 0, dst, false);
+    buf[n++] = 0xB8 + (dst & 7);
+    memcpy(buf + n, &imm, 8);
+    n += 8;
+  }
+
+  x86_emit(a, buf, n);
+}
+
+// add dst, src
+void asm_x86_regadd(microasm *a, uint8_t dst, uint8_t src) {
+  x86_op_reg(a, X86_NO_PREFIX, true, false, (uint8_t[]){0x01}, 1, src, dst,
+             NULL, 0);
+}
+
+// sub dst, src
+void asm_x86_regsub(microasm *a, uint8_t dst, uint8_t src) {
+  x86_op_reg(a, X86_NO_PREFIX, true, false, (uint8_t[]){0x29}, 1, src, dst,
+             NULL, 0);
+}
+
+// cmp lhs, rhs
+void asm_x86_regcmp(microasm *a, uint8_t lhs, uint8_t rhs) {
+  x86_op_reg(a, X86_NO_PREFIX, true, false, (uint8_t[]){0x39}, 1, rhs, lhs,
+             NULL, 0);
+}
+
+void asm_x86_immadd(microasm *a, uint8_t dst, int32_t imm) {
+  x86_alu_imm(a, 0, dst, imm);
+}
+
+void asm_x86_immsub(microasm *a, uint8_t dst, int32_t imm) {
+  x86_alu_imm(a, 5, dst, imm);
+}
+
+void asm_x86_immcmp(microasm *a, uint8_t r, int32_t imm) {
+  x86_alu_imm(a, 7, r, imm);
+}
+
+// lea dst, [base + disp]
+void asm_x86_lea(microasm *a, uint8_t dst, uint8_t base, int32_t disp) {
+  x86_op_mem(a, X86_NO_PREFIX, true, false, (uint8_t[]){0x8D}, 1, dst, base,
+             disp, NULL, 0);
+}
+
+// movzx dst32, byte [base + disp]
+void asm_x86_movzx8_load(microasm *a, uint8_t dst, uint8_t base,
+                         int32_t disp) {
+  x86_op_mem(a, X86_NO_PREFIX, false, false, (uint8_t[]){0x0F, 0xB6}, 2, dst,
+             base, disp, NULL, 0);
+}
+
+// movzx dst32, src8
+void asm_x86_movzx8_reg(microasm *a, uint8_t dst, uint8_t src) {
+  x86_op_reg(a, X86_NO_PREFIX, false, x86_needs_byte_rex(src),
+             (uint8_t[]){0x0F, 0xB6}, 2, dst, src, NULL, 0);
+}
+
+// mov byte [base + disp], src8
+void asm_x86_store8(microasm *a, uint8_t src, uint8_t base, int32_t disp) {
+  x86_op_mem(a, X86_NO_PREFIX, false, x86_needs_byte_rex(src),
+             (uint8_t[]){0x88}, 1, src, base, disp, NULL, 0);
+}
+
+// mov byte [base + disp], imm
+void asm_x86_store8_imm(microasm *a, uint8_t base, int32_t disp,
+                        uint8_t imm) {
+  x86_op_mem(a, X86_NO_PREFIX, false, false, (uint8_t[]){0xC6}, 1, 0, base,
+             disp, &imm, 1);
+}
+
+// add r8, imm
+void asm_x86_add8_imm(microasm *a, uint8_t r, uint8_t imm) {
+  x86_op_reg(a, X86_NO_PREFIX, false, x86_needs_byte_rex(r),
+             (uint8_t[]){0x80}, 1, 0, r, &imm, 1);
+}
+
+// sub r8, imm
+void asm_x86_sub8_imm(microasm *a, uint8_t r, uint8_t imm) {
+  x86_op_reg(a, X86_NO_PREFIX, false, x86_needs_byte_rex(r),
+             (uint8_t[]){0x80}, 1, 5, r, &imm, 1);
+}
+
+// add byte [base + disp], src8
+void asm_x86_add8_mem(microasm *a, uint8_t base, int32_t disp, uint8_t src) {
+  x86_op_mem(a, X86_NO_PREFIX, false, x86_needs_byte_rex(src),
+             (uint8_t[]){0x00}, 1, src, base, disp, NULL, 0);
+}
+
+// sub byte [base + disp], src8
+void asm_x86_sub8_mem(microasm *a, uint8_t base, int32_t disp, uint8_t src) {
+  x86_op_mem(a, X86_NO_PREFIX, false, x86_needs_byte_rex(src),
+             (uint8_t[]){0x28}, 1, src, base, disp, NULL, 0);
+}
+
+// cmp byte [base + disp], imm
+void asm_x86_cmp8_mem_imm(microasm *a, uint8_t base, int32_t disp,
+                          uint8_t imm) {
+  x86_op_mem(a, X86_NO_PREFIX, false, false, (uint8_t[]){0x80}, 1, 7, base,
+             disp, &imm, 1);
+}
+
+// test r1_8, r2_8
+void asm_x86_test8(microasm *a, uint8_t r1, uint8_t r2) {
+  x86_op_reg(a, X86_NO_PREFIX, false,
+             x86_needs_byte_rex(r1) || x86_needs_byte_rex(r2),
+             (uint8_t[]){0x84}, 1, r2, r1, NULL, 0);
+}
+
+// NOTE: The _n variants work on size byte operands (1, 2 or 4). 2 bytes is
+// the 32-bit form with an operand size prefix.
+static uint8_t x86_size_prefix(uint8_t size) {
+  return size == 2 ? 0x66 : X86_NO_PREFIX;
+}
+
+// movzx dst32, [base + disp], or mov for 4 and 8 bytes
+void asm_x86_load_n(microasm *a, uint8_t size, uint8_t dst, uint8_t base,
+                    int32_t disp) {
+  if (size >= 4) {
+    x86_op_mem(a, X86_NO_PREFIX, size == 8, false, (uint8_t[]){0x8B}, 1, dst,
+               base, disp, NULL, 0);
+    return;
+  }
+  x86_op_mem(a, X86_NO_PREFIX, false, false,
+             (uint8_t[]){0x0F, size == 2 ? 0xB7 : 0xB6}, 2, dst, base, disp,
+             NULL, 0);
+}
+
+// mov [base + disp], src, size can also be 8
+void asm_x86_store_n(microasm *a, uint8_t size, uint8_t src, uint8_t base,
+                     int32_t disp) {
+  if (size == 1) {
+    asm_x86_store8(a, src, base, disp);
+    return;
+  }
+  x86_op_mem(a, x86_size_prefix(size), size == 8, false, (uint8_t[]){0x89}, 1,
+             src, base, disp, NULL, 0);
+}
+
+// mov [base + disp], imm
+void asm_x86_store_imm_n(microasm *a, uint8_t size, uint8_t base,
+                         int32_t disp, uint32_t imm) {
+  if (size == 1) {
+    asm_x86_store8_imm(a, base, disp, (uint8_t)imm);
+    return;
+  }
+  x86_op_mem(a, x86_size_prefix(size), false, false, (uint8_t[]){0xC7}, 1, 0,
+             base, disp, (uint8_t *)&imm, size);
+}
+
+// add [base + disp], src
+void asm_x86_add_mem_n(microasm *a, uint8_t size, uint8_t base, int32_t disp,
+                       uint8_t src) {
+  if (size == 1) {
+    asm_x86_add8_mem(a, base, disp, src);
+    return;
+  }
+  x86_op_mem(a, x86_size_prefix(size), false, false, (uint8_t[]){0x01}, 1,
+             src, base, disp, NULL, 0);
+}
+
+// sub [base + disp], src
+void asm_x86_sub_mem_n(microasm *a, uint8_t size, uint8_t base, int32_t disp,
+                       uint8_t src) {
+  if (size == 1) {
+    asm_x86_sub8_mem(a, base, disp, src);
+    return;
+  }
+  x86_op_mem(a, x86_size_prefix(size), false, false, (uint8_t[]){0x29}, 1,
+             src, base, disp, NULL, 0);
+}
+
+// cmp [base + disp], imm
+void asm_x86_cmp_mem_imm_n(microasm *a, uint8_t size, uint8_t base,
+                           int32_t disp, int8_t imm) {
+  if (size == 1) {
+    asm_x86_cmp8_mem_imm(a, base, disp, (uint8_t)imm);
+    return;
+  }
+  x86_op_mem(a, x86_size_prefix(size), false, false, (uint8_t[]){0x83}, 1, 7,
+             base, disp, (uint8_t *)&imm, 1);
+}
+
+// add qword [base + disp], imm
+void asm_x86_add_mem64_imm(microasm *a, uint8_t base, int32_t disp,
+                           int8_t imm) {
+  x86_op_mem(a, X86_NO_PREFIX, true, false, (uint8_t[]){0x83}, 1, 0, base,
+             disp, (uint8_t *)&imm, 1);
+}
+
+// test r1, r2
+void asm_x86_test_n(microasm *a, uint8_t size, uint8_t r1, uint8_t r2) {
+  if (size == 1) {
+    asm_x86_test8(a, r1, r2);
+    return;
+  }
+  x86_op_reg(a, x86_size_prefix(size), false, false, (uint8_t[]){0x85}, 1,
+             r2, r1, NULL, 0);
+}
+
+// imul dst32, src32, imm
+void asm_x86_imul32_imm(microasm *a, uint8_t dst, uint8_t src, int32_t imm) {
+  x86_op_reg(a, X86_NO_PREFIX, false, false, (uint8_t[]){0x69}, 1, dst, src,
+             (uint8_t *)&imm, 4);
+}
+
+// and r32, imm
+void asm_x86_and32_imm(microasm *a, uint8_t r, uint32_t imm) {
+  x86_op_reg(a, X86_NO_PREFIX, false, false, (uint8_t[]){0x81}, 1, 4, r,
+             (uint8_t *)&imm, 4);
+}
+
+// test r1_32, r2_32
+void asm_x86_test32(microasm *a, uint8_t r1, uint8_t r2) {
+  x86_op_reg(a, X86_NO_PREFIX, false, false, (uint8_t[]){0x85}, 1, r2, r1,
+             NULL, 0);
+}
+
+// bsf dst32, src32: index of the lowest set bit
+void asm_x86_bsf32(microasm *a, uint8_t dst, uint8_t src) {
+  x86_op_reg(a, X86_NO_PREFIX, false, false, (uint8_t[]){0x0F, 0xBC}, 2, dst,
+             src, NULL, 0);
+}
+
+// bsr dst32, src32: index of the highest set bit
+void asm_x86_bsr32(microasm *a, uint8_t dst, uint8_t src) {
+  x86_op_reg(a, X86_NO_PREFIX, false, false, (uint8_t[]){0x0F, 0xBD}, 2, dst,
+             src, NULL, 0);
+}
+
+// movdqu xmm, [base + disp]
+void asm_x86_movdqu_load(microasm *a, uint8_t xmm, uint8_t base,
+                         int32_t disp) {
+  x86_op_mem(a, 0xF3, false, false, (uint8_t[]){0x0F, 0x6F}, 2, xmm, base,
+             disp, NULL, 0);
+}
+
+void asm_x86_pxor(microasm *a, uint8_t dst, uint8_t src) {
+  x86_op_reg(a, 0x66, false, false, (uint8_t[]){0x0F, 0xEF}, 2, dst, src,
+             NULL, 0);
+}
+
+void asm_x86_pcmpeqb(microasm *a, uint8_t dst, uint8_t src) {
+  x86_op_reg(a, 0x66, false, false, (uint8_t[]){0x0F, 0x74}, 2, dst, src,
+             NULL, 0);
+}
+
+// pcmpeqb, pcmpeqw or pcmpeqd on size byte elements
+void asm_x86_pcmpeq_n(microasm *a, uint8_t size, uint8_t dst, uint8_t src) {
+  uint8_t op = size == 4 ? 0x76 : size == 2 ? 0x75 : 0x74;
+  x86_op_reg(a, 0x66, false, false, (uint8_t[]){0x0F, op}, 2, dst, src, NULL,
+             0);
+}
+
+// pmovmskb dst32, xmm: the top bit of every byte
+void asm_x86_pmovmskb(microasm *a, uint8_t dst, uint8_t xmm) {
+  x86_op_reg(a, 0x66, false, false, (uint8_t[]){0x0F, 0xD7}, 2, dst, xmm,
+             NULL, 0);
+}
+
+static void x86_rel32(microasm *a, const uint8_t *op, int op_len,
+                      uint32_t to) {
+  uint8_t buf[6];
+  memcpy(buf, op, op_len);
+  int32_t rel = (int32_t)(to - (a->count + op_len + 4));
+  memcpy(buf + op_len, &rel, 4);
+
+  x86_emit(a, buf, op_len + 4);
+}
+
+void asm_x86_jmp(microasm *a, uint32_t to) {
+  x86_rel32(a, (uint8_t[]){0xE9}, 1, to);
+}
+
+void asm_x86_jcc(microasm *a, uint8_t cond, uint32_t to) {
+  x86_rel32(a, (uint8_t[]){0x0F, 0x80 + cond}, 2, to);
+}
+
+void asm_x86_call(microasm *a, uint32_t to) {
+  x86_rel32(a, (uint8_t[]){0xE8}, 1, to);
+}
+
+// from is the offset just past the jmp/jcc/call to patch
+void asm_x86_patch_rel32(microasm *a, uint32_t from, uint32_t to) {
+  if (a->failed) {
+    return;
+  }
+  uint8_t *end = a->dest - (a->count - from);
+  int32_t rel = (int32_t)(to - from);
+  memcpy(end - 4, &rel, 4);
+}